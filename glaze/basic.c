@@ -5,6 +5,11 @@
 #include <math.h>
 #include <string.h>
 
+// Build with -mavx2 for the batched vertex path in renderfunc.c
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
 typedef unsigned int IUINT32;
 
 // vector and matrices definitions
@@ -37,11 +42,82 @@ typedef struct {
     IUINT32* framebuffer;
     int width;
     int height;
+
+    // Points waiting to be written, binned by framebuffer tile
+    IUINT32* point_offsets; // Pixel index of each point
+    IUINT32* point_tiles;   // Tile of each point
+    IUINT32* point_sorted;  // Pixel indices in tile order
+    int point_capacity;
+    int* tile_starts;       // tile_count + 1 counters for the sort
+    int tiles_x;
+    int tile_count;
 } device_t;
 
-// Shape definition
-typedef struct shape_t {
-    vertex_t* vertices;
+#define SHAPE_SIZE_CLASSES 32
+#define SHAPE_NO_SLOT 0xffffffffu
+
+// Vertices are stored in chunks of up to 1 << SHAPE_CHUNK_SHIFT
+#define SHAPE_CHUNK_SHIFT 10
+#define SHAPE_CHUNK_VERTICES (1 << SHAPE_CHUNK_SHIFT)
+
+// Storage carved into power of two blocks of stride bytes elements, each
+// size recycled through its own free list
+typedef struct {
+    char* data;
+    int stride;
+    int used;
+    int capacity;
+    int free_blocks[SHAPE_SIZE_CLASSES];    // Head of each size's free list, -1 if empty
+} block_arena_t;
+
+// Chunks are shared by shapes and undo snapshots, and copied before a write
+// while more than one of them holds it
+typedef struct {
+    int first_vertex;   // Block offset in the vertex arena
+    int size_class;
+    int refs;           // Holders, or the next free chunk once released
+} shape_chunk_t;
+
+// Shape definition: vertex i lives in chunk i >> SHAPE_CHUNK_SHIFT
+typedef struct {
+    int chunk_table;    // Block offset of the chunk ids in the table arena
+    int table_class;
+    int chunk_count;
     int vertex_count;
-    struct shape_t* next;
+    int dirty_first;    // Vertices [dirty_first, dirty_end) changed since shape_clean
+    int dirty_end;
 } shape_t;
+
+// Stays valid until the shape is removed, then never matches again
+typedef struct {
+    IUINT32 index;
+    IUINT32 generation;
+} shape_handle_t;
+
+// A shape's vertices at some point, sharing chunks with the shape until
+// either side writes
+typedef struct {
+    int* chunks;
+    int chunk_count;
+    int vertex_count;
+} shape_snapshot_t;
+
+// Shapes are kept packed in shapes[0, count) for iteration. Handles point
+// at a slot, and the slot knows where its shape currently sits
+typedef struct {
+    shape_t* shapes;
+    IUINT32* owners;        // Slot of each packed shape
+    IUINT32* slot_dense;    // Packed position of each slot, or the next free slot
+    IUINT32* slot_generation;
+    int count;
+    int capacity;
+    int slot_count;
+    IUINT32 free_slot;      // Head of the free slot list, SHAPE_NO_SLOT if empty
+
+    block_arena_t vertices; // Chunk contents
+    block_arena_t tables;   // Chunk ids of each shape
+    shape_chunk_t* chunks;
+    int chunk_count;
+    int chunk_capacity;
+    int free_chunk;         // Head of the free chunk list, -1 if empty
+} shape_pool_t;
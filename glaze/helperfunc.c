@@ -41,3 +41,22 @@ void transform_update(transform_t *ts) {
     matrix_mul(&m, &ts->world, &ts->view);
     matrix_mul(&ts->transform, &m, &ts->projection);
 }
+
+void transform_apply(const transform_t *ts, vector_t *y, const vector_t *x) {
+    matrix_apply(y, x, &ts->transform);
+}
+
+// Nonzero when the clip space point is outside the view volume. Written so
+// NaN fails every test, and an infinite w is rejected too
+int transform_check_cvv(const vector_t *v) {
+    float w = v->w;
+    int check = 0;
+    if (!(v->z >= 0.0f)) check |= 1;
+    if (!(v->z <= w)) check |= 2;
+    if (!(v->x >= -w)) check |= 4;
+    if (!(v->x <= w)) check |= 8;
+    if (!(v->y >= -w)) check |= 16;
+    if (!(v->y <= w)) check |= 32;
+    if (!(w > 0.0f) || isinf(w)) check |= 64;
+    return check;
+}
@@ -12,19 +12,21 @@ int main() {
         {{ 0.5f, -0.5f, 0.0f, 1.0f}, {0.0f, 1.0f, 0.0f}, {1.0f, 0.0f}},
         {{ 0.0f,  0.5f, 0.0f, 1.0f}, {0.0f, 0.0f, 1.0f}, {0.5f, 1.0f}}
     };
-    shape_t* shapes = NULL;
-    shape_t* triangle = create_shape(vertices, 3);
-    add_shape(&shapes, triangle);
+    shape_pool_t shapes;
+    shape_pool_init(&shapes);
+    shape_handle_t triangle = create_shape(&shapes, vertices, 3);
 
     // Complete transformations
     transform_t transform;
     transform_update(&transform);
 
     // Render loop
-    render(&device, &transform, shapes);
+    render(&device, &transform, &shapes);
 
     // Clear cache
     remove_shape(&shapes, triangle);
+    shape_pool_destroy(&shapes);
+    device_destroy(&device);
     free(framebuffer);
     return 0;
 }
@@ -1,32 +1,193 @@
 //! It is enough to use I think
 
+// Points are written one framebuffer tile at a time, so each tile's rows
+// stay in cache while its points land
+#define TILE_SHIFT 5
+
 void device_init(device_t* device, int width, int height, void* fb) {
+    memset(device, 0, sizeof(device_t));
     device->framebuffer = (IUINT32*)fb;
     device->width = width;
     device->height = height;
+    device->tiles_x = (width + (1 << TILE_SHIFT) - 1) >> TILE_SHIFT;
+    device->tile_count = device->tiles_x * ((height + (1 << TILE_SHIFT) - 1) >> TILE_SHIFT);
+    device->tile_starts = (int*)malloc(sizeof(int) * (device->tile_count + 1));
     memset(fb, 0, width * height * 4);
 }
 
+void device_destroy(device_t* device) {
+    free(device->point_offsets);
+    free(device->point_tiles);
+    free(device->point_sorted);
+    free(device->tile_starts);
+}
+
 void device_pixel(device_t* device, int x, int y, IUINT32 color) {
     if (x >= 0 && x < device->width && y >= 0 && y < device->height) {
         device->framebuffer[y * device->width + x] = color;
     }
 }
 
-void draw_shape(device_t* device, const transform_t* transform, const shape_t* shape) {
-    for (int i = 0; i < shape->vertex_count; i++) {
-        vector_t screen_pos;
-        transform_apply(transform, &screen_pos, &shape->vertices[i].pos);
-        int x = (int)((screen_pos.x + 1.0f) * 0.5f * device->width);
-        int y = (int)((1.0f - screen_pos.y) * 0.5f * device->height);
-        device_pixel(device, x, y, 0xFFFFFF);
+static void device_reserve_points(device_t* device, int count) {
+    if (count <= device->point_capacity) return;
+    device->point_offsets = (IUINT32*)realloc(device->point_offsets, sizeof(IUINT32) * count);
+    device->point_tiles = (IUINT32*)realloc(device->point_tiles, sizeof(IUINT32) * count);
+    device->point_sorted = (IUINT32*)realloc(device->point_sorted, sizeof(IUINT32) * count);
+    device->point_capacity = count;
+}
+
+// Clip test and viewport mapping for one vertex. Appends the visible ones
+// after the first n points and returns the new count
+static int transform_points_scalar(device_t* device, const transform_t* transform, const vertex_t* vertices, int vertex_count, int n) {
+    for (int i = 0; i < vertex_count; i++) {
+        vector_t clip;
+        transform_apply(transform, &clip, &vertices[i].pos);
+        if (transform_check_cvv(&clip) != 0) continue;
+
+        float rhw = 1.0f / clip.w;
+        int x = (int)((clip.x * rhw + 1.0f) * 0.5f * device->width);
+        int y = (int)((1.0f - clip.y * rhw) * 0.5f * device->height);
+        if (x < 0) x = 0;
+        if (y < 0) y = 0;
+        if (x > device->width - 1) x = device->width - 1;
+        if (y > device->height - 1) y = device->height - 1;
+
+        device->point_offsets[n] = (IUINT32)(y * device->width + x);
+        device->point_tiles[n++] = (IUINT32)((y >> TILE_SHIFT) * device->tiles_x + (x >> TILE_SHIFT));
+    }
+    return n;
+}
+
+#ifdef __AVX2__
+// Loads 8 vertex positions and transposes them so lane i holds vertex i
+static void load_positions(const vertex_t* v, __m256* x, __m256* y, __m256* z, __m256* w) {
+    __m256 r0 = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(&v[0].pos.x)), _mm_loadu_ps(&v[4].pos.x), 1);
+    __m256 r1 = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(&v[1].pos.x)), _mm_loadu_ps(&v[5].pos.x), 1);
+    __m256 r2 = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(&v[2].pos.x)), _mm_loadu_ps(&v[6].pos.x), 1);
+    __m256 r3 = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(&v[3].pos.x)), _mm_loadu_ps(&v[7].pos.x), 1);
+    __m256 t0 = _mm256_unpacklo_ps(r0, r1);
+    __m256 t1 = _mm256_unpackhi_ps(r0, r1);
+    __m256 t2 = _mm256_unpacklo_ps(r2, r3);
+    __m256 t3 = _mm256_unpackhi_ps(r2, r3);
+    *x = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(1, 0, 1, 0));
+    *y = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(3, 2, 3, 2));
+    *z = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(1, 0, 1, 0));
+    *w = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(3, 2, 3, 2));
+}
+
+// For each movemask, the lanes that are set in order, then the rest. Lanes
+// are bytes so the table stays at 2KB
+static unsigned char compact_lanes[256][8];
+
+static void compact_lanes_init(void) {
+    for (int mask = 0; mask < 256; mask++) {
+        int k = 0;
+        for (int lane = 0; lane < 8; lane++) if (mask & (1 << lane)) compact_lanes[mask][k++] = (unsigned char)lane;
+        for (int lane = 0; lane < 8; lane++) if (!(mask & (1 << lane))) compact_lanes[mask][k++] = (unsigned char)lane;
     }
 }
 
-void render(device_t* device, const transform_t* transform, const shape_t* shapes) {
-    shape_t* shape = (shape_t*)shapes;
-    while (shape) {
-        draw_shape(device, transform, shape);
-        shape = shape->next;
+// Same math as transform_points_scalar in the same order, 8 vertices at a
+// time. All 8 results are stored with the visible ones packed to the front
+// and n advances past those only, so the stores never branch per lane. The
+// stores stay within the reservation, since n never passes i
+static int transform_points_avx2(device_t* device, const transform_t* transform, const vertex_t* vertices, int vertex_count, int n) {
+    const matrix_t* m = &transform->transform;
+    __m256 m00 = _mm256_set1_ps(m->m[0][0]), m01 = _mm256_set1_ps(m->m[0][1]), m02 = _mm256_set1_ps(m->m[0][2]), m03 = _mm256_set1_ps(m->m[0][3]);
+    __m256 m10 = _mm256_set1_ps(m->m[1][0]), m11 = _mm256_set1_ps(m->m[1][1]), m12 = _mm256_set1_ps(m->m[1][2]), m13 = _mm256_set1_ps(m->m[1][3]);
+    __m256 m20 = _mm256_set1_ps(m->m[2][0]), m21 = _mm256_set1_ps(m->m[2][1]), m22 = _mm256_set1_ps(m->m[2][2]), m23 = _mm256_set1_ps(m->m[2][3]);
+    __m256 m30 = _mm256_set1_ps(m->m[3][0]), m31 = _mm256_set1_ps(m->m[3][1]), m32 = _mm256_set1_ps(m->m[3][2]), m33 = _mm256_set1_ps(m->m[3][3]);
+    __m256 zero = _mm256_setzero_ps(), one = _mm256_set1_ps(1.0f), half = _mm256_set1_ps(0.5f), infinity = _mm256_set1_ps(INFINITY);
+    __m256 width = _mm256_set1_ps((float)device->width), height = _mm256_set1_ps((float)device->height);
+    __m256i zero_i = _mm256_setzero_si256(), max_x = _mm256_set1_epi32(device->width - 1), max_y = _mm256_set1_epi32(device->height - 1);
+    __m256i pitch = _mm256_set1_epi32(device->width), tiles_x = _mm256_set1_epi32(device->tiles_x);
+    static int compact_ready;
+    if (!compact_ready) {
+        compact_lanes_init();
+        compact_ready = 1;
+    }
+
+    int i = 0;
+    for (; i + 8 <= vertex_count; i += 8) {
+        __m256 X, Y, Z, W;
+        load_positions(vertices + i, &X, &Y, &Z, &W);
+        __m256 cx = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(X, m00), _mm256_mul_ps(Y, m10)), _mm256_mul_ps(Z, m20)), _mm256_mul_ps(W, m30));
+        __m256 cy = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(X, m01), _mm256_mul_ps(Y, m11)), _mm256_mul_ps(Z, m21)), _mm256_mul_ps(W, m31));
+        __m256 cz = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(X, m02), _mm256_mul_ps(Y, m12)), _mm256_mul_ps(Z, m22)), _mm256_mul_ps(W, m32));
+        __m256 cw = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(X, m03), _mm256_mul_ps(Y, m13)), _mm256_mul_ps(Z, m23)), _mm256_mul_ps(W, m33));
+
+        // Inside when 0 <= z <= w and -w <= x, y <= w with w > 0 and finite.
+        // Ordered compares fail on NaN, like transform_check_cvv
+        __m256 neg_w = _mm256_sub_ps(zero, cw);
+        __m256 inside = _mm256_and_ps(_mm256_cmp_ps(cw, zero, _CMP_GT_OQ), _mm256_cmp_ps(cw, infinity, _CMP_LT_OQ));
+        inside = _mm256_and_ps(inside, _mm256_cmp_ps(cz, zero, _CMP_GE_OQ));
+        inside = _mm256_and_ps(inside, _mm256_cmp_ps(cz, cw, _CMP_LE_OQ));
+        inside = _mm256_and_ps(inside, _mm256_and_ps(_mm256_cmp_ps(cx, neg_w, _CMP_GE_OQ), _mm256_cmp_ps(cx, cw, _CMP_LE_OQ)));
+        inside = _mm256_and_ps(inside, _mm256_and_ps(_mm256_cmp_ps(cy, neg_w, _CMP_GE_OQ), _mm256_cmp_ps(cy, cw, _CMP_LE_OQ)));
+        int mask = _mm256_movemask_ps(inside);
+        if (!mask) continue;
+
+        __m256 rhw = _mm256_div_ps(one, cw);
+        __m256i x = _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_mul_ps(_mm256_add_ps(_mm256_mul_ps(cx, rhw), one), half), width));
+        __m256i y = _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_mul_ps(_mm256_sub_ps(one, _mm256_mul_ps(cy, rhw)), half), height));
+        x = _mm256_max_epi32(_mm256_min_epi32(x, max_x), zero_i);
+        y = _mm256_max_epi32(_mm256_min_epi32(y, max_y), zero_i);
+        __m256i offsets = _mm256_add_epi32(_mm256_mullo_epi32(y, pitch), x);
+        __m256i tiles = _mm256_add_epi32(_mm256_mullo_epi32(_mm256_srli_epi32(y, TILE_SHIFT), tiles_x), _mm256_srli_epi32(x, TILE_SHIFT));
+
+        __m256i lanes = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)compact_lanes[mask]));
+        _mm256_storeu_si256((__m256i*)(device->point_offsets + n), _mm256_permutevar8x32_epi32(offsets, lanes));
+        _mm256_storeu_si256((__m256i*)(device->point_tiles + n), _mm256_permutevar8x32_epi32(tiles, lanes));
+        n += __builtin_popcount(mask);
+    }
+    return transform_points_scalar(device, transform, vertices + i, vertex_count - i, n);
+}
+#define transform_points transform_points_avx2
+#else
+#define transform_points transform_points_scalar
+#endif
+
+// Counting sort of the points by tile, then one pass of writes
+static void device_write_points(device_t* device, int n, IUINT32 color) {
+    int* starts = device->tile_starts;
+    memset(starts, 0, sizeof(int) * (device->tile_count + 1));
+    for (int i = 0; i < n; i++) {
+        starts[device->point_tiles[i] + 1]++;
+    }
+    for (int t = 0; t < device->tile_count; t++) {
+        starts[t + 1] += starts[t];
+    }
+    for (int i = 0; i < n; i++) {
+        device->point_sorted[starts[device->point_tiles[i]]++] = device->point_offsets[i];
+    }
+    for (int i = 0; i < n; i++) {
+        device->framebuffer[device->point_sorted[i]] = color;
+    }
+}
+
+void draw_shape(device_t* device, const transform_t* transform, const vertex_t* vertices, int vertex_count) {
+    device_reserve_points(device, vertex_count);
+    int n = transform_points(device, transform, vertices, vertex_count, 0);
+    device_write_points(device, n, 0xFFFFFF);
+}
+
+// Transforms every shape into one batch of points before writing any, so
+// the tile sort covers the whole frame
+void render(device_t* device, const transform_t* transform, const shape_pool_t* pool) {
+    int total = 0;
+    for (int i = 0; i < pool->count; i++) {
+        total += pool->shapes[i].vertex_count;
+    }
+    device_reserve_points(device, total);
+
+    int n = 0;
+    for (int i = 0; i < pool->count; i++) {
+        const shape_t* shape = &pool->shapes[i];
+        for (int c = 0; c < shape->chunk_count; c++) {
+            int vertex_count;
+            const vertex_t* vertices = shape_chunk_vertices(pool, shape, c, &vertex_count);
+            n = transform_points(device, transform, vertices, vertex_count, n);
+        }
     }
+    device_write_points(device, n, 0xFFFFFF);
 }
@@ -1,39 +1,304 @@
 //! It is enough to use I think
 
-shape_t* create_shape(vertex_t* vertices, int vertex_count) {
-    shape_t* shape = (shape_t*)malloc(sizeof(shape_t));
-    shape->vertices = (vertex_t*)malloc(sizeof(vertex_t) * vertex_count);
-    memcpy(shape->vertices, vertices, sizeof(vertex_t) * vertex_count);
-    shape->vertex_count = vertex_count;
-    shape->next = NULL;
-    return shape;
+// Shapes live in a pool instead of a list of separate allocations. Records
+// stay packed so render walks one array and handles find them in O(1).
+// Vertices sit in fixed size chunks that shapes and undo snapshots share,
+// so an edit copies at most the chunks it touches and leaves a dirty range
+// behind for whatever mirrors the vertices.
+
+static void block_arena_init(block_arena_t* arena, int stride) {
+    memset(arena, 0, sizeof(block_arena_t));
+    arena->stride = stride;
+    for (int i = 0; i < SHAPE_SIZE_CLASSES; i++) {
+        arena->free_blocks[i] = -1;
+    }
+}
+
+static int block_size_class(int count) {
+    int size_class = 0;
+    while ((1 << size_class) < count) size_class++;
+    return size_class;
+}
+
+static void* block_data(const block_arena_t* arena, int offset) {
+    return arena->data + (size_t)offset * arena->stride;
+}
+
+// A free block keeps the offset of the next free block in its first element
+static int block_alloc(block_arena_t* arena, int size_class) {
+    int offset = arena->free_blocks[size_class];
+    if (offset >= 0) {
+        memcpy(&arena->free_blocks[size_class], block_data(arena, offset), sizeof(int));
+        return offset;
+    }
+
+    int size = 1 << size_class;
+    if (arena->used + size > arena->capacity) {
+        int capacity = arena->capacity ? arena->capacity * 2 : 4096;
+        while (capacity < arena->used + size) capacity *= 2;
+        arena->data = (char*)realloc(arena->data, (size_t)arena->stride * capacity);
+        arena->capacity = capacity;
+    }
+    offset = arena->used;
+    arena->used += size;
+    return offset;
+}
+
+static void block_free(block_arena_t* arena, int offset, int size_class) {
+    memcpy(block_data(arena, offset), &arena->free_blocks[size_class], sizeof(int));
+    arena->free_blocks[size_class] = offset;
+}
+
+void shape_pool_init(shape_pool_t* pool) {
+    memset(pool, 0, sizeof(shape_pool_t));
+    pool->free_slot = SHAPE_NO_SLOT;
+    pool->free_chunk = -1;
+    block_arena_init(&pool->vertices, sizeof(vertex_t));
+    block_arena_init(&pool->tables, sizeof(int));
 }
 
-void add_shape(shape_t** shapes, shape_t* new_shape) {
-    new_shape->next = *shapes;
-    *shapes = new_shape;
+void shape_pool_destroy(shape_pool_t* pool) {
+    free(pool->shapes);
+    free(pool->owners);
+    free(pool->slot_dense);
+    free(pool->slot_generation);
+    free(pool->vertices.data);
+    free(pool->tables.data);
+    free(pool->chunks);
+    shape_pool_init(pool);
 }
 
-void remove_shape(shape_t** shapes, shape_t* shape) {
-    if (*shapes == shape) {
-        *shapes = shape->next;
+static int chunk_alloc(shape_pool_t* pool, int vertex_count) {
+    int chunk = pool->free_chunk;
+    if (chunk >= 0) {
+        pool->free_chunk = pool->chunks[chunk].refs;
     } else {
-        shape_t* prev = *shapes;
-        while (prev->next && prev->next != shape) {
-            prev = prev->next;
-        }
-        if (prev->next == shape) {
-            prev->next = shape->next;
+        if (pool->chunk_count == pool->chunk_capacity) {
+            pool->chunk_capacity = pool->chunk_capacity ? pool->chunk_capacity * 2 : 64;
+            pool->chunks = (shape_chunk_t*)realloc(pool->chunks, sizeof(shape_chunk_t) * pool->chunk_capacity);
         }
+        chunk = pool->chunk_count++;
     }
-    free(shape->vertices);
-    free(shape);
+
+    int size_class = block_size_class(vertex_count);
+    int first_vertex = block_alloc(&pool->vertices, size_class);
+    pool->chunks[chunk] = (shape_chunk_t){ first_vertex, size_class, 1 };
+    return chunk;
+}
+
+static void chunk_release(shape_pool_t* pool, int chunk) {
+    shape_chunk_t* c = &pool->chunks[chunk];
+    if (--c->refs > 0) return;
+    block_free(&pool->vertices, c->first_vertex, c->size_class);
+    c->refs = pool->free_chunk;
+    pool->free_chunk = chunk;
 }
 
-//TODO Edit all of particules or faces of the shape
-void edit_shape(shape_t* shape, vertex_t* new_vertices, int vertex_count) {
-    free(shape->vertices);
-    shape->vertices = (vertex_t*)malloc(sizeof(vertex_t) * vertex_count);
-    memcpy(shape->vertices, new_vertices, sizeof(vertex_t) * vertex_count);
+static int* shape_chunks(const shape_pool_t* pool, const shape_t* shape) {
+    return (int*)block_data(&pool->tables, shape->chunk_table);
+}
+
+static int chunk_vertex_count(int vertex_count, int chunk) {
+    int left = vertex_count - (chunk << SHAPE_CHUNK_SHIFT);
+    return left < SHAPE_CHUNK_VERTICES ? left : SHAPE_CHUNK_VERTICES;
+}
+
+// Vertices of one chunk of the shape, and how many of them it uses
+const vertex_t* shape_chunk_vertices(const shape_pool_t* pool, const shape_t* shape, int chunk, int* vertex_count) {
+    *vertex_count = chunk_vertex_count(shape->vertex_count, chunk);
+    return (const vertex_t*)block_data(&pool->vertices, pool->chunks[shape_chunks(pool, shape)[chunk]].first_vertex);
+}
+
+// Copies the chunk first when a snapshot still holds it
+static vertex_t* shape_chunk_write(shape_pool_t* pool, shape_t* shape, int chunk) {
+    int* chunks = shape_chunks(pool, shape);
+    int id = chunks[chunk];
+    if (pool->chunks[id].refs > 1) {
+        int copy = chunk_alloc(pool, 1 << pool->chunks[id].size_class);
+        memcpy(block_data(&pool->vertices, pool->chunks[copy].first_vertex),
+               block_data(&pool->vertices, pool->chunks[id].first_vertex),
+               sizeof(vertex_t) * chunk_vertex_count(shape->vertex_count, chunk));
+        pool->chunks[id].refs--;
+        chunks[chunk] = id = copy;
+    }
+    return (vertex_t*)block_data(&pool->vertices, pool->chunks[id].first_vertex);
+}
+
+static void shape_mark_dirty(shape_t* shape, int first, int end) {
+    if (shape->dirty_first == shape->dirty_end) {
+        shape->dirty_first = first;
+        shape->dirty_end = end;
+    } else {
+        if (first < shape->dirty_first) shape->dirty_first = first;
+        if (end > shape->dirty_end) shape->dirty_end = end;
+    }
+}
+
+// Call once the dirty range has been picked up
+void shape_clean(shape_t* shape) {
+    shape->dirty_first = shape->dirty_end = 0;
+}
+
+static void shape_fill(shape_pool_t* pool, shape_t* shape, const vertex_t* vertices, int vertex_count) {
     shape->vertex_count = vertex_count;
+    shape->chunk_count = (vertex_count + SHAPE_CHUNK_VERTICES - 1) >> SHAPE_CHUNK_SHIFT;
+    shape->table_class = block_size_class(shape->chunk_count);
+    shape->chunk_table = block_alloc(&pool->tables, shape->table_class);
+    for (int c = 0; c < shape->chunk_count; c++) {
+        int count = chunk_vertex_count(vertex_count, c);
+        int id = chunk_alloc(pool, count);
+        shape_chunks(pool, shape)[c] = id;
+        memcpy(block_data(&pool->vertices, pool->chunks[id].first_vertex), vertices + (c << SHAPE_CHUNK_SHIFT), sizeof(vertex_t) * count);
+    }
+    shape->dirty_first = 0;
+    shape->dirty_end = vertex_count;
+}
+
+static void shape_release(shape_pool_t* pool, shape_t* shape) {
+    int* chunks = shape_chunks(pool, shape);
+    for (int c = 0; c < shape->chunk_count; c++) {
+        chunk_release(pool, chunks[c]);
+    }
+    block_free(&pool->tables, shape->chunk_table, shape->table_class);
+}
+
+// Returns NULL once the shape has been removed
+shape_t* get_shape(shape_pool_t* pool, shape_handle_t handle) {
+    if (handle.index >= (IUINT32)pool->slot_count || pool->slot_generation[handle.index] != handle.generation) {
+        return NULL;
+    }
+    return &pool->shapes[pool->slot_dense[handle.index]];
+}
+
+shape_handle_t create_shape(shape_pool_t* pool, const vertex_t* vertices, int vertex_count) {
+    // Every slot is in use whenever a new one is made, so slots never
+    // outnumber the packed capacity
+    if (pool->count == pool->capacity) {
+        int capacity = pool->capacity ? pool->capacity * 2 : 64;
+        pool->shapes = (shape_t*)realloc(pool->shapes, sizeof(shape_t) * capacity);
+        pool->owners = (IUINT32*)realloc(pool->owners, sizeof(IUINT32) * capacity);
+        pool->slot_dense = (IUINT32*)realloc(pool->slot_dense, sizeof(IUINT32) * capacity);
+        pool->slot_generation = (IUINT32*)realloc(pool->slot_generation, sizeof(IUINT32) * capacity);
+        pool->capacity = capacity;
+    }
+
+    IUINT32 slot = pool->free_slot;
+    if (slot != SHAPE_NO_SLOT) {
+        pool->free_slot = pool->slot_dense[slot];
+    } else {
+        slot = (IUINT32)pool->slot_count++;
+        pool->slot_generation[slot] = 1;
+    }
+
+    shape_fill(pool, &pool->shapes[pool->count], vertices, vertex_count);
+    pool->owners[pool->count] = slot;
+    pool->slot_dense[slot] = (IUINT32)pool->count++;
+    return (shape_handle_t){ slot, pool->slot_generation[slot] };
+}
+
+// The last packed shape moves into the hole. Returns -1 for a stale handle
+int remove_shape(shape_pool_t* pool, shape_handle_t handle) {
+    shape_t* shape = get_shape(pool, handle);
+    if (!shape) return -1;
+
+    IUINT32 dense = pool->slot_dense[handle.index];
+    IUINT32 last = (IUINT32)--pool->count;
+    shape_release(pool, shape);
+    if (dense != last) {
+        pool->shapes[dense] = pool->shapes[last];
+        pool->owners[dense] = pool->owners[last];
+        pool->slot_dense[pool->owners[dense]] = dense;
+    }
+
+    if (++pool->slot_generation[handle.index] == 0) pool->slot_generation[handle.index] = 1;
+    pool->slot_dense[handle.index] = pool->free_slot;
+    pool->free_slot = handle.index;
+    return 0;
+}
+
+// Replaces every vertex, and the count with them. new_vertices must not
+// point into the pool
+int edit_shape(shape_pool_t* pool, shape_handle_t handle, const vertex_t* new_vertices, int vertex_count) {
+    shape_t* shape = get_shape(pool, handle);
+    if (!shape) return -1;
+
+    shape_release(pool, shape);
+    shape_fill(pool, shape, new_vertices, vertex_count);
+    return 0;
+}
+
+// Overwrites vertices [first, first + count) and copies only the shared
+// chunks in that range. Returns -1 for a stale handle or a range outside
+// the shape. vertices must not point into the pool: copying a shared chunk
+// can reallocate pool->vertices.data and leave it dangling
+int edit_vertices(shape_pool_t* pool, shape_handle_t handle, int first, const vertex_t* vertices, int count) {
+    shape_t* shape = get_shape(pool, handle);
+    if (!shape || first < 0 || count < 0 || first > shape->vertex_count - count) return -1;
+
+    for (int i = first; i < first + count;) {
+        int offset = i & (SHAPE_CHUNK_VERTICES - 1);
+        int n = SHAPE_CHUNK_VERTICES - offset;
+        if (n > first + count - i) n = first + count - i;
+        memcpy(shape_chunk_write(pool, shape, i >> SHAPE_CHUNK_SHIFT) + offset, vertices + (i - first), sizeof(vertex_t) * n);
+        i += n;
+    }
+    if (count > 0) shape_mark_dirty(shape, first, first + count);
+    return 0;
+}
+
+// Holds the shape's chunks without copying any vertices
+int shape_snapshot(shape_pool_t* pool, shape_handle_t handle, shape_snapshot_t* snapshot) {
+    shape_t* shape = get_shape(pool, handle);
+    if (!shape) return -1;
+
+    int* chunks = shape_chunks(pool, shape);
+    snapshot->chunk_count = shape->chunk_count;
+    snapshot->vertex_count = shape->vertex_count;
+    snapshot->chunks = (int*)malloc(sizeof(int) * (shape->chunk_count + 1));
+    for (int c = 0; c < shape->chunk_count; c++) {
+        snapshot->chunks[c] = chunks[c];
+        pool->chunks[chunks[c]].refs++;
+    }
+    return 0;
+}
+
+// Puts the snapshot's chunks back. Only chunks that differ from the current
+// ones end up in the dirty range
+int shape_restore(shape_pool_t* pool, shape_handle_t handle, const shape_snapshot_t* snapshot) {
+    shape_t* shape = get_shape(pool, handle);
+    if (!shape) return -1;
+
+    int* chunks = shape_chunks(pool, shape);
+    if (snapshot->vertex_count != shape->vertex_count) {
+        shape_mark_dirty(shape, 0, snapshot->vertex_count);
+    } else {
+        for (int c = 0; c < shape->chunk_count; c++) {
+            if (chunks[c] != snapshot->chunks[c]) {
+                shape_mark_dirty(shape, c << SHAPE_CHUNK_SHIFT, (c << SHAPE_CHUNK_SHIFT) + chunk_vertex_count(shape->vertex_count, c));
+            }
+        }
+    }
+
+    // Take the snapshot's chunks before letting go of ours, they may be the same
+    for (int c = 0; c < snapshot->chunk_count; c++) {
+        pool->chunks[snapshot->chunks[c]].refs++;
+    }
+    shape_release(pool, shape);
+
+    shape->vertex_count = snapshot->vertex_count;
+    shape->chunk_count = snapshot->chunk_count;
+    shape->table_class = block_size_class(snapshot->chunk_count);
+    shape->chunk_table = block_alloc(&pool->tables, shape->table_class);
+    memcpy(shape_chunks(pool, shape), snapshot->chunks, sizeof(int) * snapshot->chunk_count);
+    if (shape->dirty_end > shape->vertex_count) shape->dirty_end = shape->vertex_count;
+    return 0;
+}
+
+void shape_snapshot_release(shape_pool_t* pool, shape_snapshot_t* snapshot) {
+    for (int c = 0; c < snapshot->chunk_count; c++) {
+        chunk_release(pool, snapshot->chunks[c]);
+    }
+    free(snapshot->chunks);
+    snapshot->chunks = NULL;
+    snapshot->chunk_count = 0;
 }
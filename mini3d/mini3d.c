@@ -5,6 +5,9 @@
 // build:
 //   mingw: gcc -O3 mini3d.c -o mini3d.exe -lgdi32
 //   msvc:  cl -O2 -nologo mini3d.c 
+//   linux: gcc -O3 mini3d.c -o mini3d -lm -lpthread   (headless, writes PNG)
+//
+// Define MINI3D_NO_MAIN to include the renderer in another program.
 //
 // history:
 //   2007.7.01  skywind  create this file as a tutorial
@@ -21,9 +24,21 @@
 #include <stdlib.h>
 #include <math.h>
 #include <assert.h>
+#include <float.h>
+#include <string.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define MINI3D_SSE2
+#include <emmintrin.h>
+#endif
 
+#ifdef _WIN32
 #include <windows.h>
 #include <tchar.h>
+#else
+#include <pthread.h>
+#include <unistd.h>
+#endif
 
 typedef unsigned int IUINT32;
 
@@ -311,7 +326,7 @@ typedef struct { point_t pos; texcoord_t tc; color_t color; float rhw; } vertex_
 
 typedef struct { vertex_t v, v1, v2; } edge_t;
 typedef struct { float top, bottom; edge_t left, right; } trapezoid_t;
-typedef struct { vertex_t v, step; int x, y, w; } scanline_t;
+typedef struct { vertex_t v, step; int x, y, w; texcoord_t tc_dy; float rhw_dy; } scanline_t;
 
 
 void vertex_rhw_init(vertex_t *v) {
@@ -445,61 +460,300 @@ void trapezoid_init_scan_line(const trapezoid_t *trap, scanline_t *scanline, int
 	scanline->v = trap->left.v;
 	if (trap->left.v.pos.x >= trap->right.v.pos.x) scanline->w = 0;
 	vertex_division(&scanline->step, &trap->left.v, &trap->right.v, width);
+	if (scanline->w > 0) {	// Vertical gradients for mip selection: the slope down the left edge minus its x drift
+		float dy = trap->left.v2.pos.y - trap->left.v1.pos.y;
+		float dxdy = (trap->left.v2.pos.x - trap->left.v1.pos.x) / dy;
+		scanline->tc_dy.u = (trap->left.v2.tc.u - trap->left.v1.tc.u) / dy - scanline->step.tc.u * dxdy;
+		scanline->tc_dy.v = (trap->left.v2.tc.v - trap->left.v1.tc.v) / dy - scanline->step.tc.v * dxdy;
+		scanline->rhw_dy = (trap->left.v2.rhw - trap->left.v1.rhw) / dy - scanline->step.rhw * dxdy;
+	}
 }
 
 
+//=====================================================================
+// Texture: full mip chain, each level stored in 4x4 texel tiles
+//=====================================================================
+// A tile is 64 bytes, one cache line, with its texels in Morton order, and
+// tiles are stored row by row. A bilinear footprint or a run of nearby
+// pixels mostly stays inside one or two cache lines, where row pointers
+// touch a new line for every texel row. Texture coordinates are clamped to
+// the edge, and u = 0..1 spans the texel centers 0..width-1 on every level.
+#define TEXTURE_MAX_SIZE    8192
+#define TEXTURE_MAX_LEVELS  14			// log2(TEXTURE_MAX_SIZE) + 1
+
+typedef struct {
+	IUINT32 *texels;            // Tiles of this level
+	int width, height;
+	int tiles_x;                // Tiles per row
+	float max_u, max_v;         // width - 1, height - 1
+}	texture_level_t;
+
+typedef struct {
+	IUINT32 *texels;            // One allocation for every level
+	int levels;
+	texture_level_t level[TEXTURE_MAX_LEVELS];
+}	texture_t;
+
+static IUINT32 *texture_texel(const texture_level_t *level, int x, int y) {
+	int tile = (y >> 2) * level->tiles_x + (x >> 2);
+	int morton = (x & 1) | ((y & 1) << 1) | ((x & 2) << 1) | ((y & 2) << 2);
+	return level->texels + tile * 16 + morton;
+}
+
+// Copy a w x h image (pitch bytes per row) and build its mip chain. Each
+// level averages 2x2 texels of the one above, per byte.
+void texture_init(texture_t *texture, const void *bits, long pitch, int w, int h) {
+	const IUINT32 *src = (const IUINT32*)bits;
+	IUINT32 *scratch = NULL;
+	long size = 0, src_pitch = pitch / 4;
+	int i, x, y;
+	assert(w > 0 && h > 0 && w <= TEXTURE_MAX_SIZE && h <= TEXTURE_MAX_SIZE);
+
+	for (i = 0; i < TEXTURE_MAX_LEVELS; i++) {
+		texture_level_t *level = &texture->level[i];
+		level->width = w;
+		level->height = h;
+		level->tiles_x = (w + 3) >> 2;
+		level->max_u = (float)(w - 1);
+		level->max_v = (float)(h - 1);
+		size += (long)level->tiles_x * ((h + 3) >> 2) * 16;
+		if (w == 1 && h == 1) break;
+		w = w > 1 ? w >> 1 : 1;
+		h = h > 1 ? h >> 1 : 1;
+	}
+	texture->levels = i + 1;
+	texture->texels = (IUINT32*)malloc(size * sizeof(IUINT32));
+	assert(texture->texels);
+
+	for (i = 0, size = 0; i < texture->levels; i++) {
+		texture_level_t *level = &texture->level[i];
+		level->texels = texture->texels + size;
+		size += (long)level->tiles_x * ((level->height + 3) >> 2) * 16;
+		for (y = 0; y < level->height; y++) {
+			for (x = 0; x < level->width; x++) 
+				*texture_texel(level, x, y) = src[y * src_pitch + x];
+		}
+
+		if (i + 1 < texture->levels) {
+			const texture_level_t *next = &texture->level[i + 1];
+			IUINT32 *dst = (IUINT32*)malloc(sizeof(IUINT32) * next->width * next->height);
+			assert(dst);
+			for (y = 0; y < next->height; y++) {
+				const IUINT32 *row0 = src + CMID(y * 2, 0, level->height - 1) * src_pitch;
+				const IUINT32 *row1 = src + CMID(y * 2 + 1, 0, level->height - 1) * src_pitch;
+				for (x = 0; x < next->width; x++) {
+					int x0 = CMID(x * 2, 0, level->width - 1), x1 = CMID(x * 2 + 1, 0, level->width - 1);
+					IUINT32 c = 0;
+					int k;
+					for (k = 0; k < 32; k += 8) {
+						IUINT32 sum = ((row0[x0] >> k) & 255) + ((row0[x1] >> k) & 255) +
+							((row1[x0] >> k) & 255) + ((row1[x1] >> k) & 255);
+						c |= ((sum + 2) >> 2) << k;
+					}
+					dst[y * next->width + x] = c;
+				}
+			}
+			free(scratch);
+			scratch = dst;
+			src = dst;
+			src_pitch = next->width;
+		}
+	}
+	free(scratch);
+}
+
+void texture_destroy(texture_t *texture) {
+	free(texture->texels);
+	texture->texels = NULL;
+	texture->levels = 0;
+}
+
+// Mip level for a pixel covering rho2 squared level 0 texels, rounded to the
+// nearest level.
+int texture_select_level(const texture_t *texture, float rho2) {
+	union { float f; IUINT32 i; } bits;
+	int e, level;
+	bits.f = rho2;
+	e = (int)((bits.i >> 23) & 255) - 127;	// floor(log2(rho2))
+	level = (e + 1) >> 1;
+	return CMID(level, 0, texture->levels - 1);
+}
+
+// Nearest texel of level 0
+IUINT32 texture_read(const texture_t *texture, float u, float v) {
+	const texture_level_t *level = &texture->level[0];
+	int x = (int)(u * level->max_u + 0.5f);
+	int y = (int)(v * level->max_v + 0.5f);
+	x = CMID(x, 0, level->width - 1);
+	y = CMID(y, 0, level->height - 1);
+	return *texture_texel(level, x, y);
+}
+
+// (a * (256 - f) + b * f) / 256 for every byte, f in [0, 256]
+static IUINT32 texture_lerp(IUINT32 a, IUINT32 b, int f) {
+	IUINT32 c = 0;
+	int k;
+	for (k = 0; k < 32; k += 8) {
+		IUINT32 x = ((a >> k) & 255) * (256 - f) + ((b >> k) & 255) * f;
+		c |= ((x + 128) >> 8) << k;
+	}
+	return c;
+}
+
+// Bilinear filtered sample of the mip level picked by texture_select_level
+IUINT32 texture_read_bilinear(const texture_t *texture, float u, float v, float rho2) {
+	const texture_level_t *level = &texture->level[texture_select_level(texture, rho2)];
+	float s = u * level->max_u, t = v * level->max_v;
+	int x0, y0, x1, y1, fx, fy;
+	s = s < 0.0f ? 0.0f : (s > level->max_u ? level->max_u : s);
+	t = t < 0.0f ? 0.0f : (t > level->max_v ? level->max_v : t);
+	x0 = (int)s;
+	y0 = (int)t;
+	fx = (int)((s - (float)x0) * 256.0f);
+	fy = (int)((t - (float)y0) * 256.0f);
+	x1 = x0 + (x0 < level->width - 1);
+	y1 = y0 + (y0 < level->height - 1);
+	return texture_lerp(
+		texture_lerp(*texture_texel(level, x0, y0), *texture_texel(level, x1, y0), fx),
+		texture_lerp(*texture_texel(level, x0, y1), *texture_texel(level, x1, y1), fx), fy);
+}
+
+#ifdef MINI3D_SSE2
+
+// texture_lerp for four pixels, f holds one weight per 32 bit lane
+static __m128i texture_lerp4(__m128i a, __m128i b, __m128i f) {
+	const __m128i zero = _mm_setzero_si128(), full = _mm_set1_epi16(256), round = _mm_set1_epi16(128);
+	__m128i f16 = _mm_packs_epi32(f, f), flo, fhi, lo, hi;
+	f16 = _mm_unpacklo_epi16(f16, f16);
+	flo = _mm_unpacklo_epi32(f16, f16);		// Weights of pixels 0 and 1, one per byte
+	fhi = _mm_unpackhi_epi32(f16, f16);		// Pixels 2 and 3
+	lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(a, zero), _mm_sub_epi16(full, flo)),
+		_mm_mullo_epi16(_mm_unpacklo_epi8(b, zero), flo));
+	hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(a, zero), _mm_sub_epi16(full, fhi)),
+		_mm_mullo_epi16(_mm_unpackhi_epi8(b, zero), fhi));
+	lo = _mm_srli_epi16(_mm_add_epi16(lo, round), 8);
+	hi = _mm_srli_epi16(_mm_add_epi16(hi, round), 8);
+	return _mm_packus_epi16(lo, hi);
+}
+
+// texture_read_bilinear for four pixels, each with its own mip level.
+// The texel fetches are scalar, the filtering is done in 16 bit lanes.
+static __m128i texture_read_bilinear4(const texture_t *texture, __m128 u, __m128 v, __m128 rho2) {
+	const __m128 zero = _mm_setzero_ps(), scale = _mm_set1_ps(256.0f);
+	__m128i e = _mm_and_si128(_mm_srli_epi32(_mm_castps_si128(rho2), 23), _mm_set1_epi32(255));
+	int lod[4], X[4], Y[4], i;
+	IUINT32 c00[4], c10[4], c01[4], c11[4];
+	float max_u[4], max_v[4];
+	__m128 s, t, mu, mv;
+	__m128i x0, y0, fx, fy;
+
+	e = _mm_srai_epi32(_mm_add_epi32(e, _mm_set1_epi32(1 - 127)), 1);
+	_mm_storeu_si128((__m128i*)lod, e);
+	for (i = 0; i < 4; i++) {
+		lod[i] = CMID(lod[i], 0, texture->levels - 1);
+		max_u[i] = texture->level[lod[i]].max_u;
+		max_v[i] = texture->level[lod[i]].max_v;
+	}
+	mu = _mm_loadu_ps(max_u);
+	mv = _mm_loadu_ps(max_v);
+	s = _mm_min_ps(_mm_max_ps(_mm_mul_ps(u, mu), zero), mu);
+	t = _mm_min_ps(_mm_max_ps(_mm_mul_ps(v, mv), zero), mv);
+	x0 = _mm_cvttps_epi32(s);
+	y0 = _mm_cvttps_epi32(t);
+	fx = _mm_cvttps_epi32(_mm_mul_ps(_mm_sub_ps(s, _mm_cvtepi32_ps(x0)), scale));
+	fy = _mm_cvttps_epi32(_mm_mul_ps(_mm_sub_ps(t, _mm_cvtepi32_ps(y0)), scale));
+	_mm_storeu_si128((__m128i*)X, x0);
+	_mm_storeu_si128((__m128i*)Y, y0);
+
+	for (i = 0; i < 4; i++) {
+		const texture_level_t *level = &texture->level[lod[i]];
+		int x1 = X[i] + (X[i] < level->width - 1), y1 = Y[i] + (Y[i] < level->height - 1);
+		c00[i] = *texture_texel(level, X[i], Y[i]);
+		c10[i] = *texture_texel(level, x1, Y[i]);
+		c01[i] = *texture_texel(level, X[i], y1);
+		c11[i] = *texture_texel(level, x1, y1);
+	}
+
+	return texture_lerp4(
+		texture_lerp4(_mm_loadu_si128((const __m128i*)c00), _mm_loadu_si128((const __m128i*)c10), fx),
+		texture_lerp4(_mm_loadu_si128((const __m128i*)c01), _mm_loadu_si128((const __m128i*)c11), fx), fy);
+}
+
+#endif
+
+
 //=====================================================================
 // Rendering device
 //=====================================================================
+// Post-transform cache for device_draw_indexed: every vertex of a draw is
+// transformed once, and triangles are assembled from it by index.
+typedef struct {
+	float *x, *y, *z;           // Screen position, as transform_homogenize writes it
+	float *w;                   // Clip space w
+	float *rhw;                 // 1 / w
+	int *clip;                  // transform_check_cvv flags
+	int capacity;
+}	vertex_cache_t;
+
 typedef struct {
 	transform_t transform;      // Coordinate transformer
 	int width;                  // Window width
 	int height;                 // Window height
 	IUINT32 **framebuffer;      // Pixel buffer: framebuffer[y] represents the yth line
 	float **zbuffer;            // Depth buffer: zbuffer[y] is the y-th row pointer
-	IUINT32 **texture;          // Texture: Same as each row index
-	int tex_width;              // Doku genişliği
-	int tex_height;             // Doku yüksekliği
-	float max_u;                // Dokunun maksimum genişliği: tex_width - 1
-	float max_v;                // Dokunun maksimum yüksekliği: tex_height - 1
+	texture_t texture;          // Texture, owned by the device
 	int render_state;           // Oluşturma durumu
 	IUINT32 background;         // Arka plan rengi
 	IUINT32 foreground;         // Wireframe color
+	int clip_left, clip_top;    // Drawing is limited to [clip_left, clip_right) x [clip_top, clip_bottom)
+	int clip_right, clip_bottom;
+	float *hiz;                 // Hi-Z: farthest rhw of each HIZ_BLOCK square, never nearer than the zbuffer
+	int hiz_width;              // Hi-Z blocks per row
+	vertex_cache_t cache;       // Scratch for device_draw_indexed
 }	device_t;
 
 #define RENDER_STATE_WIREFRAME      1		// Render wireframe
 #define RENDER_STATE_TEXTURE        2		// Render texture
 #define RENDER_STATE_COLOR          4		// Render color
+#define RENDER_STATE_HALFSPACE      8		// Fill with the SIMD block rasterizer instead of trapezoids
+#define RENDER_STATE_FILTER         16		// Bilinear texture filtering with per pixel mip selection
+#define RENDER_STATE_CULL           32		// Skip triangles wound counter-clockwise on screen
+
+#define HIZ_BLOCK                   8		// Hi-Z resolution in pixels
 
 // Device initialization, fb is the external frame buffer, non-NULL will refer to the external frame buffer (each line is 4 bytes aligned)
+// and no frame buffer of our own is allocated
 void device_init(device_t *device, int width, int height, void *fb) {
-	int need = sizeof(void*) * (height * 2 + 1024) + width * height * 8;
+	int hiz_width = (width + HIZ_BLOCK - 1) / HIZ_BLOCK;
+	int hiz_height = (height + HIZ_BLOCK - 1) / HIZ_BLOCK;
+	int fb_size = (fb != NULL)? 0 : width * height * 4;
+	int need = sizeof(void*) * height * 2 + fb_size + width * height * 4 + hiz_width * hiz_height * 4;
 	char *ptr = (char*)malloc(need + 64);
 	char *framebuf, *zbuf;
+	IUINT32 blank[4] = { 0, 0, 0, 0 };
 	int j;
 	assert(ptr);
 	device->framebuffer = (IUINT32**)ptr;
 	device->zbuffer = (float**)(ptr + sizeof(void*) * height);
 	ptr += sizeof(void*) * height * 2;
-	device->texture = (IUINT32**)ptr;
-	ptr += sizeof(void*) * 1024;
 	framebuf = (char*)ptr;
-	zbuf = (char*)ptr + width * height * 4;
-	ptr += width * height * 8;
+	zbuf = (char*)ptr + fb_size;
+	ptr += fb_size + width * height * 4;
+	device->hiz = (float*)ptr;
+	device->hiz_width = hiz_width;
+	memset(device->hiz, 0, hiz_width * hiz_height * 4);
 	if (fb != NULL) framebuf = (char*)fb;
 	for (j = 0; j < height; j++) {
 		device->framebuffer[j] = (IUINT32*)(framebuf + width * 4 * j);
 		device->zbuffer[j] = (float*)(zbuf + width * 4 * j);
 	}
-	device->texture[0] = (IUINT32*)ptr;
-	device->texture[1] = (IUINT32*)(ptr + 16);
-	memset(device->texture[0], 0, 64);
-	device->tex_width = 2;
-	device->tex_height = 2;
-	device->max_u = 1.0f;
-	device->max_v = 1.0f;
+	texture_init(&device->texture, blank, 8, 2, 2);
+	memset(&device->cache, 0, sizeof(device->cache));
 	device->width = width;
 	device->height = height;
+	device->clip_left = device->clip_top = 0;
+	device->clip_right = width;
+	device->clip_bottom = height;
 	device->background = 0xc0c0c0;
 	device->foreground = 0;
 	transform_init(&device->transform, width, height);
@@ -512,20 +766,16 @@ void device_destroy(device_t *device) {
 		free(device->framebuffer);
 	device->framebuffer = NULL;
 	device->zbuffer = NULL;
-	device->texture = NULL;
+	device->hiz = NULL;
+	texture_destroy(&device->texture);
+	free(device->cache.x);
+	memset(&device->cache, 0, sizeof(device->cache));
 }
 
-// Set current texture
-void device_set_texture(device_t *device, void *bits, long pitch, int w, int h) {
-	char *ptr = (char*)bits;
-	int j;
-	assert(w <= 1024 && h <= 1024);
-	for (j = 0; j < h; ptr += pitch, j++) 	// Recalculate the texture pointer for each row
-		device->texture[j] = (IUINT32*)ptr;
-	device->tex_width = w;
-	device->tex_height = h;
-	device->max_u = (float)(w - 1);
-	device->max_v = (float)(h - 1);
+// Set current texture, the image is copied so the caller may free it
+void device_set_texture(device_t *device, const void *bits, long pitch, int w, int h) {
+	texture_destroy(&device->texture);
+	texture_init(&device->texture, bits, pitch, w, h);
 }
 
 // Clear framebuffer and zbuffer
@@ -542,11 +792,46 @@ void device_clear(device_t *device, int mode) {
 		float *dst = device->zbuffer[y];
 		for (x = device->width; x > 0; dst++, x--) dst[0] = 0.0f;
 	}
+	for (x = device->hiz_width * ((height + HIZ_BLOCK - 1) / HIZ_BLOCK) - 1; x >= 0; x--)
+		device->hiz[x] = 0.0f;
+}
+
+// Recompute the Hi-Z blocks overlapping [x0, x1) x [y0, y1) from the
+// zbuffer. The half-space rasterizer keeps Hi-Z current as it goes, after
+// drawing with trapezoids it only catches up when this is called.
+void device_hiz_build(device_t *device, int x0, int y0, int x1, int y1) {
+	int bx, by, x, y;
+	for (by = y0 / HIZ_BLOCK; by * HIZ_BLOCK < y1; by++) {
+		int yend = CMID((by + 1) * HIZ_BLOCK, 0, device->height);
+		for (bx = x0 / HIZ_BLOCK; bx * HIZ_BLOCK < x1; bx++) {
+			int xend = CMID((bx + 1) * HIZ_BLOCK, 0, device->width);
+			float farthest = FLT_MAX;
+			for (y = by * HIZ_BLOCK; y < yend; y++) {
+				const float *zbuffer = device->zbuffer[y];
+				for (x = bx * HIZ_BLOCK; x < xend; x++) 
+					if (zbuffer[x] < farthest) farthest = zbuffer[x];
+			}
+			device->hiz[by * device->hiz_width + bx] = farthest;
+		}
+	}
+}
+
+// Returns 1 if every pixel of [x0, x1) x [y0, y1) already holds something
+// nearer than rhw, so nothing at rhw or farther can pass the depth test there.
+int device_hiz_occluded(const device_t *device, int x0, int y0, int x1, int y1, float rhw) {
+	int bx, by, bx0 = x0 / HIZ_BLOCK, bx1 = (x1 - 1) / HIZ_BLOCK;
+	if (x0 >= x1 || y0 >= y1) return 1;
+	for (by = y0 / HIZ_BLOCK; by * HIZ_BLOCK < y1; by++) {
+		const float *hiz = device->hiz + by * device->hiz_width;
+		for (bx = bx0; bx <= bx1; bx++) 
+			if (rhw >= hiz[bx]) return 0;
+	}
+	return 1;
 }
 
 // Painting point
 void device_pixel(device_t *device, int x, int y, IUINT32 color) {
-	if (((IUINT32)x) < (IUINT32)device->width && ((IUINT32)y) < (IUINT32)device->height) {
+	if (x >= device->clip_left && x < device->clip_right && y >= device->clip_top && y < device->clip_bottom) {
 		device->framebuffer[y][x] = color;
 	}
 }
@@ -597,14 +882,7 @@ void device_draw_line(device_t *device, int x1, int y1, int x2, int y2, IUINT32
 
 // Read texture based on coordinates
 IUINT32 device_texture_read(const device_t *device, float u, float v) {
-	int x, y;
-	u = u * device->max_u;
-	v = v * device->max_v;
-	x = (int)(u + 0.5f);
-	y = (int)(v + 0.5f);
-	x = CMID(x, 0, device->tex_width - 1);
-	y = CMID(y, 0, device->tex_height - 1);
-	return device->texture[y][x];
+	return texture_read(&device->texture, u, v);
 }
 
 
@@ -618,10 +896,11 @@ void device_draw_scanline(device_t *device, scanline_t *scanline) {
 	float *zbuffer = device->zbuffer[scanline->y];
 	int x = scanline->x;
 	int w = scanline->w;
-	int width = device->width;
+	int left = device->clip_left;
+	int right = device->clip_right;
 	int render_state = device->render_state;
 	for (; w > 0; x++, w--) {
-		if (x >= 0 && x < width) {
+		if (x >= left && x < right) {
 			float rhw = scanline->v.rhw;
 			if (rhw >= zbuffer[x]) {	
 				float w = 1.0f / rhw;
@@ -641,13 +920,24 @@ void device_draw_scanline(device_t *device, scanline_t *scanline) {
 				if (render_state & RENDER_STATE_TEXTURE) {
 					float u = scanline->v.tc.u * w;
 					float v = scanline->v.tc.v * w;
-					IUINT32 cc = device_texture_read(device, u, v);
+					IUINT32 cc;
+					if (render_state & RENDER_STATE_FILTER) {
+						const texture_t *texture = &device->texture;
+						float dsdx = (scanline->step.tc.u - u * scanline->step.rhw) * w * texture->level[0].max_u;
+						float dtdx = (scanline->step.tc.v - v * scanline->step.rhw) * w * texture->level[0].max_v;
+						float dsdy = (scanline->tc_dy.u - u * scanline->rhw_dy) * w * texture->level[0].max_u;
+						float dtdy = (scanline->tc_dy.v - v * scanline->rhw_dy) * w * texture->level[0].max_v;
+						float rx = dsdx * dsdx + dtdx * dtdx, ry = dsdy * dsdy + dtdy * dtdy;
+						cc = texture_read_bilinear(texture, u, v, rx > ry ? rx : ry);
+					}	else {
+						cc = device_texture_read(device, u, v);
+					}
 					framebuffer[x] = cc;
 				}
 			}
 		}
 		vertex_add(&scanline->v, &scanline->step);
-		if (x >= width) break;
+		if (x >= right) break;
 	}
 }
 
@@ -658,20 +948,312 @@ void device_render_trap(device_t *device, trapezoid_t *trap) {
 	top = (int)(trap->top + 0.5f);
 	bottom = (int)(trap->bottom + 0.5f);
 	for (j = top; j < bottom; j++) {
-		if (j >= 0 && j < device->height) {
+		if (j >= device->clip_top && j < device->clip_bottom) {
 			trapezoid_edge_interp(trap, (float)j + 0.5f);
 			trapezoid_init_scan_line(trap, &scanline, j);
 			device_draw_scanline(device, &scanline);
 		}
-		if (j >= device->height) break;
+		if (j >= device->clip_bottom) break;
 	}
 }
 
-// Draw the original triangle according to render_state
-void device_draw_primitive(device_t *device, const vertex_t *v1, 
-	const vertex_t *v2, const vertex_t *v3) {
-	point_t p1, p2, p3, c1, c2, c3;
+//=====================================================================
+// Half-space rasterizer: edge functions evaluated on 8x8 pixel blocks
+//=====================================================================
+// Vertices are snapped to 1/16 pixel and each edge function is stepped in
+// 32 bit integers, four pixels per SSE2 register. A block that lies
+// entirely outside one edge is skipped, and a block inside all three edges
+// skips the per pixel coverage test. Depth, color and texture coordinates
+// are interpolated from plane equations instead of per pixel vertex_add.
+// Blocks are the Hi-Z blocks: one whose nearest point is behind the Hi-Z is
+// skipped, and a fully covered block raises the Hi-Z to its farthest point.
+#ifdef MINI3D_SSE2
+
+#define HALFSPACE_SUBPIXEL_BITS 4
+#define HALFSPACE_SUBPIXEL      (1 << HALFSPACE_SUBPIXEL_BITS)
+#define HALFSPACE_BLOCK         HIZ_BLOCK
+#define HALFSPACE_MAX_EXTENT    1024	// Larger triangles could overflow the 32 bit edge functions
+
+// Attribute as a function of the pixel center: f(x, y) = dx * x + dy * y + c
+typedef struct { float dx, dy, c; } plane_t;
+
+static plane_t plane_init(const float *X, const float *Y, float f0, float f1, float f2, float inv_det) {
+	plane_t p;
+	float d1 = f1 - f0, d2 = f2 - f0;
+	p.dx = (d1 * (Y[2] - Y[0]) - d2 * (Y[1] - Y[0])) * inv_det;
+	p.dy = (d2 * (X[1] - X[0]) - d1 * (X[2] - X[0])) * inv_det;
+	p.c = f0 - p.dx * X[0] - p.dy * Y[0];
+	return p;
+}
+
+// Shades four pixels. a1, a2 and a3 are u, v when texturing or r, g, b
+// when coloring, all still multiplied by rhw, and planes are their plane
+// equations after the one of rhw. covered has all bits set in each lane
+// that passed the edge tests.
+static void halfspace_shade4(const device_t *device, const plane_t *planes, __m128 rhw, 
+	__m128 a1, __m128 a2, __m128 a3, __m128i covered, float *zrow, IUINT32 *crow) {
 	int render_state = device->render_state;
+	__m128 z = _mm_loadu_ps(zrow);
+	__m128 pass = _mm_and_ps(_mm_castsi128_ps(covered), _mm_cmpge_ps(rhw, z));
+	__m128i color, old;
+	__m128 w;
+
+	if (_mm_movemask_ps(pass) == 0) return;
+	_mm_storeu_ps(zrow, _mm_or_ps(_mm_and_ps(pass, rhw), _mm_andnot_ps(pass, z)));
+	if ((render_state & (RENDER_STATE_TEXTURE | RENDER_STATE_COLOR)) == 0) return;
+
+	w = _mm_rcp_ps(rhw);	// One Newton-Raphson step brings the estimate to about 22 bits
+	w = _mm_sub_ps(_mm_add_ps(w, w), _mm_mul_ps(_mm_mul_ps(w, w), rhw));
+
+	if ((render_state & (RENDER_STATE_TEXTURE | RENDER_STATE_FILTER)) == (RENDER_STATE_TEXTURE | RENDER_STATE_FILTER)) {
+		// d(U / rhw) / dx = (dU/dx - u * drhw/dx) / rhw, in level 0 texels
+		const texture_t *texture = &device->texture;
+		__m128 u = _mm_mul_ps(a1, w), v = _mm_mul_ps(a2, w);
+		__m128 su = _mm_mul_ps(w, _mm_set1_ps(texture->level[0].max_u));
+		__m128 sv = _mm_mul_ps(w, _mm_set1_ps(texture->level[0].max_v));
+		__m128 dsdx = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(planes[1].dx), _mm_mul_ps(u, _mm_set1_ps(planes[0].dx))), su);
+		__m128 dtdx = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(planes[2].dx), _mm_mul_ps(v, _mm_set1_ps(planes[0].dx))), sv);
+		__m128 dsdy = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(planes[1].dy), _mm_mul_ps(u, _mm_set1_ps(planes[0].dy))), su);
+		__m128 dtdy = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(planes[2].dy), _mm_mul_ps(v, _mm_set1_ps(planes[0].dy))), sv);
+		__m128 rho2 = _mm_max_ps(_mm_add_ps(_mm_mul_ps(dsdx, dsdx), _mm_mul_ps(dtdx, dtdx)),
+			_mm_add_ps(_mm_mul_ps(dsdy, dsdy), _mm_mul_ps(dtdy, dtdy)));
+		color = texture_read_bilinear4(texture, u, v, rho2);
+	}	else if (render_state & RENDER_STATE_TEXTURE) {
+		const texture_level_t *level = &device->texture.level[0];
+		const __m128 half = _mm_set1_ps(0.5f), zero = _mm_setzero_ps();
+		__m128 max_u = _mm_set1_ps(level->max_u), max_v = _mm_set1_ps(level->max_v);
+		__m128 u = _mm_add_ps(_mm_mul_ps(_mm_mul_ps(a1, w), max_u), half);
+		__m128 v = _mm_add_ps(_mm_mul_ps(_mm_mul_ps(a2, w), max_v), half);
+		int tx[4], ty[4], i;
+		_mm_storeu_si128((__m128i*)tx, _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(u, zero), max_u)));
+		_mm_storeu_si128((__m128i*)ty, _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(v, zero), max_v)));
+		for (i = 0; i < 4; i++) tx[i] = *texture_texel(level, tx[i], ty[i]);
+		color = _mm_loadu_si128((const __m128i*)tx);
+	}	else {
+		const __m128 hi = _mm_set1_ps(255.0f), lo = _mm_setzero_ps();
+		__m128 scale = _mm_mul_ps(w, hi);
+		__m128i R = _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(_mm_mul_ps(a1, scale), lo), hi));
+		__m128i G = _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(_mm_mul_ps(a2, scale), lo), hi));
+		__m128i B = _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(_mm_mul_ps(a3, scale), lo), hi));
+		color = _mm_or_si128(_mm_or_si128(_mm_slli_epi32(R, 16), _mm_slli_epi32(G, 8)), B);
+	}
+
+	old = _mm_loadu_si128((const __m128i*)crow);
+	color = _mm_or_si128(_mm_and_si128(_mm_castps_si128(pass), color), 
+		_mm_andnot_si128(_mm_castps_si128(pass), old));
+	_mm_storeu_si128((__m128i*)crow, color);
+}
+
+// Same for four pixels straddling the clip rectangle: shades a copy and
+// writes back only the pixels inside [x0, x1).
+static void halfspace_shade4_clipped(const device_t *device, const plane_t *planes, const __m128 *attr, __m128i covered,
+	float *zrow, IUINT32 *crow, int x, int x0, int x1) {
+	float ztmp[4];
+	IUINT32 ctmp[4];
+	int i;
+	for (i = 0; i < 4; i++) {
+		int inside = x + i >= x0 && x + i < x1;
+		ztmp[i] = inside ? zrow[i] : FLT_MAX;
+		ctmp[i] = inside ? crow[i] : 0;
+	}
+	halfspace_shade4(device, planes, attr[0], attr[1], attr[2], attr[3], covered, ztmp, ctmp);
+	for (i = 0; i < 4; i++) {
+		if (x + i >= x0 && x + i < x1) {
+			zrow[i] = ztmp[i];
+			crow[i] = ctmp[i];
+		}
+	}
+}
+
+// Draw a triangle of homogenized vertices (after vertex_rhw_init), only
+// touching pixels inside [x0, x1) x [y0, y1). Returns 0 if the triangle is
+// too large for the fixed point edge functions and nothing was drawn.
+int device_draw_triangle_halfspace(device_t *device, const vertex_t *v1,
+	const vertex_t *v2, const vertex_t *v3, int x0, int y0, int x1, int y1) {
+	const vertex_t *v[3] = { v1, v2, v3 };
+	const __m128 lanes = _mm_set_ps(3.0f, 2.0f, 1.0f, 0.0f);
+	int X[3], Y[3], A[3], B[3], E[3], i, k, attr_count = 1;
+	int minx, miny, maxx, maxy, bx0, by0, bx, by;
+	__m128i lane_step[3], row_step[3];
+	__m128 attr_group_step[4], attr_row_step[4];
+	float FX[3], FY[3], inv_det;
+	plane_t planes[4];
+	long long area;
+
+	for (i = 0; i < 3; i++) {	// Vertices passed the cvv check, so they are not negative
+		X[i] = (int)(v[i]->pos.x * HALFSPACE_SUBPIXEL + 0.5f);
+		Y[i] = (int)(v[i]->pos.y * HALFSPACE_SUBPIXEL + 0.5f);
+	}
+
+	area = (long long)(X[1] - X[0]) * (Y[2] - Y[0]) - (long long)(Y[1] - Y[0]) * (X[2] - X[0]);
+	if (area == 0) return 1;
+	if (area < 0) {		// Both windings are drawn, make the edge functions positive inside
+		const vertex_t *p = v[1]; v[1] = v[2]; v[2] = p;
+		i = X[1]; X[1] = X[2]; X[2] = i;
+		i = Y[1]; Y[1] = Y[2]; Y[2] = i;
+	}
+
+	minx = X[0] < X[1] ? (X[0] < X[2] ? X[0] : X[2]) : (X[1] < X[2] ? X[1] : X[2]);
+	miny = Y[0] < Y[1] ? (Y[0] < Y[2] ? Y[0] : Y[2]) : (Y[1] < Y[2] ? Y[1] : Y[2]);
+	maxx = X[0] > X[1] ? (X[0] > X[2] ? X[0] : X[2]) : (X[1] > X[2] ? X[1] : X[2]);
+	maxy = Y[0] > Y[1] ? (Y[0] > Y[2] ? Y[0] : Y[2]) : (Y[1] > Y[2] ? Y[1] : Y[2]);
+	// The edge functions grow with the whole triangle, not with the part of
+	// it inside the clip rectangle, so the unclipped extent is what's limited
+	if (maxx - minx > HALFSPACE_MAX_EXTENT * HALFSPACE_SUBPIXEL || 
+		maxy - miny > HALFSPACE_MAX_EXTENT * HALFSPACE_SUBPIXEL) return 0;
+	// Pixels whose centers lie within the bounds, so slivers between centers cost nothing
+	minx = CMID((minx + HALFSPACE_SUBPIXEL / 2 - 1) >> HALFSPACE_SUBPIXEL_BITS, x0, x1);
+	miny = CMID((miny + HALFSPACE_SUBPIXEL / 2 - 1) >> HALFSPACE_SUBPIXEL_BITS, y0, y1);
+	maxx = CMID(((maxx - HALFSPACE_SUBPIXEL / 2) >> HALFSPACE_SUBPIXEL_BITS) + 1, x0, x1);
+	maxy = CMID(((maxy - HALFSPACE_SUBPIXEL / 2) >> HALFSPACE_SUBPIXEL_BITS) + 1, y0, y1);
+	if (minx >= maxx || miny >= maxy) return 1;
+
+	// Edge i runs from v[i] to v[i + 1]. Pixels exactly on an edge belong to
+	// the triangle only for top and left edges, so shared edges are drawn once.
+	bx0 = minx & ~(HALFSPACE_BLOCK - 1);
+	by0 = miny & ~(HALFSPACE_BLOCK - 1);
+	for (i = 0; i < 3; i++) {
+		int a = i, b = (i + 1) % 3;
+		int top_left = (Y[a] == Y[b] && X[b] > X[a]) || Y[b] < Y[a];
+		A[i] = Y[a] - Y[b];
+		B[i] = X[b] - X[a];
+		E[i] = (int)((long long)A[i] * (bx0 * HALFSPACE_SUBPIXEL + HALFSPACE_SUBPIXEL / 2 - X[a]) +
+			(long long)B[i] * (by0 * HALFSPACE_SUBPIXEL + HALFSPACE_SUBPIXEL / 2 - Y[a])) - (top_left ? 0 : 1);
+		A[i] *= HALFSPACE_SUBPIXEL;
+		B[i] *= HALFSPACE_SUBPIXEL;
+		lane_step[i] = _mm_set_epi32(3 * A[i], 2 * A[i], A[i], 0);
+		row_step[i] = _mm_set1_epi32(B[i]);
+	}
+
+	// Only the attributes the render state reads are interpolated
+	for (i = 0; i < 3; i++) {
+		FX[i] = (float)X[i] / HALFSPACE_SUBPIXEL;
+		FY[i] = (float)Y[i] / HALFSPACE_SUBPIXEL;
+	}
+	inv_det = 1.0f / ((FX[1] - FX[0]) * (FY[2] - FY[0]) - (FY[1] - FY[0]) * (FX[2] - FX[0]));
+	planes[0] = plane_init(FX, FY, v[0]->rhw, v[1]->rhw, v[2]->rhw, inv_det);
+	if (device->render_state & RENDER_STATE_TEXTURE) {
+		planes[attr_count++] = plane_init(FX, FY, v[0]->tc.u, v[1]->tc.u, v[2]->tc.u, inv_det);
+		planes[attr_count++] = plane_init(FX, FY, v[0]->tc.v, v[1]->tc.v, v[2]->tc.v, inv_det);
+	}	else if (device->render_state & RENDER_STATE_COLOR) {
+		planes[attr_count++] = plane_init(FX, FY, v[0]->color.r, v[1]->color.r, v[2]->color.r, inv_det);
+		planes[attr_count++] = plane_init(FX, FY, v[0]->color.g, v[1]->color.g, v[2]->color.g, inv_det);
+		planes[attr_count++] = plane_init(FX, FY, v[0]->color.b, v[1]->color.b, v[2]->color.b, inv_det);
+	}
+	for (k = attr_count; k < 4; k++) planes[k] = planes[0];
+	for (k = 0; k < 4; k++) {
+		attr_group_step[k] = _mm_set1_ps(planes[k].dx * 4.0f);
+		attr_row_step[k] = _mm_set1_ps(planes[k].dy);
+	}
+
+	for (by = by0; by < maxy; by += HALFSPACE_BLOCK) {
+		for (bx = bx0; bx < maxx; bx += HALFSPACE_BLOCK) {
+			const int last = HALFSPACE_BLOCK - 1;
+			float *hiz = &device->hiz[(by / HIZ_BLOCK) * device->hiz_width + bx / HIZ_BLOCK];
+			__m128i edge_row[3][HALFSPACE_BLOCK / 4];
+			__m128 attr_row[4];
+			float fx0 = (float)bx + 0.5f, fy0 = (float)by + 0.5f, nearest, farthest;
+			int accept = 1, reject = 0, y, ystart, yend, g;
+
+			ystart = by > miny ? by : miny;
+			yend = by + HALFSPACE_BLOCK < maxy ? by + HALFSPACE_BLOCK : maxy;
+
+			// Edge functions are linear, so the block corners bound every pixel in it
+			for (i = 0; i < 3; i++) {
+				int e = E[i] + A[i] * (bx - bx0) + B[i] * (by - by0);
+				int c10 = e + A[i] * last, c01 = e + B[i] * last, c11 = c10 + B[i] * last;
+				int lo = e < c10 ? e : c10, hi = e > c10 ? e : c10;
+				lo = lo < c01 ? lo : c01; lo = lo < c11 ? lo : c11;
+				hi = hi > c01 ? hi : c01; hi = hi > c11 ? hi : c11;
+				if (hi < 0) reject = 1;
+				if (lo < 0) accept = 0;
+				e += B[i] * (ystart - by);
+				for (g = 0; g < HALFSPACE_BLOCK / 4; g++)
+					edge_row[i][g] = _mm_add_epi32(_mm_set1_epi32(e + A[i] * 4 * g), lane_step[i]);
+			}
+			if (reject) continue;
+
+			// rhw is linear too, so its extremes over the block are at corners
+			nearest = farthest = planes[0].c + planes[0].dx * fx0 + planes[0].dy * fy0;
+			if (planes[0].dx > 0) nearest += planes[0].dx * last; else farthest += planes[0].dx * last;
+			if (planes[0].dy > 0) nearest += planes[0].dy * last; else farthest += planes[0].dy * last;
+			if (nearest < *hiz) continue;
+
+			for (k = 0; k < 4; k++) {
+				float fx = (float)bx + 0.5f, fy = (float)ystart + 0.5f;
+				attr_row[k] = _mm_add_ps(_mm_set1_ps(planes[k].dx * fx + planes[k].dy * fy + planes[k].c),
+					_mm_mul_ps(_mm_set1_ps(planes[k].dx), lanes));
+			}
+
+			for (y = ystart; y < yend; y++) {
+				IUINT32 *framebuffer = device->framebuffer[y];
+				float *zbuffer = device->zbuffer[y];
+				__m128 attr[4];
+
+				for (k = 0; k < 4; k++) attr[k] = attr_row[k];
+
+				for (g = 0; g < HALFSPACE_BLOCK / 4; g++) {
+					const int gx = bx + g * 4;
+					__m128i covered = _mm_set1_epi32(-1);
+
+					if (g > 0) {
+						for (k = 0; k < 4; k++) attr[k] = _mm_add_ps(attr[k], attr_group_step[k]);
+					}
+					if (gx + 4 <= minx || gx >= maxx) continue;
+					if (!accept) {
+						__m128i outside = _mm_or_si128(_mm_or_si128(edge_row[0][g], edge_row[1][g]), edge_row[2][g]);
+						covered = _mm_xor_si128(_mm_srai_epi32(outside, 31), covered);
+						if (_mm_movemask_epi8(covered) == 0) continue;
+					}
+
+					if (gx >= x0 && gx + 4 <= x1) {
+						halfspace_shade4(device, planes, attr[0], attr[1], attr[2], attr[3], covered, zbuffer + gx, framebuffer + gx);
+					}	else {
+						halfspace_shade4_clipped(device, planes, attr, covered, zbuffer + gx, framebuffer + gx, gx, x0, x1);
+					}
+				}
+
+				for (i = 0; i < 3; i++) {
+					for (g = 0; g < HALFSPACE_BLOCK / 4; g++)
+						edge_row[i][g] = _mm_add_epi32(edge_row[i][g], row_step[i]);
+				}
+				for (k = 0; k < 4; k++) attr_row[k] = _mm_add_ps(attr_row[k], attr_row_step[k]);
+			}
+
+			// Every pixel of a covered block is now at least as near as the triangle
+			if (accept && bx >= x0 && bx + HALFSPACE_BLOCK <= x1 && by >= y0 && by + HALFSPACE_BLOCK <= y1) {
+				if (farthest > *hiz) *hiz = farthest;
+			}
+		}
+	}
+
+	return 1;
+}
+
+#else
+
+int device_draw_triangle_halfspace(device_t *device, const vertex_t *v1,
+	const vertex_t *v2, const vertex_t *v3, int x0, int y0, int x1, int y1) {
+	return 0;
+}
+
+#endif
+
+
+// Returns 1 if RENDER_STATE_CULL is set and the screen space triangle is
+// wound counter-clockwise (screen y points down), or has no area
+int device_backface(const device_t *device, const point_t *p1, const point_t *p2, const point_t *p3) {
+	float area;
+	if ((device->render_state & RENDER_STATE_CULL) == 0) return 0;
+	area = (p2->x - p1->x) * (p3->y - p1->y) - (p2->y - p1->y) * (p3->x - p1->x);
+	return area <= 0.0f;
+}
+
+// Transform, cull and project a triangle into screen space vertices ready
+// for device_draw_triangle. Returns 0 if the triangle is not drawn.
+int device_setup_primitive(const device_t *device, vertex_t *t, const vertex_t *v1, 
+	const vertex_t *v2, const vertex_t *v3) {
+	point_t c1, c2, c3;
 
 	// Change according to Transform
 	transform_apply(&device->transform, &c1, &v1->pos);
@@ -680,47 +1262,994 @@ void device_draw_primitive(device_t *device, const vertex_t *v1,
 
 	// Cropping, note that this can be improved to specifically determine the coordinate ratio of several points within the cvv and the plane that intersects the cvv
 	// Perform further fine-cutting to decompose one into several triangles that are completely within cvv
-	if (transform_check_cvv(&c1) != 0) return;
-	if (transform_check_cvv(&c2) != 0) return;
-	if (transform_check_cvv(&c3) != 0) return;
+	if (transform_check_cvv(&c1) != 0) return 0;
+	if (transform_check_cvv(&c2) != 0) return 0;
+	if (transform_check_cvv(&c3) != 0) return 0;
+
+	t[0] = *v1, t[1] = *v2, t[2] = *v3;
 
 	// Normalized
-	transform_homogenize(&device->transform, &p1, &c1);
-	transform_homogenize(&device->transform, &p2, &c2);
-	transform_homogenize(&device->transform, &p3, &c3);
+	transform_homogenize(&device->transform, &t[0].pos, &c1);
+	transform_homogenize(&device->transform, &t[1].pos, &c2);
+	transform_homogenize(&device->transform, &t[2].pos, &c3);
+	t[0].pos.w = c1.w;
+	t[1].pos.w = c2.w;
+	t[2].pos.w = c3.w;
+
+	if (device_backface(device, &t[0].pos, &t[1].pos, &t[2].pos)) return 0;
+
+	vertex_rhw_init(&t[0]);	// initialize w
+	vertex_rhw_init(&t[1]);	// initialize w
+	vertex_rhw_init(&t[2]);	// initialize w
+	return 1;
+}
 
-	// Doku veya renk boyama
-	if (render_state & (RENDER_STATE_TEXTURE | RENDER_STATE_COLOR)) {
-		vertex_t t1 = *v1, t2 = *v2, t3 = *v3;
-		trapezoid_t traps[2];
-		int n;
-
-		t1.pos = p1; 
-		t2.pos = p2;
-		t3.pos = p3;
-		t1.pos.w = c1.w;
-		t2.pos.w = c2.w;
-		t3.pos.w = c3.w;
-		
-		vertex_rhw_init(&t1);	// initialize w
-		vertex_rhw_init(&t2);	// initialize w
-		vertex_rhw_init(&t3);	// initialize w
-		
-		// Splits the triangle into 0-2 trapezoids and returns the number of available trapezoids
-		n = trapezoid_init_triangle(traps, &t1, &t2, &t3);
+// Returns 1 if the Hi-Z shows the triangle is hidden inside the clip rectangle
+int device_triangle_occluded(const device_t *device, const vertex_t *t1,
+	const vertex_t *t2, const vertex_t *t3) {
+	float minx = t1->pos.x, miny = t1->pos.y, maxx = minx, maxy = miny, nearest = t1->rhw;
+	const vertex_t *t[2] = { t2, t3 };
+	int i;
+	for (i = 0; i < 2; i++) {
+		if (t[i]->pos.x < minx) minx = t[i]->pos.x;
+		if (t[i]->pos.x > maxx) maxx = t[i]->pos.x;
+		if (t[i]->pos.y < miny) miny = t[i]->pos.y;
+		if (t[i]->pos.y > maxy) maxy = t[i]->pos.y;
+		if (t[i]->rhw > nearest) nearest = t[i]->rhw;
+	}
+	return device_hiz_occluded(device, 
+		CMID((int)minx, device->clip_left, device->clip_right), 
+		CMID((int)miny, device->clip_top, device->clip_bottom),
+		CMID((int)maxx + 1, device->clip_left, device->clip_right), 
+		CMID((int)maxy + 1, device->clip_top, device->clip_bottom), nearest);
+}
+
+// Draw a triangle from device_setup_primitive according to render_state
+void device_draw_triangle(device_t *device, const vertex_t *t1,
+	const vertex_t *t2, const vertex_t *t3) {
+	int render_state = device->render_state;
 
-		if (n >= 1) device_render_trap(device, &traps[0]);
-		if (n >= 2) device_render_trap(device, &traps[1]);
+	// Doku veya renk boyama
+	if ((render_state & (RENDER_STATE_TEXTURE | RENDER_STATE_COLOR)) && 
+		!device_triangle_occluded(device, t1, t2, t3)) {
+		if ((render_state & RENDER_STATE_HALFSPACE) == 0 || 
+			!device_draw_triangle_halfspace(device, t1, t2, t3, 
+				device->clip_left, device->clip_top, device->clip_right, device->clip_bottom)) {
+			trapezoid_t traps[2];
+			// Splits the triangle into 0-2 trapezoids and returns the number of available trapezoids
+			int n = trapezoid_init_triangle(traps, t1, t2, t3);
+
+			if (n >= 1) device_render_trap(device, &traps[0]);
+			if (n >= 2) device_render_trap(device, &traps[1]);
+		}
 	}
 
 	if (render_state & RENDER_STATE_WIREFRAME) {		// Wireframe drawing
-		device_draw_line(device, (int)p1.x, (int)p1.y, (int)p2.x, (int)p2.y, device->foreground);
-		device_draw_line(device, (int)p1.x, (int)p1.y, (int)p3.x, (int)p3.y, device->foreground);
-		device_draw_line(device, (int)p3.x, (int)p3.y, (int)p2.x, (int)p2.y, device->foreground);
+		device_draw_line(device, (int)t1->pos.x, (int)t1->pos.y, (int)t2->pos.x, (int)t2->pos.y, device->foreground);
+		device_draw_line(device, (int)t1->pos.x, (int)t1->pos.y, (int)t3->pos.x, (int)t3->pos.y, device->foreground);
+		device_draw_line(device, (int)t3->pos.x, (int)t3->pos.y, (int)t2->pos.x, (int)t2->pos.y, device->foreground);
+	}
+}
+
+// Draw the original triangle according to render_state
+void device_draw_primitive(device_t *device, const vertex_t *v1, 
+	const vertex_t *v2, const vertex_t *v3) {
+	vertex_t t[3];
+	if (device_setup_primitive(device, t, v1, v2, v3))
+		device_draw_triangle(device, &t[0], &t[1], &t[2]);
+}
+
+// Make room for count vertices in the cache, rounded up to whole SIMD groups
+static void vertex_cache_reserve(vertex_cache_t *cache, int count) {
+	int capacity = (count + 3) & ~3;
+	char *ptr;
+	if (capacity <= cache->capacity) return;
+	free(cache->x);
+	ptr = (char*)malloc(capacity * (sizeof(float) * 5 + sizeof(int)));
+	assert(ptr);
+	cache->x = (float*)ptr;
+	cache->y = cache->x + capacity;
+	cache->z = cache->y + capacity;
+	cache->w = cache->z + capacity;
+	cache->rhw = cache->w + capacity;
+	cache->clip = (int*)(cache->rhw + capacity);
+	cache->capacity = capacity;
+}
+
+// Transform and project vertices[0, count) into the cache. Gives the same
+// results as transform_apply, transform_check_cvv and transform_homogenize.
+void device_transform_vertices(device_t *device, const vertex_t *vertices, int count) {
+	vertex_cache_t *cache = &device->cache;
+	const transform_t *ts = &device->transform;
+	int i = 0;
+	vertex_cache_reserve(cache, count);
+
+#ifdef MINI3D_SSE2
+	{
+		const float (*m)[4] = ts->transform.m;
+		const __m128 one = _mm_set1_ps(1.0f), half = _mm_set1_ps(0.5f), zero = _mm_setzero_ps();
+		const __m128 sw = _mm_set1_ps(ts->w), sh = _mm_set1_ps(ts->h);
+		__m128 M[4][4];
+		int r, c;
+		for (r = 0; r < 4; r++) 
+			for (c = 0; c < 4; c++) M[r][c] = _mm_set1_ps(m[r][c]);
+
+		// Four vertices per iteration, the last group repeats the final vertex
+		for (; i < count; i += 4) {
+			const point_t *p0 = &vertices[i].pos;
+			const point_t *p1 = &vertices[i + 1 < count ? i + 1 : count - 1].pos;
+			const point_t *p2 = &vertices[i + 2 < count ? i + 2 : count - 1].pos;
+			const point_t *p3 = &vertices[i + 3 < count ? i + 3 : count - 1].pos;
+			__m128 X = _mm_set_ps(p3->x, p2->x, p1->x, p0->x);
+			__m128 Y = _mm_set_ps(p3->y, p2->y, p1->y, p0->y);
+			__m128 Z = _mm_set_ps(p3->z, p2->z, p1->z, p0->z);
+			__m128 W = _mm_set_ps(p3->w, p2->w, p1->w, p0->w);
+			__m128 C[4], rhw, neg_w;
+			__m128i clip;
+			for (c = 0; c < 4; c++) {	// Same summation order as matrix_apply
+				C[c] = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(X, M[0][c]), _mm_mul_ps(Y, M[1][c])),
+					_mm_mul_ps(Z, M[2][c])), _mm_mul_ps(W, M[3][c]));
+			}
+			neg_w = _mm_sub_ps(zero, C[3]);
+			clip = _mm_and_si128(_mm_castps_si128(_mm_cmplt_ps(C[2], zero)), _mm_set1_epi32(1));
+			clip = _mm_or_si128(clip, _mm_and_si128(_mm_castps_si128(_mm_cmpgt_ps(C[2], C[3])), _mm_set1_epi32(2)));
+			clip = _mm_or_si128(clip, _mm_and_si128(_mm_castps_si128(_mm_cmplt_ps(C[0], neg_w)), _mm_set1_epi32(4)));
+			clip = _mm_or_si128(clip, _mm_and_si128(_mm_castps_si128(_mm_cmpgt_ps(C[0], C[3])), _mm_set1_epi32(8)));
+			clip = _mm_or_si128(clip, _mm_and_si128(_mm_castps_si128(_mm_cmplt_ps(C[1], neg_w)), _mm_set1_epi32(16)));
+			clip = _mm_or_si128(clip, _mm_and_si128(_mm_castps_si128(_mm_cmpgt_ps(C[1], C[3])), _mm_set1_epi32(32)));
+			rhw = _mm_div_ps(one, C[3]);
+			_mm_storeu_ps(cache->x + i, _mm_mul_ps(_mm_mul_ps(_mm_add_ps(_mm_mul_ps(C[0], rhw), one), sw), half));
+			_mm_storeu_ps(cache->y + i, _mm_mul_ps(_mm_mul_ps(_mm_sub_ps(one, _mm_mul_ps(C[1], rhw)), sh), half));
+			_mm_storeu_ps(cache->z + i, _mm_mul_ps(C[2], rhw));
+			_mm_storeu_ps(cache->w + i, C[3]);
+			_mm_storeu_ps(cache->rhw + i, rhw);
+			_mm_storeu_si128((__m128i*)(cache->clip + i), clip);
+		}
+	}
+#else
+	for (; i < count; i++) {
+		point_t c, p;
+		transform_apply(ts, &c, &vertices[i].pos);
+		transform_homogenize(ts, &p, &c);
+		cache->x[i] = p.x;
+		cache->y[i] = p.y;
+		cache->z[i] = p.z;
+		cache->w[i] = c.w;
+		cache->rhw[i] = 1.0f / c.w;
+		cache->clip[i] = transform_check_cvv(&c);
+	}
+#endif
+}
+
+// Assemble triangle a, b, c from the cache into vertices ready for
+// device_draw_triangle. Returns 0 if it is clipped or culled.
+int device_assemble_triangle(const device_t *device, vertex_t *t, const vertex_t *vertices, 
+	int a, int b, int c) {
+	const vertex_cache_t *cache = &device->cache;
+	int index[3], i;
+	point_t p[3];
+	if (cache->clip[a] | cache->clip[b] | cache->clip[c]) return 0;
+
+	index[0] = a, index[1] = b, index[2] = c;
+	for (i = 0; i < 3; i++) {
+		p[i].x = cache->x[index[i]];
+		p[i].y = cache->y[index[i]];
+	}
+	if (device_backface(device, &p[0], &p[1], &p[2])) return 0;
+
+	for (i = 0; i < 3; i++) {
+		int k = index[i];
+		float rhw = cache->rhw[k];
+		t[i] = vertices[k];
+		t[i].pos.x = cache->x[k];
+		t[i].pos.y = cache->y[k];
+		t[i].pos.z = cache->z[k];
+		t[i].pos.w = cache->w[k];
+		t[i].rhw = rhw;
+		t[i].tc.u *= rhw;
+		t[i].tc.v *= rhw;
+		t[i].color.r *= rhw;
+		t[i].color.g *= rhw;
+		t[i].color.b *= rhw;
+	}
+	return 1;
+}
+
+// Draw a triangle list: every three entries of indices name the vertices of
+// one triangle. Each vertex is transformed once however many triangles share it.
+void device_draw_indexed(device_t *device, const vertex_t *vertices, int vertex_count, 
+	const int *indices, int index_count) {
+	vertex_t t[3];
+	int i;
+	if (vertex_count <= 0) return;
+	device_transform_vertices(device, vertices, vertex_count);
+	for (i = 0; i + 2 < index_count; i += 3) {
+		if (device_assemble_triangle(device, t, vertices, indices[i], indices[i + 1], indices[i + 2]))
+			device_draw_triangle(device, &t[0], &t[1], &t[2]);
+	}
+}
+
+// Occlusion query for the box [bmin, bmax] in object space under the current
+// transform. Returns 0 if it is outside the view or the Hi-Z shows it is
+// behind what was already drawn, so a mesh inside it can be skipped.
+int device_box_visible(const device_t *device, const vector_t *bmin, const vector_t *bmax) {
+	float minx = FLT_MAX, miny = FLT_MAX, maxx = -FLT_MAX, maxy = -FLT_MAX, nearest = 0.0f;
+	int i, outside = 0x3f, crosses_near = 0;
+	for (i = 0; i < 8; i++) {
+		point_t p, c, s;
+		int check;
+		p.x = (i & 1) ? bmax->x : bmin->x;
+		p.y = (i & 2) ? bmax->y : bmin->y;
+		p.z = (i & 4) ? bmax->z : bmin->z;
+		p.w = 1.0f;
+		transform_apply(&device->transform, &c, &p);
+		check = transform_check_cvv(&c);
+		outside &= check;
+		if (check & 1) {	// Corners in front of the near plane have no usable projection
+			crosses_near = 1;
+			continue;
+		}
+		transform_homogenize(&device->transform, &s, &c);
+		if (s.x < minx) minx = s.x;
+		if (s.x > maxx) maxx = s.x;
+		if (s.y < miny) miny = s.y;
+		if (s.y > maxy) maxy = s.y;
+		if (1.0f / c.w > nearest) nearest = 1.0f / c.w;
+	}
+	if (outside) return 0;		// Every corner is beyond the same frustum plane
+	if (crosses_near) return 1;
+	return !device_hiz_occluded(device, 
+		CMID((int)minx, 0, device->width), CMID((int)miny, 0, device->height),
+		CMID((int)maxx + 1, 0, device->width), CMID((int)maxy + 1, 0, device->height), nearest);
+}
+
+
+//=====================================================================
+// Binned rendering: a batch of triangles is set up once, sorted into
+// screen tiles, and the tiles are rasterized in parallel
+//=====================================================================
+// Each worker draws with its own copy of the device whose clip rectangle is
+// the tile, so it only ever writes that tile's part of framebuffer and
+// zbuffer and no locking is needed. Triangles keep their submission order
+// within a tile, so the picture is the same as drawing them one by one.
+// With front_to_back set each tile is drawn nearest triangle first instead,
+// so the Hi-Z rejects more of what follows. Only triangles at equal depth
+// and wireframe lines can come out differently.
+#define BIN_TILE_SIZE       64
+#define BIN_MAX_WORKERS     64
+#define BIN_MAX_TRIANGLES   65536		// The batch is flushed when it fills up
+
+typedef struct {
+	int triangle;               // Index into triangles
+	float nearest;              // Largest rhw of its vertices
+}	bin_item_t;
+
+typedef struct {
+	bin_item_t *items;          // In submission order
+	int count;
+	int capacity;
+}	bin_t;
+
+#ifdef _WIN32
+typedef HANDLE bin_thread_t;
+typedef CRITICAL_SECTION bin_mutex_t;
+typedef CONDITION_VARIABLE bin_cond_t;
+#define bin_fetch_add(ptr, x)   InterlockedExchangeAdd((volatile LONG*)(ptr), (x))
+#define bin_lock(m)             EnterCriticalSection(m)
+#define bin_unlock(m)           LeaveCriticalSection(m)
+#define bin_wait(c, m)          SleepConditionVariableCS((c), (m), INFINITE)
+#define bin_broadcast(c)        WakeAllConditionVariable(c)
+#else
+typedef pthread_t bin_thread_t;
+typedef pthread_mutex_t bin_mutex_t;
+typedef pthread_cond_t bin_cond_t;
+#define bin_fetch_add(ptr, x)   __sync_fetch_and_add((ptr), (x))
+#define bin_lock(m)             pthread_mutex_lock(m)
+#define bin_unlock(m)           pthread_mutex_unlock(m)
+#define bin_wait(c, m)          pthread_cond_wait((c), (m))
+#define bin_broadcast(c)        pthread_cond_broadcast(c)
+#endif
+
+typedef struct {
+	device_t *device;
+	vertex_t *triangles;        // Three screen space vertices per triangle
+	int triangle_count;
+	bin_t *bins;                // bins[tiles_x * ty + tx]
+	int tiles_x;
+	int tiles_y;
+	int worker_count;
+	int front_to_back;          // Sort each tile by depth before drawing it
+	volatile long next_tile;    // Next tile for a worker to take
+	// Workers besides the flushing thread, started once and parked on wake
+	// between flushes. done wakes the flushing thread when busy drops to 0.
+	bin_thread_t threads[BIN_MAX_WORKERS];
+	int thread_count;
+	bin_mutex_t lock;
+	bin_cond_t wake;
+	bin_cond_t done;
+	int generation;             // Flushes started so far
+	int busy;                   // Workers still on the current flush
+	int quit;
+}	binner_t;
+
+// Nearest first, ties in submission order
+static int bin_item_compare(const void *a, const void *b) {
+	const bin_item_t *x = (const bin_item_t*)a, *y = (const bin_item_t*)b;
+	if (x->nearest != y->nearest) return x->nearest > y->nearest ? -1 : 1;
+	return x->triangle - y->triangle;
+}
+
+static void binner_render_tile(binner_t *binner, int tile) {
+	bin_t *bin = &binner->bins[tile];
+	device_t device = *binner->device;
+	int i;
+	device.clip_left = (tile % binner->tiles_x) * BIN_TILE_SIZE;
+	device.clip_top = (tile / binner->tiles_x) * BIN_TILE_SIZE;
+	device.clip_right = CMID(device.clip_left + BIN_TILE_SIZE, 0, device.width);
+	device.clip_bottom = CMID(device.clip_top + BIN_TILE_SIZE, 0, device.height);
+	if (binner->front_to_back) 
+		qsort(bin->items, bin->count, sizeof(bin_item_t), bin_item_compare);
+	for (i = 0; i < bin->count; i++) {
+		const vertex_t *t = &binner->triangles[bin->items[i].triangle * 3];
+		device_draw_triangle(&device, &t[0], &t[1], &t[2]);
+	}
+	// Trapezoids leave the Hi-Z behind, catch up so the next batch can use it
+	if ((device.render_state & RENDER_STATE_HALFSPACE) == 0) 
+		device_hiz_build(&device, device.clip_left, device.clip_top, device.clip_right, device.clip_bottom);
+}
+
+static void binner_work(binner_t *binner) {
+	int tiles = binner->tiles_x * binner->tiles_y;
+	while (1) {
+		int tile = (int)bin_fetch_add(&binner->next_tile, 1);
+		if (tile >= tiles) break;
+		if (binner->bins[tile].count > 0) binner_render_tile(binner, tile);
+	}
+}
+
+#ifdef _WIN32
+static DWORD WINAPI binner_worker(LPVOID arg)
+#else
+static void *binner_worker(void *arg)
+#endif
+{
+	binner_t *binner = (binner_t*)arg;
+	int seen = 0;
+	while (1) {
+		bin_lock(&binner->lock);
+		while (binner->generation == seen && !binner->quit) 
+			bin_wait(&binner->wake, &binner->lock);
+		if (binner->quit) {
+			bin_unlock(&binner->lock);
+			break;
+		}
+		seen = binner->generation;
+		bin_unlock(&binner->lock);
+
+		binner_work(binner);
+
+		bin_lock(&binner->lock);
+		if (--binner->busy == 0) bin_broadcast(&binner->done);
+		bin_unlock(&binner->lock);
+	}
+	return 0;
+}
+
+// workers = 0 uses one per processor
+void binner_init(binner_t *binner, device_t *device, int workers) {
+	int tiles;
+	if (workers <= 0) {
+#ifdef _WIN32
+		SYSTEM_INFO info;
+		GetSystemInfo(&info);
+		workers = (int)info.dwNumberOfProcessors;
+#else
+		workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+	}
+	binner->device = device;
+	binner->worker_count = CMID(workers, 1, BIN_MAX_WORKERS);
+	binner->tiles_x = (device->width + BIN_TILE_SIZE - 1) / BIN_TILE_SIZE;
+	binner->tiles_y = (device->height + BIN_TILE_SIZE - 1) / BIN_TILE_SIZE;
+	tiles = binner->tiles_x * binner->tiles_y;
+	binner->bins = (bin_t*)calloc(tiles, sizeof(bin_t));
+	binner->triangles = (vertex_t*)malloc(sizeof(vertex_t) * 3 * BIN_MAX_TRIANGLES);
+	binner->triangle_count = 0;
+	binner->front_to_back = 0;
+	binner->next_tile = 0;
+	binner->generation = 0;
+	binner->busy = 0;
+	binner->quit = 0;
+	binner->thread_count = 0;
+	assert(binner->bins && binner->triangles);
+
+#ifdef _WIN32
+	InitializeCriticalSection(&binner->lock);
+	InitializeConditionVariable(&binner->wake);
+	InitializeConditionVariable(&binner->done);
+#else
+	pthread_mutex_init(&binner->lock, NULL);
+	pthread_cond_init(&binner->wake, NULL);
+	pthread_cond_init(&binner->done, NULL);
+#endif
+	while (binner->thread_count < binner->worker_count - 1) {
+		bin_thread_t *thread = &binner->threads[binner->thread_count];
+#ifdef _WIN32
+		*thread = CreateThread(NULL, 0, binner_worker, binner, 0, NULL);
+		if (*thread == NULL) break;
+#else
+		if (pthread_create(thread, NULL, binner_worker, binner) != 0) break;
+#endif
+		binner->thread_count++;
 	}
 }
 
+void binner_destroy(binner_t *binner) {
+	int i;
+	bin_lock(&binner->lock);
+	binner->quit = 1;
+	bin_broadcast(&binner->wake);
+	bin_unlock(&binner->lock);
+	for (i = 0; i < binner->thread_count; i++) {
+#ifdef _WIN32
+		WaitForSingleObject(binner->threads[i], INFINITE);
+		CloseHandle(binner->threads[i]);
+#else
+		pthread_join(binner->threads[i], NULL);
+#endif
+	}
+	binner->thread_count = 0;
+#ifdef _WIN32
+	DeleteCriticalSection(&binner->lock);
+#else
+	pthread_mutex_destroy(&binner->lock);
+	pthread_cond_destroy(&binner->wake);
+	pthread_cond_destroy(&binner->done);
+#endif
+	for (i = 0; i < binner->tiles_x * binner->tiles_y; i++) 
+		free(binner->bins[i].items);
+	free(binner->bins);
+	free(binner->triangles);
+	binner->bins = NULL;
+	binner->triangles = NULL;
+}
 
+// Rasterize every queued triangle and empty the batch
+void binner_flush(binner_t *binner) {
+	int i;
+	if (binner->triangle_count == 0) return;
+
+	bin_lock(&binner->lock);
+	binner->next_tile = 0;
+	binner->busy = binner->thread_count;
+	binner->generation++;
+	bin_broadcast(&binner->wake);
+	bin_unlock(&binner->lock);
+
+	binner_work(binner);		// The calling thread works too
+	bin_lock(&binner->lock);
+	while (binner->busy > 0) bin_wait(&binner->done, &binner->lock);
+	bin_unlock(&binner->lock);
+
+	for (i = 0; i < binner->tiles_x * binner->tiles_y; i++) 
+		binner->bins[i].count = 0;
+	binner->triangle_count = 0;
+}
+
+// Sort the triangle just written to the next free slot into its tiles
+static void binner_add_triangle(binner_t *binner) {
+	vertex_t *t = &binner->triangles[binner->triangle_count * 3];
+	float minx, miny, maxx, maxy, nearest;
+	int tx, ty, tx0, ty0, tx1, ty1;
+
+	nearest = t[0].rhw > t[1].rhw ? t[0].rhw : t[1].rhw;
+	nearest = nearest > t[2].rhw ? nearest : t[2].rhw;
+
+	minx = t[0].pos.x < t[1].pos.x ? t[0].pos.x : t[1].pos.x;
+	minx = minx < t[2].pos.x ? minx : t[2].pos.x;
+	maxx = t[0].pos.x > t[1].pos.x ? t[0].pos.x : t[1].pos.x;
+	maxx = maxx > t[2].pos.x ? maxx : t[2].pos.x;
+	miny = t[0].pos.y < t[1].pos.y ? t[0].pos.y : t[1].pos.y;
+	miny = miny < t[2].pos.y ? miny : t[2].pos.y;
+	maxy = t[0].pos.y > t[1].pos.y ? t[0].pos.y : t[1].pos.y;
+	maxy = maxy > t[2].pos.y ? maxy : t[2].pos.y;
+
+	// One pixel of slack for rounding in the rasterizers and line drawing
+	tx0 = CMID((int)minx - 1, 0, binner->device->width - 1) / BIN_TILE_SIZE;
+	ty0 = CMID((int)miny - 1, 0, binner->device->height - 1) / BIN_TILE_SIZE;
+	tx1 = CMID((int)maxx + 1, 0, binner->device->width - 1) / BIN_TILE_SIZE;
+	ty1 = CMID((int)maxy + 1, 0, binner->device->height - 1) / BIN_TILE_SIZE;
+
+	for (ty = ty0; ty <= ty1; ty++) {
+		for (tx = tx0; tx <= tx1; tx++) {
+			bin_t *bin = &binner->bins[ty * binner->tiles_x + tx];
+			if (bin->count == bin->capacity) {
+				bin->capacity = bin->capacity ? bin->capacity * 2 : 256;
+				bin->items = (bin_item_t*)realloc(bin->items, sizeof(bin_item_t) * bin->capacity);
+				assert(bin->items);
+			}
+			bin->items[bin->count].triangle = binner->triangle_count;
+			bin->items[bin->count++].nearest = nearest;
+		}
+	}
+
+	if (++binner->triangle_count == BIN_MAX_TRIANGLES) 
+		binner_flush(binner);
+}
+
+// Queue a triangle, same arguments as device_draw_primitive. It is
+// transformed right away, render_state is read when the batch is flushed.
+void binner_add_primitive(binner_t *binner, const vertex_t *v1, 
+	const vertex_t *v2, const vertex_t *v3) {
+	vertex_t *t = &binner->triangles[binner->triangle_count * 3];
+	if (device_setup_primitive(binner->device, t, v1, v2, v3)) 
+		binner_add_triangle(binner);
+}
+
+// Queue a triangle list, same arguments as device_draw_indexed
+void binner_add_indexed(binner_t *binner, const vertex_t *vertices, int vertex_count, 
+	const int *indices, int index_count) {
+	int i;
+	if (vertex_count <= 0) return;
+	device_transform_vertices(binner->device, vertices, vertex_count);
+	for (i = 0; i + 2 < index_count; i += 3) {
+		vertex_t *t = &binner->triangles[binner->triangle_count * 3];
+		if (device_assemble_triangle(binner->device, t, vertices, indices[i], indices[i + 1], indices[i + 2]))
+			binner_add_triangle(binner);
+	}
+}
+
+
+//=====================================================================
+// Meshes: triangles grouped into clusters that are culled as a whole
+//=====================================================================
+// mesh_init sorts the triangles along a Morton curve so each run of
+// MESH_CLUSTER_TRIANGLES is spatially compact, and gives every cluster its
+// own vertices. A cluster outside the frustum, or whose normal cone faces
+// away from the camera, is skipped before any of its vertices are transformed.
+#define MESH_CLUSTER_TRIANGLES  128
+
+typedef struct {
+	vector_t center;            // Bounding sphere in object space
+	float radius;
+	vector_t axis;              // Normal cone: average facing of the triangles
+	float cutoff;               // Sine of the cone's half angle, 1 if it cannot be culled
+	int first_vertex, vertex_count;
+	int first_index, index_count;	// Indices are relative to first_vertex
+}	mesh_cluster_t;
+
+typedef struct {
+	vertex_t *vertices;
+	int *indices;
+	mesh_cluster_t *clusters;
+	int cluster_count;
+}	mesh_t;
+
+typedef struct { IUINT32 code; int triangle; } mesh_sort_t;
+
+static int mesh_sort_compare(const void *a, const void *b) {
+	const mesh_sort_t *x = (const mesh_sort_t*)a, *y = (const mesh_sort_t*)b;
+	if (x->code != y->code) return x->code < y->code ? -1 : 1;
+	return x->triangle - y->triangle;
+}
+
+// Spread the low 10 bits of x so there are two zero bits between each
+static IUINT32 mesh_morton_spread(IUINT32 x) {
+	x &= 0x3ff;
+	x = (x | (x << 16)) & 0x030000ff;
+	x = (x | (x << 8)) & 0x0300f00f;
+	x = (x | (x << 4)) & 0x030c30c3;
+	x = (x | (x << 2)) & 0x09249249;
+	return x;
+}
+
+// Normal of triangle a, b, c on the side device_backface keeps, not normalized
+static void mesh_face_normal(vector_t *n, const point_t *a, const point_t *b, const point_t *c) {
+	vector_t ab, ac;
+	vector_sub(&ab, b, a);
+	vector_sub(&ac, c, a);
+	vector_crossproduct(n, &ab, &ac);
+}
+
+static void mesh_cluster_bounds(mesh_cluster_t *cluster, const vertex_t *vertices, const int *indices) {
+	vector_t bmin = vertices[0].pos, bmax = vertices[0].pos, sum = { 0, 0, 0, 0 };
+	float radius2 = 0.0f, mindp = 1.0f;
+	int i;
+	for (i = 1; i < cluster->vertex_count; i++) {
+		const point_t *p = &vertices[i].pos;
+		if (p->x < bmin.x) bmin.x = p->x;
+		if (p->y < bmin.y) bmin.y = p->y;
+		if (p->z < bmin.z) bmin.z = p->z;
+		if (p->x > bmax.x) bmax.x = p->x;
+		if (p->y > bmax.y) bmax.y = p->y;
+		if (p->z > bmax.z) bmax.z = p->z;
+	}
+	vector_interp(&cluster->center, &bmin, &bmax, 0.5f);
+	for (i = 0; i < cluster->vertex_count; i++) {
+		vector_t d;
+		vector_sub(&d, &vertices[i].pos, &cluster->center);
+		if (vector_dotproduct(&d, &d) > radius2) radius2 = vector_dotproduct(&d, &d);
+	}
+	cluster->radius = (float)sqrt(radius2);
+
+	for (i = 0; i < cluster->index_count; i += 3) {
+		vector_t n;
+		mesh_face_normal(&n, &vertices[indices[i]].pos, &vertices[indices[i + 1]].pos, &vertices[indices[i + 2]].pos);
+		vector_normalize(&n);
+		sum.x += n.x, sum.y += n.y, sum.z += n.z;
+	}
+	cluster->axis = sum;
+	vector_normalize(&cluster->axis);
+	for (i = 0; i < cluster->index_count; i += 3) {
+		vector_t n;
+		float dp;
+		mesh_face_normal(&n, &vertices[indices[i]].pos, &vertices[indices[i + 1]].pos, &vertices[indices[i + 2]].pos);
+		if (vector_length(&n) == 0.0f) continue;	// No area, never drawn
+		vector_normalize(&n);
+		dp = vector_dotproduct(&n, &cluster->axis);
+		if (dp < mindp) mindp = dp;
+	}
+	// Cones wider than a hemisphere always have a triangle facing the camera
+	cluster->cutoff = (mindp <= 0.1f)? 1.0f : (float)sqrt(1.0f - mindp * mindp);
+}
+
+void mesh_destroy(mesh_t *mesh) {
+	free(mesh->vertices);
+	free(mesh->indices);
+	free(mesh->clusters);
+	memset(mesh, 0, sizeof(mesh_t));
+}
+
+// Build a mesh from a triangle list, the arrays are copied. Returns 0 on success.
+int mesh_init(mesh_t *mesh, const vertex_t *vertices, int vertex_count, const int *indices, int index_count) {
+	int triangle_count = index_count / 3, used = 0, i, j, k;
+	mesh_sort_t *order;
+	int *remap;
+	vector_t bmin, bmax;
+	float sx, sy, sz;
+
+	memset(mesh, 0, sizeof(mesh_t));
+	if (triangle_count <= 0 || vertex_count <= 0) return 0;
+	order = (mesh_sort_t*)malloc(sizeof(mesh_sort_t) * triangle_count);
+	remap = (int*)malloc(sizeof(int) * vertex_count);
+	mesh->vertices = (vertex_t*)malloc(sizeof(vertex_t) * triangle_count * 3);
+	mesh->indices = (int*)malloc(sizeof(int) * triangle_count * 3);
+	mesh->clusters = (mesh_cluster_t*)malloc(sizeof(mesh_cluster_t) * 
+		((triangle_count + MESH_CLUSTER_TRIANGLES - 1) / MESH_CLUSTER_TRIANGLES));
+	if (!order || !remap || !mesh->vertices || !mesh->indices || !mesh->clusters) {
+		free(order);
+		free(remap);
+		mesh_destroy(mesh);
+		return -1;
+	}
+
+	bmin = bmax = vertices[0].pos;
+	for (i = 1; i < vertex_count; i++) {
+		const point_t *p = &vertices[i].pos;
+		if (p->x < bmin.x) bmin.x = p->x;
+		if (p->y < bmin.y) bmin.y = p->y;
+		if (p->z < bmin.z) bmin.z = p->z;
+		if (p->x > bmax.x) bmax.x = p->x;
+		if (p->y > bmax.y) bmax.y = p->y;
+		if (p->z > bmax.z) bmax.z = p->z;
+	}
+	sx = (bmax.x > bmin.x)? 1023.0f / (bmax.x - bmin.x) : 0.0f;
+	sy = (bmax.y > bmin.y)? 1023.0f / (bmax.y - bmin.y) : 0.0f;
+	sz = (bmax.z > bmin.z)? 1023.0f / (bmax.z - bmin.z) : 0.0f;
+	for (i = 0; i < triangle_count; i++) {
+		const point_t *a = &vertices[indices[i * 3]].pos;
+		const point_t *b = &vertices[indices[i * 3 + 1]].pos;
+		const point_t *c = &vertices[indices[i * 3 + 2]].pos;
+		float x = ((a->x + b->x + c->x) / 3.0f - bmin.x) * sx;
+		float y = ((a->y + b->y + c->y) / 3.0f - bmin.y) * sy;
+		float z = ((a->z + b->z + c->z) / 3.0f - bmin.z) * sz;
+		order[i].code = mesh_morton_spread((IUINT32)x) | (mesh_morton_spread((IUINT32)y) << 1) | 
+			(mesh_morton_spread((IUINT32)z) << 2);
+		order[i].triangle = i;
+	}
+	qsort(order, triangle_count, sizeof(mesh_sort_t), mesh_sort_compare);
+
+	for (i = 0; i < vertex_count; i++) remap[i] = -1;
+	for (i = 0; i < triangle_count; i += MESH_CLUSTER_TRIANGLES) {
+		mesh_cluster_t *cluster = &mesh->clusters[mesh->cluster_count++];
+		int end = (i + MESH_CLUSTER_TRIANGLES < triangle_count)? i + MESH_CLUSTER_TRIANGLES : triangle_count;
+		vertex_t *dst = mesh->vertices + used;
+		int *out = mesh->indices + i * 3;
+		cluster->first_vertex = used;
+		cluster->vertex_count = 0;
+		cluster->first_index = i * 3;
+		cluster->index_count = (end - i) * 3;
+		for (k = i; k < end; k++) {
+			for (j = 0; j < 3; j++) {
+				int v = indices[order[k].triangle * 3 + j];
+				if (remap[v] < 0) {
+					remap[v] = cluster->vertex_count++;
+					dst[remap[v]] = vertices[v];
+				}
+				*out++ = remap[v];
+			}
+		}
+		for (k = i; k < end; k++) {
+			for (j = 0; j < 3; j++) remap[indices[order[k].triangle * 3 + j]] = -1;
+		}
+		used += cluster->vertex_count;
+		mesh_cluster_bounds(cluster, dst, mesh->indices + i * 3);
+	}
+	free(order);
+	free(remap);
+	return 0;
+}
+
+// Camera position in object space, where world * view puts the origin.
+// Returns the sign of the determinant: -1 if world mirrors the mesh.
+static int transform_eye(const transform_t *ts, vector_t *eye) {
+	matrix_t m;
+	vector_t a0, a1, a2, t, c;
+	float det;
+	matrix_mul(&m, &ts->world, &ts->view);
+	a0.x = m.m[0][0], a0.y = m.m[0][1], a0.z = m.m[0][2];
+	a1.x = m.m[1][0], a1.y = m.m[1][1], a1.z = m.m[1][2];
+	a2.x = m.m[2][0], a2.y = m.m[2][1], a2.z = m.m[2][2];
+	t.x = -m.m[3][0], t.y = -m.m[3][1], t.z = -m.m[3][2];
+	vector_crossproduct(&c, &a1, &a2);
+	det = vector_dotproduct(&a0, &c);
+	if (det == 0.0f) return 0;
+	eye->x = vector_dotproduct(&t, &c) / det;		// Cramer's rule for eye * m = origin
+	vector_crossproduct(&c, &a2, &a0);
+	eye->y = vector_dotproduct(&t, &c) / det;
+	vector_crossproduct(&c, &a0, &a1);
+	eye->z = vector_dotproduct(&t, &c) / det;
+	eye->w = 1.0f;
+	return (det > 0.0f)? 1 : -1;
+}
+
+// Object space frustum planes of the cvv, normalized so that
+// plane.x * x + plane.y * y + plane.z * z + plane.w is the distance inside
+static void transform_frustum(const transform_t *ts, vector_t planes[6]) {
+	const float (*m)[4] = ts->transform.m;
+	int i, r;
+	for (i = 0; i < 6; i++) {
+		float p[4], length;
+		for (r = 0; r < 4; r++) {
+			switch (i) {
+			case 0: p[r] = m[r][2]; break;					// z >= 0
+			case 1: p[r] = m[r][3] - m[r][2]; break;		// z <= w
+			case 2: p[r] = m[r][3] + m[r][0]; break;		// x >= -w
+			case 3: p[r] = m[r][3] - m[r][0]; break;		// x <= w
+			case 4: p[r] = m[r][3] + m[r][1]; break;		// y >= -w
+			default: p[r] = m[r][3] - m[r][1]; break;		// y <= w
+			}
+		}
+		length = (float)sqrt(p[0] * p[0] + p[1] * p[1] + p[2] * p[2]);
+		if (length == 0.0f) length = 1.0f;
+		planes[i].x = p[0] / length, planes[i].y = p[1] / length;
+		planes[i].z = p[2] / length, planes[i].w = p[3] / length;
+	}
+}
+
+// Returns 1 if any of the cluster may be drawn under the current transform
+static int mesh_cluster_visible(const device_t *device, const mesh_cluster_t *cluster, 
+	const vector_t planes[6], const vector_t *eye, int facing) {
+	const vector_t *c = &cluster->center;
+	int i;
+	for (i = 0; i < 6; i++) {
+		if (planes[i].x * c->x + planes[i].y * c->y + planes[i].z * c->z + planes[i].w < -cluster->radius) 
+			return 0;
+	}
+	if ((device->render_state & RENDER_STATE_CULL) && facing != 0 && cluster->cutoff < 1.0f) {
+		vector_t d;
+		vector_sub(&d, c, eye);
+		if (facing * vector_dotproduct(&d, &cluster->axis) >= 
+			cluster->cutoff * vector_length(&d) + cluster->radius) return 0;
+	}
+	return 1;
+}
+
+// Draw the clusters of mesh that can be seen. Returns how many were drawn.
+int device_draw_mesh(device_t *device, const mesh_t *mesh) {
+	vector_t planes[6], eye;
+	int facing = transform_eye(&device->transform, &eye), drawn = 0, i;
+	transform_frustum(&device->transform, planes);
+	for (i = 0; i < mesh->cluster_count; i++) {
+		const mesh_cluster_t *cluster = &mesh->clusters[i];
+		if (!mesh_cluster_visible(device, cluster, planes, &eye, facing)) continue;
+		device_draw_indexed(device, mesh->vertices + cluster->first_vertex, cluster->vertex_count, 
+			mesh->indices + cluster->first_index, cluster->index_count);
+		drawn++;
+	}
+	return drawn;
+}
+
+// Queue the visible clusters of mesh, same culling as device_draw_mesh
+int binner_add_mesh(binner_t *binner, const mesh_t *mesh) {
+	vector_t planes[6], eye;
+	int facing = transform_eye(&binner->device->transform, &eye), drawn = 0, i;
+	transform_frustum(&binner->device->transform, planes);
+	for (i = 0; i < mesh->cluster_count; i++) {
+		const mesh_cluster_t *cluster = &mesh->clusters[i];
+		if (!mesh_cluster_visible(binner->device, cluster, planes, &eye, facing)) continue;
+		binner_add_indexed(binner, mesh->vertices + cluster->first_vertex, cluster->vertex_count, 
+			mesh->indices + cluster->first_index, cluster->index_count);
+		drawn++;
+	}
+	return drawn;
+}
+
+
+//=====================================================================
+// Image files: save a framebuffer (0x00RRGGBB rows) as PPM or PNG
+//=====================================================================
+// Both return 0 on success. pitch is the distance between rows in bytes, so
+// the device framebuffer or any caller-owned buffer can be saved directly.
+int image_write_ppm(const char *path, const void *bits, long pitch, int w, int h) {
+	unsigned char *row = (unsigned char*)malloc(w * 3 + 1);
+	FILE *fp = fopen(path, "wb");
+	int x, y, hr = 0;
+	if (fp == NULL || row == NULL) {
+		if (fp) fclose(fp);
+		free(row);
+		return -1;
+	}
+	fprintf(fp, "P6\n%d %d\n255\n", w, h);
+	for (y = 0; y < h; y++) {
+		const IUINT32 *src = (const IUINT32*)((const char*)bits + pitch * y);
+		for (x = 0; x < w; x++) {
+			row[x * 3 + 0] = (unsigned char)(src[x] >> 16);
+			row[x * 3 + 1] = (unsigned char)(src[x] >> 8);
+			row[x * 3 + 2] = (unsigned char)(src[x]);
+		}
+		if (fwrite(row, 3, w, fp) != (size_t)w) hr = -2;
+	}
+	if (fclose(fp) != 0) hr = -2;
+	free(row);
+	return hr;
+}
+
+// Deflate output: bits are packed from the least significant end
+typedef struct {
+	unsigned char *data;
+	int size;
+	IUINT32 bits;
+	int count;
+}	bit_writer_t;
+
+static void bit_writer_put(bit_writer_t *bw, IUINT32 value, int count) {
+	bw->bits |= value << bw->count;
+	bw->count += count;
+	while (bw->count >= 8) {
+		bw->data[bw->size++] = (unsigned char)bw->bits;
+		bw->bits >>= 8;
+		bw->count -= 8;
+	}
+}
+
+// Huffman codes go most significant bit first
+static void bit_writer_code(bit_writer_t *bw, IUINT32 code, int count) {
+	IUINT32 reversed = 0;
+	int i;
+	for (i = 0; i < count; i++) reversed |= ((code >> i) & 1) << (count - 1 - i);
+	bit_writer_put(bw, reversed, count);
+}
+
+// Literal or length symbol from the fixed Huffman table
+static void deflate_symbol(bit_writer_t *bw, int symbol) {
+	if (symbol < 144) bit_writer_code(bw, 0x30 + symbol, 8);
+	else if (symbol < 256) bit_writer_code(bw, 0x190 + symbol - 144, 9);
+	else if (symbol < 280) bit_writer_code(bw, symbol - 256, 7);
+	else bit_writer_code(bw, 0xc0 + symbol - 280, 8);
+}
+
+// One fixed Huffman block whose only matches repeat the previous byte. With
+// the Sub filter a flat background becomes runs of zeros, which is where
+// thumbnails spend most of their bytes. out needs size * 9 / 8 + 8 bytes.
+static int deflate_runs(const unsigned char *src, int size, unsigned char *out) {
+	static const int base[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 
+		35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+	static const int extra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 
+		3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+	bit_writer_t bw = { out, 0, 0, 0 };
+	int i = 0;
+	bit_writer_put(&bw, 3, 3);		// final block, fixed codes
+	while (i < size) {
+		int run = 0, code = 28;
+		if (i > 0) {
+			while (run < 258 && i + run < size && src[i + run] == src[i - 1]) run++;
+		}
+		if (run < 3) {
+			deflate_symbol(&bw, src[i++]);
+			continue;
+		}
+		while (base[code] > run) code--;
+		deflate_symbol(&bw, 257 + code);
+		bit_writer_put(&bw, run - base[code], extra[code]);
+		bit_writer_code(&bw, 0, 5);		// distance 1
+		i += run;
+	}
+	deflate_symbol(&bw, 256);
+	if (bw.count > 0) bit_writer_put(&bw, 0, 8 - bw.count);
+	return bw.size;
+}
+
+static IUINT32 png_crc(IUINT32 crc, const unsigned char *data, int size) {
+	static IUINT32 table[256];
+	static int ready = 0;
+	int i, k;
+	if (!ready) {
+		for (i = 0; i < 256; i++) {
+			IUINT32 c = (IUINT32)i;
+			for (k = 0; k < 8; k++) c = (c & 1)? 0xedb88320u ^ (c >> 1) : c >> 1;
+			table[i] = c;
+		}
+		ready = 1;
+	}
+	crc = ~crc;
+	for (i = 0; i < size; i++) crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+
+static void png_put32(unsigned char *p, IUINT32 x) {
+	p[0] = (unsigned char)(x >> 24), p[1] = (unsigned char)(x >> 16);
+	p[2] = (unsigned char)(x >> 8), p[3] = (unsigned char)x;
+}
+
+// Chunk data must be preceded by 8 free bytes for length and type
+static int png_chunk(FILE *fp, const char *type, unsigned char *chunk, int size) {
+	unsigned char crc[4];
+	png_put32(chunk, size);
+	memcpy(chunk + 4, type, 4);
+	png_put32(crc, png_crc(0, chunk + 4, size + 4));
+	if (fwrite(chunk, 1, size + 8, fp) != (size_t)(size + 8)) return -1;
+	return (fwrite(crc, 1, 4, fp) == 4)? 0 : -1;
+}
+
+// 8-bit RGB with the Sub filter on every row
+int image_write_png(const char *path, const void *bits, long pitch, int w, int h) {
+	static const unsigned char signature[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+	int stride = w * 3 + 1, raw_size = stride * h;
+	unsigned char *raw = (unsigned char*)malloc(raw_size);
+	unsigned char *chunk = (unsigned char*)malloc(8 + 2 + raw_size * 9 / 8 + 8 + 4);
+	IUINT32 a = 1, b = 0;
+	FILE *fp = NULL;
+	int x, y, i, size, hr = -1;
+	if (raw == NULL || chunk == NULL) goto done;
+	for (y = 0; y < h; y++) {
+		const IUINT32 *src = (const IUINT32*)((const char*)bits + pitch * y);
+		unsigned char *dst = raw + stride * y;
+		IUINT32 prev = 0;
+		dst[0] = 1;
+		for (x = 0; x < w; x++, prev = src[x - 1]) {
+			dst[1 + x * 3 + 0] = (unsigned char)((src[x] >> 16) - (prev >> 16));
+			dst[1 + x * 3 + 1] = (unsigned char)((src[x] >> 8) - (prev >> 8));
+			dst[1 + x * 3 + 2] = (unsigned char)(src[x] - prev);
+		}
+	}
+	fp = fopen(path, "wb");
+	if (fp == NULL) goto done;
+	hr = -2;
+	if (fwrite(signature, 1, 8, fp) != 8) goto done;
+	png_put32(chunk + 8, w);
+	png_put32(chunk + 12, h);
+	chunk[16] = 8, chunk[17] = 2, chunk[18] = 0, chunk[19] = 0, chunk[20] = 0;
+	if (png_chunk(fp, "IHDR", chunk, 13)) goto done;
+	chunk[8] = 0x78, chunk[9] = 0x01;
+	size = 2 + deflate_runs(raw, raw_size, chunk + 10);
+	for (i = 0; i < raw_size; i++) {
+		a = (a + raw[i]) % 65521;
+		b = (b + a) % 65521;
+	}
+	png_put32(chunk + 8 + size, (b << 16) | a);
+	if (png_chunk(fp, "IDAT", chunk, size + 4)) goto done;
+	if (png_chunk(fp, "IEND", chunk, 0)) goto done;
+	hr = 0;
+done:
+	if (fp && fclose(fp) != 0 && hr == 0) hr = -2;
+	free(raw);
+	free(chunk);
+	return hr;
+}
+
+
+#ifdef _WIN32
 //=====================================================================
 // Win32 window and graphics drawing: provide a DibSection FB for device
 //=====================================================================
@@ -848,8 +2377,10 @@ void screen_update(void) {
 	ReleaseDC(screen_handle, hDC);
 	screen_dispatch();
 }
+#endif
 
 
+#ifndef MINI3D_NO_MAIN
 //=====================================================================
 // Main Program
 //=====================================================================
@@ -864,25 +2395,85 @@ vertex_t mesh[8] = {
 	{ { -1,  1, -1, 1 }, { 1, 0 }, { 0.2f, 1.0f, 0.3f }, 1 },
 };
 
-void draw_plane(device_t *device, int a, int b, int c, int d) {
-	vertex_t p1 = mesh[a], p2 = mesh[b], p3 = mesh[c], p4 = mesh[d];
-	p1.tc.u = 0, p1.tc.v = 0, p2.tc.u = 0, p2.tc.v = 1;
-	p3.tc.u = 1, p3.tc.v = 1, p4.tc.u = 1, p4.tc.v = 0;
-	device_draw_primitive(device, &p1, &p2, &p3);
-	device_draw_primitive(device, &p3, &p4, &p1);
-}
+binner_t *binner = NULL;	// When set, triangles go through the tile binner
 
+// Each face gets its own four corners so it can map the whole texture
 void draw_box(device_t *device, float theta) {
+	static const int faces[6][4] = { 
+		{ 0, 1, 2, 3 }, { 7, 6, 5, 4 }, { 0, 4, 5, 1 }, 
+		{ 1, 5, 6, 2 }, { 2, 6, 7, 3 }, { 3, 7, 4, 0 },
+	};
+	static const texcoord_t corners[4] = { { 0, 0 }, { 0, 1 }, { 1, 1 }, { 1, 0 } };
+	vector_t bmin = { -1, -1, -1, 1 }, bmax = { 1, 1, 1, 1 };
+	vertex_t vertices[24];
+	int indices[36], i, k;
 	matrix_t m;
 	matrix_set_rotate(&m, -1, -0.5, 1, theta);
 	device->transform.world = m;
 	transform_update(&device->transform);
-	draw_plane(device, 0, 1, 2, 3);
-	draw_plane(device, 7, 6, 5, 4);
-	draw_plane(device, 0, 4, 5, 1);
-	draw_plane(device, 1, 5, 6, 2);
-	draw_plane(device, 2, 6, 7, 3);
-	draw_plane(device, 3, 7, 4, 0);
+	if (!device_box_visible(device, &bmin, &bmax)) return;
+	for (i = 0; i < 6; i++) {
+		for (k = 0; k < 4; k++) {
+			vertices[i * 4 + k] = mesh[faces[i][k]];
+			vertices[i * 4 + k].tc = corners[k];
+		}
+		indices[i * 6 + 0] = i * 4 + 0, indices[i * 6 + 1] = i * 4 + 1, indices[i * 6 + 2] = i * 4 + 2;
+		indices[i * 6 + 3] = i * 4 + 2, indices[i * 6 + 4] = i * 4 + 3, indices[i * 6 + 5] = i * 4 + 0;
+	}
+	if (binner) {
+		binner_add_indexed(binner, vertices, 24, indices, 36);
+		binner_flush(binner);
+	}	else {
+		device_draw_indexed(device, vertices, 24, indices, 36);
+	}
+}
+
+mesh_t torus;		// Drawn instead of the box when show_torus is set
+int show_torus = 0;
+
+// A finely tessellated torus around the z axis, split into clusters
+void init_torus(mesh_t *mesh, int rings, int sides) {
+	int vertex_count = (rings + 1) * (sides + 1), n = 0, i, j;
+	vertex_t *vertices = (vertex_t*)malloc(sizeof(vertex_t) * vertex_count);
+	int *indices = (int*)malloc(sizeof(int) * rings * sides * 6);
+	assert(vertices && indices);
+	for (j = 0; j <= sides; j++) {
+		for (i = 0; i <= rings; i++) {
+			float u = i * 6.2831853f / rings, v = j * 6.2831853f / sides;
+			vertex_t *p = &vertices[j * (rings + 1) + i];
+			p->pos.x = (1.0f + 0.4f * (float)cos(v)) * (float)cos(u);
+			p->pos.y = (1.0f + 0.4f * (float)cos(v)) * (float)sin(u);
+			p->pos.z = 0.4f * (float)sin(v);
+			p->pos.w = 1.0f;
+			p->tc.u = (float)i / rings;
+			p->tc.v = (float)j / sides;
+			p->color.r = 0.5f + 0.5f * (float)cos(u);
+			p->color.g = 0.5f + 0.5f * (float)sin(v);
+			p->color.b = 0.6f;
+			p->rhw = 1.0f;
+		}
+	}
+	for (j = 0; j < sides; j++) {
+		for (i = 0; i < rings; i++) {
+			int a = j * (rings + 1) + i, b = a + 1, c = a + rings + 1, d = c + 1;
+			indices[n++] = a, indices[n++] = b, indices[n++] = c;
+			indices[n++] = b, indices[n++] = d, indices[n++] = c;
+		}
+	}
+	mesh_init(mesh, vertices, vertex_count, indices, n);
+	free(vertices);
+	free(indices);
+}
+
+void draw_torus(device_t *device, float theta) {
+	matrix_set_rotate(&device->transform.world, -1, -0.5, 1, theta);
+	transform_update(&device->transform);
+	if (binner) {
+		binner_add_mesh(binner, &torus);
+		binner_flush(binner);
+	}	else {
+		device_draw_mesh(device, &torus);
+	}
 }
 
 void camera_at_zero(device_t *device, float x, float y, float z) {
@@ -903,17 +2494,19 @@ void init_texture(device_t *device) {
 	device_set_texture(device, texture, 256 * 4, 256, 256);
 }
 
+#ifdef _WIN32
 int main(void)
 {
 	device_t device;
-	int states[] = { RENDER_STATE_TEXTURE, RENDER_STATE_COLOR, RENDER_STATE_WIREFRAME };
+	int states[] = { RENDER_STATE_TEXTURE | RENDER_STATE_CULL, RENDER_STATE_COLOR | RENDER_STATE_CULL, RENDER_STATE_WIREFRAME };
 	int indicator = 0;
-	int kbhit = 0;
+	int kbhit = 0, hkhit = 0, bkhit = 0, fkhit = 0, mkhit = 0, halfspace = 0, filter = 0;
+	binner_t tiles;
 	float alpha = 1;
 	float pos = 3.5;
 
 	TCHAR *title = _T("Mini3d (software render tutorial) - ")
-		_T("Left/Right: rotation, Up/Down: forward/backward, Space: switch state");
+		_T("Left/Right: rotation, Up/Down: forward/backward, Space: switch state, H: rasterizer, B: tiles, F: filter, M: mesh");
 
 	if (screen_init(800, 600, title)) 
 		return -1;
@@ -922,7 +2515,9 @@ int main(void)
 	camera_at_zero(&device, 3, 0, 0);
 
 	init_texture(&device);
-	device.render_state = RENDER_STATE_TEXTURE;
+	init_torus(&torus, 256, 128);
+	device.render_state = states[0];
+	binner_init(&tiles, &device, 0);
 
 	while (screen_exit == 0 && screen_keys[VK_ESCAPE] == 0) {
 		screen_dispatch();
@@ -938,16 +2533,94 @@ int main(void)
 			if (kbhit == 0) {
 				kbhit = 1;
 				if (++indicator >= 3) indicator = 0;
-				device.render_state = states[indicator];
+				device.render_state = states[indicator] | halfspace | filter;
 			}
 		}	else {
 			kbhit = 0;
 		}
 
-		draw_box(&device, alpha);
+		if (screen_keys['H']) {
+			if (hkhit == 0) {
+				hkhit = 1;
+				halfspace ^= RENDER_STATE_HALFSPACE;
+				device.render_state = states[indicator] | halfspace | filter;
+			}
+		}	else {
+			hkhit = 0;
+		}
+
+		if (screen_keys['B']) {
+			if (bkhit == 0) {
+				bkhit = 1;
+				binner = binner ? NULL : &tiles;
+			}
+		}	else {
+			bkhit = 0;
+		}
+
+		if (screen_keys['F']) {
+			if (fkhit == 0) {
+				fkhit = 1;
+				filter ^= RENDER_STATE_FILTER;
+				device.render_state = states[indicator] | halfspace | filter;
+			}
+		}	else {
+			fkhit = 0;
+		}
+
+		if (screen_keys['M']) {
+			if (mkhit == 0) {
+				mkhit = 1;
+				show_torus ^= 1;
+			}
+		}	else {
+			mkhit = 0;
+		}
+
+		if (show_torus) draw_torus(&device, alpha);
+		else draw_box(&device, alpha);
 		screen_update();
 		Sleep(1);
 	}
+	binner_destroy(&tiles);
 	return 0;
 }
 
+#else
+// No window: render each state, then the torus, into a buffer we own and save them
+int main(int argc, char *argv[])
+{
+	static const char *names[] = { "texture", "color", "wireframe", "mesh" };
+	int states[] = { RENDER_STATE_TEXTURE | RENDER_STATE_CULL, RENDER_STATE_COLOR | RENDER_STATE_CULL, 
+		RENDER_STATE_WIREFRAME, RENDER_STATE_TEXTURE | RENDER_STATE_CULL };
+	int width = 800, height = 600, i;
+	float alpha = (argc > 1)? (float)atof(argv[1]) : 1.0f;
+	IUINT32 *pixels = (IUINT32*)malloc(width * height * 4);
+	device_t device;
+	char path[64];
+
+	if (pixels == NULL) return -1;
+	device_init(&device, width, height, pixels);
+	init_texture(&device);
+	init_torus(&torus, 256, 128);
+	for (i = 0; i < 4; i++) {
+		device.render_state = states[i] | RENDER_STATE_HALFSPACE | RENDER_STATE_FILTER;
+		device_clear(&device, 1);
+		camera_at_zero(&device, 3.5, 0, 0);
+		if (i == 3) draw_torus(&device, alpha);
+		else draw_box(&device, alpha);
+		sprintf(path, "mini3d_%s.png", names[i]);
+		if (image_write_png(path, pixels, width * 4, width, height)) {
+			fprintf(stderr, "mini3d: cannot write %s\n", path);
+			break;
+		}
+		printf("%s\n", path);
+	}
+	mesh_destroy(&torus);
+	device_destroy(&device);
+	free(pixels);
+	return (i == 4)? 0 : -1;
+}
+#endif
+#endif
+
@@ -0,0 +1,158 @@
+// Bump allocator for transient allocations, plus a string builder on top of it.
+//
+// Allocations are never freed one at a time. The owner calls arena_reset
+// once the work is done: every frame for the frame arena, or at the end of a
+// job. If the arena spilled into extra blocks, the reset folds them into one
+// block big enough for everything, so a steady workload stops touching the
+// heap after the first few resets.
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <assert.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ARENA_ALIGNMENT 16
+#define ARENA_MIN_BLOCK (64 * 1024)
+
+typedef struct ArenaBlock {
+    struct ArenaBlock *prev;
+    size_t used;
+    size_t capacity;
+    _Alignas(ARENA_ALIGNMENT) char data[];
+} ArenaBlock;
+
+typedef struct {
+    ArenaBlock *block;
+    size_t total_capacity;
+} Arena;
+
+static inline ArenaBlock *arena_new_block(size_t capacity, ArenaBlock *prev) {
+    ArenaBlock *block = malloc(sizeof(ArenaBlock) + capacity);
+    assert(block);
+    block->prev = prev;
+    block->used = 0;
+    block->capacity = capacity;
+    return block;
+}
+
+static inline void *arena_alloc(Arena *arena, size_t size) {
+    size = (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+
+    ArenaBlock *block = arena->block;
+    if (!block || block->used + size > block->capacity) {
+        size_t capacity = block ? block->capacity * 2 : ARENA_MIN_BLOCK;
+        while (capacity < size) capacity *= 2;
+        block = arena->block = arena_new_block(capacity, block);
+        arena->total_capacity += capacity;
+    }
+
+    void *result = block->data + block->used;
+    block->used += size;
+    return result;
+}
+
+// Grows the most recent allocation in place if it is still at the top of the
+// current block. Returns false if the caller has to copy.
+static inline bool arena_extend(Arena *arena, void *ptr, size_t old_size, size_t new_size) {
+    ArenaBlock *block = arena->block;
+    old_size = (old_size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+    new_size = (new_size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+    if (!block || (char *)ptr + old_size != block->data + block->used) return false;
+    if (block->used - old_size + new_size > block->capacity) return false;
+    block->used = block->used - old_size + new_size;
+    return true;
+}
+
+static inline void arena_reset(Arena *arena) {
+    ArenaBlock *block = arena->block;
+    if (!block) return;
+
+    if (block->prev) {
+        while (block) {
+            ArenaBlock *prev = block->prev;
+            free(block);
+            block = prev;
+        }
+        arena->block = arena_new_block(arena->total_capacity, NULL);
+        return;
+    }
+
+    block->used = 0;
+}
+
+static inline void arena_free(Arena *arena) {
+    ArenaBlock *block = arena->block;
+    while (block) {
+        ArenaBlock *prev = block->prev;
+        free(block);
+        block = prev;
+    }
+    arena->block = NULL;
+    arena->total_capacity = 0;
+}
+
+// Null terminated string that doubles its capacity as it grows. Backed by an
+// arena when one is given, otherwise by the heap (free data when done).
+typedef struct {
+    char *data;
+    int size;
+    int capacity;
+    Arena *arena;
+} StringBuilder;
+
+static inline void sb_reserve(StringBuilder *sb, int capacity) {
+    if (capacity <= sb->capacity) return;
+
+    int new_capacity = sb->capacity ? sb->capacity : 256;
+    while (new_capacity < capacity) new_capacity *= 2;
+
+    if (!sb->arena) {
+        sb->data = realloc(sb->data, new_capacity);
+        assert(sb->data);
+    } else if (!sb->data || !arena_extend(sb->arena, sb->data, sb->capacity, new_capacity)) {
+        char *data = arena_alloc(sb->arena, new_capacity);
+        if (sb->data) memcpy(data, sb->data, sb->size + 1);
+        sb->data = data;
+    }
+
+    if (!sb->capacity) sb->data[0] = 0;
+    sb->capacity = new_capacity;
+}
+
+static inline void sb_append_len(StringBuilder *sb, const char *str, int len) {
+    sb_reserve(sb, sb->size + len + 1);
+    memcpy(sb->data + sb->size, str, len);
+    sb->size += len;
+    sb->data[sb->size] = 0;
+}
+
+static inline void sb_append(StringBuilder *sb, const char *str) {
+    assert(str);
+    sb_append_len(sb, str, (int)strlen(str));
+}
+
+__attribute__((format(printf, 2, 3)))
+static inline void sb_appendf(StringBuilder *sb, const char *format, ...) {
+    sb_reserve(sb, sb->size + 128);
+
+    va_list arg_ptr;
+    va_start(arg_ptr, format);
+    int added = vsnprintf(sb->data + sb->size, sb->capacity - sb->size, format, arg_ptr);
+    va_end(arg_ptr);
+
+    if (sb->size + added >= sb->capacity) {
+        sb_reserve(sb, sb->size + added + 1);
+        va_start(arg_ptr, format);
+        vsnprintf(sb->data + sb->size, sb->capacity - sb->size, format, arg_ptr);
+        va_end(arg_ptr);
+    }
+    sb->size += added;
+}
+
+#endif
@@ -0,0 +1,36 @@
+// Distance field of every shape but the selected one, read from the brick
+// cache that bricks.h bakes on the CPU. BRICK_CELLS, BRICK_SAMPLES and
+// BRICK_ATLAS are defined ahead of this file, and the selected shape is
+// folded in after it by append_baked_field.
+
+uniform sampler3D brickIndex;  // per brick: distance at the center, atlas slot or -1, packed rgb
+uniform sampler3D brickAtlas;  // BRICK_SAMPLES^3 texels per slot: distance, rgb
+uniform vec3 brickMin;
+uniform vec3 brickMax;
+uniform float brickSize;
+
+vec4 baked_field( vec3 p )
+{
+    // The surface stays a brick inside the grid, so from outside it is safe
+    // to step that much past the grid's side
+    vec3 outside = max(max(brickMin - p, p - brickMax), 0.0);
+    if( outside != vec3(0.0) ) return vec4(length(outside) + brickSize, vec3(0.0));
+
+    vec3 g = (p - brickMin)/brickSize;
+    ivec3 brick = min(ivec3(g), textureSize(brickIndex, 0) - 1);
+    vec4 entry = texelFetch(brickIndex, brick, 0);
+
+    if( entry.y < 0.0 )
+    {
+        // Far from the surface: bound the distance by the one at the center
+        int rgb = int(entry.z);
+        vec3 color = vec3(rgb & 255, (rgb >> 8) & 255, rgb >> 16)/255.0;
+        float r = length(g - vec3(brick) - 0.5)*brickSize;
+        return vec4(entry.x > 0.0 ? entry.x - r : entry.x + r, color);
+    }
+
+    int slot = int(entry.y);
+    vec3 corner = vec3(slot % BRICK_ATLAS, (slot / BRICK_ATLAS) % BRICK_ATLAS, slot / (BRICK_ATLAS*BRICK_ATLAS));
+    vec3 texel = corner*float(BRICK_SAMPLES) + 0.5 + clamp(g - vec3(brick), 0.0, 1.0)*float(BRICK_CELLS);
+    return texture(brickAtlas, texel/vec3(textureSize(brickAtlas, 0)));
+}
@@ -0,0 +1,350 @@
+// Sparse brick cache of a scene's distance field, baked on the job system.
+//
+// The scene's box is cut into a grid of bricks, BRICK_GRID along its longest
+// side, or fewer when the surface needs more slots than the atlas has. Every
+// brick records the distance and color at its center. Bricks close to the
+// surface also get BRICK_SAMPLES^3 samples, corners included, in a slot of an
+// atlas BRICK_ATLAS slots on a side, so filtering inside a brick never reads
+// a neighbour. Samples are staged as RGBA half floats: distance, then color.
+// Elsewhere the center distance minus the distance from the center is a safe
+// lower bound, and that coarse level is all the far field needs.
+//
+// A bake runs in two rounds of jobs: one job per slice of bricks measures
+// the centers, then the main thread hands atlas slots to the bricks that
+// need samples and a second round fills them in.
+//
+//     if (brick_bake_start(cache, spheres, count)) ...
+//     while (!brick_bake_poll(cache)) ...   // once per frame
+//     upload cache->staged for the slots of cache->staged_bricks
+//     brick_bake_end(cache);
+//
+// When only some shapes changed since the last bake, only the bricks around
+// them are sampled again. The other bricks keep their slots and samples.
+
+#ifndef BRICKS_H
+#define BRICKS_H
+
+#include <assert.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "jobs.h"
+#include "scene.h"
+
+#define BRICK_CELLS 8
+#define BRICK_SAMPLES (BRICK_CELLS + 1)
+#define BRICK_SAMPLE_COUNT (BRICK_SAMPLES * BRICK_SAMPLES * BRICK_SAMPLES)
+#define BRICK_GRID 32
+#define BRICK_GRID_MIN 8
+#define BRICK_ATLAS 18
+#define BRICK_SLOTS (BRICK_ATLAS * BRICK_ATLAS * BRICK_ATLAS)
+#define BRICK_NONE -1
+// Bricks per job in the sampling round
+#define BRICK_BATCH 32
+
+typedef uint16_t BrickTexel[4];
+
+typedef enum {
+    BRICK_IDLE,
+    BRICK_CENTERS,
+    BRICK_SAMPLING,
+    BRICK_DONE,
+} BrickStage;
+
+typedef struct BrickCache BrickCache;
+
+typedef struct {
+    BrickCache *cache;
+    int first, count;
+} BrickBatch;
+
+struct BrickCache {
+    // The grid covers min to max, dims bricks of side size, with grid bricks
+    // along its longest side
+    Vector3 min, max;
+    float size;
+    int dims[3];
+    int grid;
+    bool laid_out;
+
+    // Per brick, x fastest. Slot is BRICK_NONE for bricks without samples.
+    float center[BRICK_GRID * BRICK_GRID * BRICK_GRID];
+    uint32_t color[BRICK_GRID * BRICK_GRID * BRICK_GRID];
+    int slot[BRICK_GRID * BRICK_GRID * BRICK_GRID];
+    int free_slots[BRICK_SLOTS];
+    int free_count;
+    // Set when the surface needed more slots than the atlas has. The next
+    // bake lays out a coarser grid.
+    bool overflow;
+
+    // What the last bake sampled, to find what changed since
+    Sphere baked[MAX_SPHERES];
+    int baked_count;
+
+    // The bake in flight. Only bricks touching dirty_min to dirty_max are
+    // sampled again.
+    BrickStage stage;
+    SceneShape shapes[MAX_SPHERES];
+    int shape_count;
+    Vector3 dirty_min, dirty_max;
+    Job *jobs[(BRICK_GRID * BRICK_GRID * BRICK_GRID + BRICK_BATCH - 1) / BRICK_BATCH];
+    BrickBatch batches[(BRICK_GRID * BRICK_GRID * BRICK_GRID + BRICK_BATCH - 1) / BRICK_BATCH];
+    int job_count;
+
+    // Samples to upload once the bake is done, BRICK_SAMPLE_COUNT per brick
+    BrickTexel *staged;
+    int *staged_bricks;
+    int staged_count;
+};
+
+// Round to nearest even, flushing what half floats can't hold to zero or
+// infinity.
+static inline uint16_t brick_half(float value) {
+    union { float f; uint32_t u; } bits = { value };
+    const uint32_t sign = (bits.u >> 16) & 0x8000;
+    const uint32_t magnitude = bits.u & 0x7fffffff;
+    if (magnitude >= 0x47800000) return sign | 0x7c00;
+    if (magnitude < 0x38800000) return sign;
+    const uint32_t rounded = magnitude - 0x38000000 + 0xfff + ((magnitude >> 13) & 1);
+    return sign | (rounded >> 13);
+}
+
+static inline uint32_t brick_pack_color(Vector3 color) {
+    return (uint32_t)(color.x * 255 + 0.5f) | (uint32_t)(color.y * 255 + 0.5f) << 8 | (uint32_t)(color.z * 255 + 0.5f) << 16;
+}
+
+static inline int brick_count(const BrickCache *cache) {
+    return cache->dims[0] * cache->dims[1] * cache->dims[2];
+}
+
+static inline Vector3 brick_corner(const BrickCache *cache, int brick) {
+    const int x = brick % cache->dims[0];
+    const int y = brick / cache->dims[0] % cache->dims[1];
+    const int z = brick / (cache->dims[0] * cache->dims[1]);
+    return (Vector3){ cache->min.x + x * cache->size, cache->min.y + y * cache->size, cache->min.z + z * cache->size };
+}
+
+// Bricks whose center is this close to the surface get samples. The extra
+// cell keeps the normals' finite differences on sampled bricks.
+static inline float brick_near_distance(const BrickCache *cache) {
+    return cache->size * (0.8661f + 1.0f / BRICK_CELLS);
+}
+
+// Surface never reaches nearer than this to the sides of the grid, which
+// lets the shader step into the grid from outside without sampling it.
+static inline float brick_margin(const BrickCache *cache) {
+    return cache->size;
+}
+
+static inline void brick_layout(BrickCache *cache, Vector3 min, Vector3 max) {
+    const float longest = fmaxf(max.x - min.x, fmaxf(max.y - min.y, max.z - min.z));
+    // Pad by more than one brick of the padded box, see brick_margin
+    const float padding = longest / 14;
+    min = (Vector3){ min.x - padding, min.y - padding, min.z - padding };
+    cache->size = (longest + 2 * padding) / cache->grid;
+    cache->min = min;
+    cache->dims[0] = (int)fminf(cache->grid, ceilf((max.x + padding - min.x) / cache->size));
+    cache->dims[1] = (int)fminf(cache->grid, ceilf((max.y + padding - min.y) / cache->size));
+    cache->dims[2] = (int)fminf(cache->grid, ceilf((max.z + padding - min.z) / cache->size));
+    cache->max = (Vector3){
+        min.x + cache->dims[0] * cache->size,
+        min.y + cache->dims[1] * cache->size,
+        min.z + cache->dims[2] * cache->size,
+    };
+
+    for (int i = 0; i < brick_count(cache); i++) cache->slot[i] = BRICK_NONE;
+    for (int i = 0; i < BRICK_SLOTS; i++) cache->free_slots[i] = BRICK_SLOTS - 1 - i;
+    cache->free_count = BRICK_SLOTS;
+    cache->overflow = false;
+    cache->laid_out = true;
+}
+
+static inline void brick_centers_job(Job *job, void *data, Arena *arena) {
+    (void)job;
+    (void)arena;
+    BrickBatch *batch = data;
+    BrickCache *cache = batch->cache;
+    const float half = cache->size * 0.5f;
+    for (int i = batch->first; i < batch->first + batch->count; i++) {
+        const Vector3 corner = brick_corner(cache, i);
+        const SceneSample sample = scene_sample(cache->shapes, cache->shape_count,
+                                                (Vector3){ corner.x + half, corner.y + half, corner.z + half });
+        cache->center[i] = sample.distance;
+        cache->color[i] = brick_pack_color(sample.color);
+    }
+}
+
+static inline void brick_samples_job(Job *job, void *data, Arena *arena) {
+    (void)arena;
+    BrickBatch *batch = data;
+    BrickCache *cache = batch->cache;
+    const float step = cache->size / BRICK_CELLS;
+    for (int n = batch->first; n < batch->first + batch->count; n++) {
+        if (job_cancelled(job)) return;
+        const Vector3 corner = brick_corner(cache, cache->staged_bricks[n]);
+        BrickTexel *texel = cache->staged + (size_t)n * BRICK_SAMPLE_COUNT;
+        for (int z = 0; z < BRICK_SAMPLES; z++) {
+            for (int y = 0; y < BRICK_SAMPLES; y++) {
+                for (int x = 0; x < BRICK_SAMPLES; x++, texel++) {
+                    const Vector3 p = { corner.x + x * step, corner.y + y * step, corner.z + z * step };
+                    const SceneSample sample = scene_sample(cache->shapes, cache->shape_count, p);
+                    (*texel)[0] = brick_half(sample.distance);
+                    (*texel)[1] = brick_half(sample.color.x);
+                    (*texel)[2] = brick_half(sample.color.y);
+                    (*texel)[3] = brick_half(sample.color.z);
+                }
+            }
+        }
+    }
+}
+
+static inline void brick_submit(BrickCache *cache, JobFunction function, int total, int per_job) {
+    cache->job_count = 0;
+    for (int first = 0; first < total; first += per_job) {
+        BrickBatch *batch = &cache->batches[cache->job_count];
+        *batch = (BrickBatch){ cache, first, total - first < per_job ? total - first : per_job };
+        cache->jobs[cache->job_count] = job_create(function, batch, JOB_PRIORITY_LOW);
+        job_submit(cache->jobs[cache->job_count++]);
+    }
+}
+
+static inline bool brick_jobs_finished(BrickCache *cache) {
+    for (int i = 0; i < cache->job_count; i++) {
+        if (!job_finished(cache->jobs[i])) return false;
+    }
+    for (int i = 0; i < cache->job_count; i++) job_release(cache->jobs[i]);
+    cache->job_count = 0;
+    return true;
+}
+
+// Starts baking the given shapes unless they are what was baked last time
+// or a bake is already running. Moving a shape only resamples the bricks
+// around where it was and where it is. Anything that changes the fold (a
+// shape added or removed) or leaves the grid lays it out again.
+static inline bool brick_bake_start(BrickCache *cache, const Sphere *spheres, int count) {
+    if (cache->stage != BRICK_IDLE || count == 0) return false;
+    const bool coarsest = !cache->overflow || cache->grid <= BRICK_GRID_MIN;
+    if (cache->laid_out && coarsest && count == cache->baked_count &&
+        !memcmp(spheres, cache->baked, sizeof(Sphere) * count)) {
+        return false;
+    }
+
+    Vector3 min, max;
+    scene_bounds(spheres, count, 0, &min, &max);
+    for (int i = 0; i < count; i++) {
+        Vector3 shape_min, shape_max;
+        scene_shape_bounds(&spheres[i], &shape_min, &shape_max);
+        scene_grow(&min, &max, shape_min, shape_max);
+    }
+
+    const float margin = brick_margin(cache);
+    const float longest = fmaxf(max.x - min.x, fmaxf(max.y - min.y, max.z - min.z));
+    const bool fits = cache->laid_out && !cache->overflow && count == cache->baked_count &&
+                      min.x >= cache->min.x + margin && min.y >= cache->min.y + margin && min.z >= cache->min.z + margin &&
+                      max.x <= cache->max.x - margin && max.y <= cache->max.y - margin && max.z <= cache->max.z - margin &&
+                      longest * 2 > cache->size * cache->grid;
+
+    if (!fits) {
+        cache->grid = cache->overflow ? (int)fmaxf(BRICK_GRID_MIN, cache->grid * 3 / 4) : BRICK_GRID;
+        brick_layout(cache, min, max);
+        cache->dirty_min = cache->min;
+        cache->dirty_max = cache->max;
+    } else {
+        // Samples are never further from the surface than a near center
+        // plus half a brick diagonal, so a shape further away than that
+        // can't change them.
+        const float reach = brick_near_distance(cache) + cache->size * 0.8661f;
+        cache->dirty_min = (Vector3){ INFINITY, INFINITY, INFINITY };
+        cache->dirty_max = (Vector3){ -INFINITY, -INFINITY, -INFINITY };
+        for (int i = 0; i < count; i++) {
+            if (!memcmp(&spheres[i], &cache->baked[i], sizeof(Sphere))) continue;
+            Vector3 shape_min, shape_max;
+            scene_shape_bounds(&spheres[i], &shape_min, &shape_max);
+            scene_grow(&cache->dirty_min, &cache->dirty_max, shape_min, shape_max);
+            scene_shape_bounds(&cache->baked[i], &shape_min, &shape_max);
+            scene_grow(&cache->dirty_min, &cache->dirty_max, shape_min, shape_max);
+        }
+        cache->dirty_min = (Vector3){ cache->dirty_min.x - reach, cache->dirty_min.y - reach, cache->dirty_min.z - reach };
+        cache->dirty_max = (Vector3){ cache->dirty_max.x + reach, cache->dirty_max.y + reach, cache->dirty_max.z + reach };
+    }
+
+    memcpy(cache->baked, spheres, sizeof(Sphere) * count);
+    cache->baked_count = count;
+    scene_prepare(spheres, count, cache->shapes);
+    cache->shape_count = count;
+
+    // Every center is measured again: a far brick's bound can change with
+    // any shape.
+    cache->stage = BRICK_CENTERS;
+    brick_submit(cache, brick_centers_job, brick_count(cache), BRICK_GRID * BRICK_GRID);
+    return true;
+}
+
+// Frees the slots of bricks that left the surface and gives slots to the
+// dirty bricks near it, then queues their samples. If the atlas can't hold
+// them nothing is sampled and the bake ends with overflow set.
+static inline void brick_assign_slots(BrickCache *cache) {
+    const float near = brick_near_distance(cache);
+    const int count = brick_count(cache);
+
+    for (int i = 0; i < count; i++) {
+        if (fabsf(cache->center[i]) >= near && cache->slot[i] != BRICK_NONE) {
+            cache->free_slots[cache->free_count++] = cache->slot[i];
+            cache->slot[i] = BRICK_NONE;
+        }
+    }
+
+    cache->staged_bricks = malloc(sizeof(int) * count);
+    assert(cache->staged_bricks);
+    int needed = 0, new_slots = 0;
+    for (int i = 0; i < count; i++) {
+        if (fabsf(cache->center[i]) >= near) continue;
+        const Vector3 corner = brick_corner(cache, i);
+        const bool dirty = corner.x <= cache->dirty_max.x && corner.x + cache->size >= cache->dirty_min.x &&
+                           corner.y <= cache->dirty_max.y && corner.y + cache->size >= cache->dirty_min.y &&
+                           corner.z <= cache->dirty_max.z && corner.z + cache->size >= cache->dirty_min.z;
+        if (!dirty && cache->slot[i] != BRICK_NONE) continue;
+        new_slots += cache->slot[i] == BRICK_NONE;
+        cache->staged_bricks[needed++] = i;
+    }
+
+    if (new_slots > cache->free_count) {
+        cache->overflow = true;
+        needed = 0;
+    }
+    for (int n = 0; n < needed; n++) {
+        int *slot = &cache->slot[cache->staged_bricks[n]];
+        if (*slot == BRICK_NONE) *slot = cache->free_slots[--cache->free_count];
+    }
+
+    cache->staged_count = needed;
+    cache->staged = malloc(sizeof(BrickTexel) * BRICK_SAMPLE_COUNT * (needed ? needed : 1));
+    assert(cache->staged);
+    brick_submit(cache, brick_samples_job, needed, BRICK_BATCH);
+}
+
+// Advances the bake. True once its samples are staged for upload.
+static inline bool brick_bake_poll(BrickCache *cache) {
+    if (cache->stage == BRICK_CENTERS && brick_jobs_finished(cache)) {
+        cache->stage = BRICK_SAMPLING;
+        brick_assign_slots(cache);
+    }
+    if (cache->stage == BRICK_SAMPLING && brick_jobs_finished(cache)) {
+        cache->stage = BRICK_DONE;
+    }
+    return cache->stage == BRICK_DONE;
+}
+
+static inline void brick_bake_end(BrickCache *cache) {
+    free(cache->staged);
+    free(cache->staged_bricks);
+    cache->staged = NULL;
+    cache->staged_bricks = NULL;
+    cache->staged_count = 0;
+    cache->stage = BRICK_IDLE;
+}
+
+#endif
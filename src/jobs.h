@@ -0,0 +1,325 @@
+// Work-stealing job system.
+//
+// Each worker owns one Chase-Lev deque per priority. A worker pushes and pops
+// the bottom of its own deques, and idle workers steal from the top of other
+// workers' deques. Jobs submitted from outside the pool (the main thread) go
+// through a locked injection queue per priority.
+//
+//     Job *job = job_create(write_file, data, JOB_PRIORITY_LOW);
+//     job_depends_on(job, other_job);   // only before job_submit
+//     job_submit(job);
+//     ...
+//     if (job_finished(job)) job_release(job);
+//
+// A job runs once everything it depends on has finished. Cancelling a job
+// before it starts skips its function and cancels its dependents too. A
+// running job checks job_cancelled itself and returns early. Every job
+// function gets a per-worker arena that is reset after the job returns.
+
+#ifndef JOBS_H
+#define JOBS_H
+
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "trace.h"
+
+#define JOB_MAX_WORKERS 32
+#define JOB_DEQUE_SIZE 4096
+#define JOB_MAX_DEPENDENTS 16
+
+typedef enum {
+    JOB_PRIORITY_HIGH,
+    JOB_PRIORITY_NORMAL,
+    JOB_PRIORITY_LOW,
+    JOB_PRIORITY_COUNT,
+} JobPriority;
+
+typedef struct Job Job;
+typedef void (*JobFunction)(Job *job, void *data, Arena *arena);
+
+struct Job {
+    JobFunction function;
+    void *data;
+    JobPriority priority;
+
+    // One extra count is held until job_submit so a job can't start while
+    // its dependencies are still being added.
+    atomic_int unfinished_dependencies;
+    atomic_int refs;
+    atomic_bool cancelled;
+    atomic_bool finished;
+    _Atomic float progress;
+
+    pthread_mutex_t lock;
+    Job *dependents[JOB_MAX_DEPENDENTS];
+    int dependent_count;
+};
+
+typedef struct {
+    atomic_llong top;
+    atomic_llong bottom;
+    Job *_Atomic buffer[JOB_DEQUE_SIZE];
+} JobDeque;
+
+typedef struct {
+    Job *jobs[JOB_DEQUE_SIZE];
+    int head;
+    int count;
+} JobQueue;
+
+typedef struct {
+    pthread_t thread;
+    int index;
+    JobDeque deques[JOB_PRIORITY_COUNT];
+    Arena arena;
+} JobWorker;
+
+static struct {
+    JobWorker workers[JOB_MAX_WORKERS];
+    int worker_count;
+
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    JobQueue injected[JOB_PRIORITY_COUNT];
+    atomic_int queued;
+    atomic_bool quit;
+} job_system;
+
+static _Thread_local JobWorker *job_current_worker;
+
+static inline bool job_deque_push(JobDeque *deque, Job *job) {
+    const long long b = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    const long long t = atomic_load_explicit(&deque->top, memory_order_acquire);
+    if (b - t >= JOB_DEQUE_SIZE) return false;
+
+    atomic_store_explicit(&deque->buffer[b % JOB_DEQUE_SIZE], job, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&deque->bottom, b + 1, memory_order_relaxed);
+    return true;
+}
+
+static inline Job *job_deque_pop(JobDeque *deque) {
+    const long long b = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+    atomic_store_explicit(&deque->bottom, b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    long long t = atomic_load_explicit(&deque->top, memory_order_relaxed);
+
+    if (t > b) {
+        atomic_store_explicit(&deque->bottom, b + 1, memory_order_relaxed);
+        return NULL;
+    }
+
+    Job *job = atomic_load_explicit(&deque->buffer[b % JOB_DEQUE_SIZE], memory_order_relaxed);
+    if (t == b) {
+        // Last job, race the thieves for it.
+        if (!atomic_compare_exchange_strong_explicit(&deque->top, &t, t + 1, memory_order_seq_cst, memory_order_relaxed)) {
+            job = NULL;
+        }
+        atomic_store_explicit(&deque->bottom, b + 1, memory_order_relaxed);
+    }
+    return job;
+}
+
+static inline Job *job_deque_steal(JobDeque *deque) {
+    long long t = atomic_load_explicit(&deque->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    const long long b = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+    if (t >= b) return NULL;
+
+    Job *job = atomic_load_explicit(&deque->buffer[t % JOB_DEQUE_SIZE], memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&deque->top, &t, t + 1, memory_order_seq_cst, memory_order_relaxed)) {
+        return NULL;
+    }
+    return job;
+}
+
+static inline void job_enqueue(Job *job) {
+    JobWorker *worker = job_current_worker;
+    bool pushed = worker && job_deque_push(&worker->deques[job->priority], job);
+
+    pthread_mutex_lock(&job_system.lock);
+    if (!pushed) {
+        JobQueue *queue = &job_system.injected[job->priority];
+        assert(queue->count < JOB_DEQUE_SIZE);
+        queue->jobs[(queue->head + queue->count) % JOB_DEQUE_SIZE] = job;
+        queue->count++;
+    }
+    atomic_fetch_add(&job_system.queued, 1);
+    pthread_cond_signal(&job_system.wake);
+    pthread_mutex_unlock(&job_system.lock);
+}
+
+static inline Job *job_find(JobWorker *worker) {
+    for (int priority = 0; priority < JOB_PRIORITY_COUNT; priority++) {
+        Job *job = job_deque_pop(&worker->deques[priority]);
+        if (job) return job;
+
+        pthread_mutex_lock(&job_system.lock);
+        JobQueue *queue = &job_system.injected[priority];
+        if (queue->count) {
+            job = queue->jobs[queue->head];
+            queue->head = (queue->head + 1) % JOB_DEQUE_SIZE;
+            queue->count--;
+        }
+        pthread_mutex_unlock(&job_system.lock);
+        if (job) return job;
+
+        for (int i = 1; i < job_system.worker_count; i++) {
+            JobWorker *victim = &job_system.workers[(worker->index + i) % job_system.worker_count];
+            job = job_deque_steal(&victim->deques[priority]);
+            if (job) return job;
+        }
+    }
+    return NULL;
+}
+
+static inline void job_release(Job *job) {
+    if (job && atomic_fetch_sub(&job->refs, 1) == 1) {
+        pthread_mutex_destroy(&job->lock);
+        free(job);
+    }
+}
+
+static inline void job_cancel(Job *job) {
+    atomic_store(&job->cancelled, true);
+}
+
+static inline bool job_cancelled(Job *job) {
+    return atomic_load_explicit(&job->cancelled, memory_order_relaxed);
+}
+
+static inline bool job_finished(Job *job) {
+    return atomic_load_explicit(&job->finished, memory_order_acquire);
+}
+
+static inline void job_set_progress(Job *job, float progress) {
+    atomic_store_explicit(&job->progress, progress, memory_order_relaxed);
+}
+
+static inline float job_progress(Job *job) {
+    return atomic_load_explicit(&job->progress, memory_order_relaxed);
+}
+
+static inline void job_dependency_done(Job *job) {
+    if (atomic_fetch_sub(&job->unfinished_dependencies, 1) == 1) {
+        job_enqueue(job);
+    }
+}
+
+static inline void job_complete(Job *job) {
+    pthread_mutex_lock(&job->lock);
+    atomic_store_explicit(&job->finished, true, memory_order_release);
+    const bool cancelled = job_cancelled(job);
+    pthread_mutex_unlock(&job->lock);
+
+    // No dependents can be added once finished is set, so the list is stable.
+    for (int i = 0; i < job->dependent_count; i++) {
+        if (cancelled) job_cancel(job->dependents[i]);
+        job_dependency_done(job->dependents[i]);
+    }
+    job_release(job);
+}
+
+static inline void job_run(JobWorker *worker, Job *job) {
+    if (!job_cancelled(job)) {
+        TRACE_SCOPE("job");
+        job->function(job, job->data, &worker->arena);
+        arena_reset(&worker->arena);
+    }
+    job_complete(job);
+}
+
+static inline void *job_worker_main(void *arg) {
+    JobWorker *worker = arg;
+    job_current_worker = worker;
+    TRACE_THREAD_NAME("job worker");
+
+    while (!atomic_load(&job_system.quit)) {
+        Job *job = job_find(worker);
+        if (job) {
+            atomic_fetch_sub(&job_system.queued, 1);
+            job_run(worker, job);
+            continue;
+        }
+
+        pthread_mutex_lock(&job_system.lock);
+        while (atomic_load(&job_system.queued) <= 0 && !atomic_load(&job_system.quit)) {
+            pthread_cond_wait(&job_system.wake, &job_system.lock);
+        }
+        pthread_mutex_unlock(&job_system.lock);
+    }
+    return NULL;
+}
+
+// Starts one worker per core, leaving a core for the main thread.
+static inline void job_system_init(void) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int count = cores > 2 ? (int)cores - 1 : 1;
+    if (count > JOB_MAX_WORKERS) count = JOB_MAX_WORKERS;
+
+    pthread_mutex_init(&job_system.lock, NULL);
+    pthread_cond_init(&job_system.wake, NULL);
+    job_system.worker_count = count;
+    for (int i = 0; i < count; i++) {
+        job_system.workers[i].index = i;
+        pthread_create(&job_system.workers[i].thread, NULL, job_worker_main, &job_system.workers[i]);
+    }
+}
+
+static inline void job_system_shutdown(void) {
+    pthread_mutex_lock(&job_system.lock);
+    atomic_store(&job_system.quit, true);
+    pthread_cond_broadcast(&job_system.wake);
+    pthread_mutex_unlock(&job_system.lock);
+
+    for (int i = 0; i < job_system.worker_count; i++) {
+        pthread_join(job_system.workers[i].thread, NULL);
+        arena_free(&job_system.workers[i].arena);
+    }
+}
+
+// The caller owns one reference and must job_release it.
+static inline Job *job_create(JobFunction function, void *data, JobPriority priority) {
+    Job *job = calloc(1, sizeof(Job));
+    assert(job);
+    job->function = function;
+    job->data = data;
+    job->priority = priority;
+    atomic_init(&job->unfinished_dependencies, 1);
+    atomic_init(&job->refs, 2);
+    pthread_mutex_init(&job->lock, NULL);
+    return job;
+}
+
+static inline void job_depends_on(Job *job, Job *prerequisite) {
+    pthread_mutex_lock(&prerequisite->lock);
+    if (!job_finished(prerequisite)) {
+        assert(prerequisite->dependent_count < JOB_MAX_DEPENDENTS);
+        atomic_fetch_add(&job->unfinished_dependencies, 1);
+        prerequisite->dependents[prerequisite->dependent_count++] = job;
+    } else if (job_cancelled(prerequisite)) {
+        job_cancel(job);
+    }
+    pthread_mutex_unlock(&prerequisite->lock);
+}
+
+static inline void job_submit(Job *job) {
+    job_dependency_done(job);
+}
+
+// Convenience for fire-and-forget jobs.
+static inline void job_run_async(JobFunction function, void *data, JobPriority priority) {
+    Job *job = job_create(function, data, priority);
+    job_submit(job);
+    job_release(job);
+}
+
+#endif
@@ -0,0 +1,304 @@
+// Lighting cache: how much of the light of shader_base.fs reaches a point,
+// and its ambient occlusion, baked on the job system into a grid over the
+// scene that the shader reads back with one filtered fetch instead of
+// marching a shadow ray and AO taps per pixel.
+//
+// The grid has LIGHT_GRID points along the scene's longest side. Only points
+// within LIGHT_BAND cells of the surface are lit: each is first moved onto
+// the surface along the field's gradient, so a fetch anywhere on the surface
+// blends values measured on the surface rather than inside a shape. Points
+// further away are left fully lit and unoccluded. Texels are RG8: shadow,
+// then AO. One job lights one slice of the grid.
+//
+//     if (light_bake_start(cache, spheres, count)) ...
+//     if (light_bake_poll(cache))   // once per frame
+//         upload cache->texels from slice dirty_min[2] to dirty_max[2]
+//
+// When only some shapes changed since the last bake, only the points whose
+// shadow rays or AO taps can reach them are lit again.
+
+#ifndef LIGHTING_H
+#define LIGHTING_H
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "jobs.h"
+#include "scene.h"
+
+#define LIGHT_GRID 64
+#define LIGHT_BAND 2
+// calcSoftshadow and calcAO as render() in shader_base.fs called them
+#define LIGHT_SHADOW_STEPS 16
+#define LIGHT_SHADOW_START 0.02f
+#define LIGHT_SHADOW_DISTANCE 2.5f
+#define LIGHT_AO_TAPS 5
+#define LIGHT_AO_REACH 0.13f
+
+typedef uint8_t LightTexel[2];
+
+typedef struct LightCache LightCache;
+
+typedef struct {
+    LightCache *cache;
+    int z;
+} LightSlice;
+
+struct LightCache {
+    // Grid point x, y, z sits at min + (x, y, z) * cell
+    Vector3 min;
+    float cell;
+    int dims[3];
+    bool laid_out;
+
+    // Per grid point, x fastest
+    LightTexel texels[LIGHT_GRID * LIGHT_GRID * LIGHT_GRID];
+
+    // What the last bake lit, to find what changed since
+    Sphere baked[MAX_SPHERES];
+    int baked_count;
+
+    // The bake in flight, over grid points dirty_min to dirty_max inclusive.
+    // Unless everything is lit again, only the points that light_touches
+    // the changed box are.
+    SceneShape shapes[MAX_SPHERES];
+    int shape_count;
+    int dirty_min[3], dirty_max[3];
+    bool everything;
+    Vector3 changed_min, changed_max;
+    Job *jobs[LIGHT_GRID];
+    LightSlice slices[LIGHT_GRID];
+    int job_count;
+};
+
+// light_dir in render()
+static inline Vector3 light_direction(void) {
+    const Vector3 d = { cosf(-0.4f), sinf(0.7f), -0.6f };
+    const float length = sqrtf(d.x * d.x + d.y * d.y + d.z * d.z);
+    return (Vector3){ d.x / length, d.y / length, d.z / length };
+}
+
+static inline float light_distance(const LightCache *cache, Vector3 p) {
+    return scene_sample(cache->shapes, cache->shape_count, p).distance;
+}
+
+static inline Vector3 light_offset(Vector3 p, Vector3 d, float t) {
+    return (Vector3){ p.x + d.x * t, p.y + d.y * t, p.z + d.z * t };
+}
+
+// The tetrahedron gradient of calcNormal, not normalized
+static inline Vector3 light_gradient(const LightCache *cache, Vector3 p) {
+    const float e = 0.5773f * 0.001f;
+    const float a = light_distance(cache, (Vector3){ p.x + e, p.y - e, p.z - e });
+    const float b = light_distance(cache, (Vector3){ p.x - e, p.y - e, p.z + e });
+    const float c = light_distance(cache, (Vector3){ p.x - e, p.y + e, p.z - e });
+    const float d = light_distance(cache, (Vector3){ p.x + e, p.y + e, p.z + e });
+    return (Vector3){ a - b - c + d, -a - b + c + d, -a + b - c + d };
+}
+
+static inline float light_shadow(const LightCache *cache, Vector3 p, Vector3 light) {
+    float result = 1;
+    float t = LIGHT_SHADOW_START;
+    for (int i = 0; i < LIGHT_SHADOW_STEPS; i++) {
+        const float h = light_distance(cache, light_offset(p, light, t));
+        result = fminf(result, 8 * h / t);
+        t += fminf(fmaxf(h, 0.02f), 0.10f);
+        if (h < 0.001f || t > LIGHT_SHADOW_DISTANCE) break;
+    }
+    return fminf(fmaxf(result, 0), 1);
+}
+
+static inline float light_occlusion(const LightCache *cache, Vector3 p, Vector3 normal) {
+    float occlusion = 0;
+    float scale = 1;
+    for (int i = 0; i < LIGHT_AO_TAPS; i++) {
+        const float h = 0.01f + (LIGHT_AO_REACH - 0.01f) * i / (LIGHT_AO_TAPS - 1);
+        occlusion -= (light_distance(cache, light_offset(p, normal, h)) - h) * scale;
+        scale *= 0.95f;
+    }
+    return fminf(fmaxf(1 - 3 * occlusion, 0), 1);
+}
+
+static inline void light_point(const LightCache *cache, Vector3 p, Vector3 light, LightTexel texel) {
+    texel[0] = texel[1] = 255;
+    float d = light_distance(cache, p);
+    if (fabsf(d) > LIGHT_BAND * cache->cell) return;
+
+    // A few Newton steps, since blends and rounding make the field only
+    // roughly a distance
+    Vector3 normal = { 0, 1, 0 };
+    for (int i = 0; i < 3; i++) {
+        const Vector3 g = light_gradient(cache, p);
+        const float length = sqrtf(g.x * g.x + g.y * g.y + g.z * g.z);
+        if (length < 1e-6f) return;
+        normal = (Vector3){ g.x / length, g.y / length, g.z / length };
+        if (i > 0 && fabsf(d) < 0.0001f) break;
+        p = light_offset(p, normal, -d);
+        d = light_distance(cache, p);
+    }
+
+    texel[0] = (uint8_t)(light_shadow(cache, p, light) * 255 + 0.5f);
+    texel[1] = (uint8_t)(light_occlusion(cache, p, normal) * 255 + 0.5f);
+}
+
+// Whether the shadow ray from p, or its AO taps, can come near the changed
+// box, which light_bake_start grows by how near that has to be.
+static inline bool light_touches(const LightCache *cache, Vector3 p, Vector3 light) {
+    const float from[3] = { p.x, p.y, p.z };
+    const float direction[3] = { light.x, light.y, light.z };
+    const float lo[3] = { cache->changed_min.x, cache->changed_min.y, cache->changed_min.z };
+    const float hi[3] = { cache->changed_max.x, cache->changed_max.y, cache->changed_max.z };
+    float enter = 0, leave = LIGHT_SHADOW_DISTANCE;
+    for (int axis = 0; axis < 3; axis++) {
+        if (direction[axis] == 0) {
+            if (from[axis] < lo[axis] || from[axis] > hi[axis]) return false;
+            continue;
+        }
+        float t0 = (lo[axis] - from[axis]) / direction[axis];
+        float t1 = (hi[axis] - from[axis]) / direction[axis];
+        if (t0 > t1) {
+            const float swap = t0;
+            t0 = t1;
+            t1 = swap;
+        }
+        enter = fmaxf(enter, t0);
+        leave = fminf(leave, t1);
+    }
+    return enter <= leave;
+}
+
+static inline void light_slice_job(Job *job, void *data, Arena *arena) {
+    (void)arena;
+    LightSlice *slice = data;
+    LightCache *cache = slice->cache;
+    const Vector3 light = light_direction();
+    for (int y = cache->dirty_min[1]; y <= cache->dirty_max[1]; y++) {
+        if (job_cancelled(job)) return;
+        for (int x = cache->dirty_min[0]; x <= cache->dirty_max[0]; x++) {
+            const Vector3 p = { cache->min.x + x * cache->cell, cache->min.y + y * cache->cell, cache->min.z + slice->z * cache->cell };
+            if (!cache->everything && !light_touches(cache, p, light)) continue;
+            light_point(cache, p, light, cache->texels[(slice->z * cache->dims[1] + y) * cache->dims[0] + x]);
+        }
+    }
+}
+
+// Grid points this close to the surface may be lit, plus a row that stays
+// lit so filtering at the sides never reads past the grid.
+static inline float light_margin(const LightCache *cache) {
+    return (LIGHT_BAND + 1) * cache->cell;
+}
+
+static inline void light_layout(LightCache *cache, Vector3 min, Vector3 max) {
+    const float longest = fmaxf(max.x - min.x, fmaxf(max.y - min.y, max.z - min.z));
+    // Slack so a shape can move a little before the grid is laid out again
+    const float slack = longest / 8;
+    cache->cell = (longest + 2 * slack) / (LIGHT_GRID - 1 - 2 * (LIGHT_BAND + 1));
+    const float padding = slack + light_margin(cache);
+    cache->min = (Vector3){ min.x - padding, min.y - padding, min.z - padding };
+    cache->dims[0] = (int)fminf(LIGHT_GRID, ceilf((max.x - min.x + 2 * padding) / cache->cell) + 1);
+    cache->dims[1] = (int)fminf(LIGHT_GRID, ceilf((max.y - min.y + 2 * padding) / cache->cell) + 1);
+    cache->dims[2] = (int)fminf(LIGHT_GRID, ceilf((max.z - min.z + 2 * padding) / cache->cell) + 1);
+    memset(cache->texels, 255, sizeof(cache->texels));
+    cache->laid_out = true;
+}
+
+// How near a shape has to come to a grid point's shadow ray to darken it, a
+// ray darkening only within t/8 of a surface, or to its AO taps. The point
+// itself is up to the margin from where it is lit.
+static inline float light_reach(const LightCache *cache) {
+    return LIGHT_SHADOW_DISTANCE / 8 + LIGHT_AO_REACH + light_margin(cache);
+}
+
+// Starts lighting the given shapes unless they are what was lit last time
+// or a bake is already running. Adding or removing a shape, or leaving the
+// grid, lays it out again and lights everything.
+static inline bool light_bake_start(LightCache *cache, const Sphere *spheres, int count) {
+    if (cache->job_count || count == 0) return false;
+    if (cache->laid_out && count == cache->baked_count && !memcmp(spheres, cache->baked, sizeof(Sphere) * count)) {
+        return false;
+    }
+
+    Vector3 min, max;
+    scene_shape_bounds(&spheres[0], &min, &max);
+    for (int i = 1; i < count; i++) {
+        Vector3 shape_min, shape_max;
+        scene_shape_bounds(&spheres[i], &shape_min, &shape_max);
+        scene_grow(&min, &max, shape_min, shape_max);
+    }
+
+    const float margin = light_margin(cache);
+    const Vector3 grid_max = light_offset(cache->min, (Vector3){ cache->dims[0] - 1, cache->dims[1] - 1, cache->dims[2] - 1 }, cache->cell);
+    const float longest = fmaxf(max.x - min.x, fmaxf(max.y - min.y, max.z - min.z));
+    const bool fits = cache->laid_out && count == cache->baked_count &&
+                      min.x >= cache->min.x + margin && min.y >= cache->min.y + margin && min.z >= cache->min.z + margin &&
+                      max.x <= grid_max.x - margin && max.y <= grid_max.y - margin && max.z <= grid_max.z - margin &&
+                      longest * 2 > cache->cell * LIGHT_GRID;
+
+    // Grid points whose shadow rays pass the changed shapes lie up to
+    // LIGHT_SHADOW_DISTANCE from them against the light.
+    Vector3 dirty_min, dirty_max;
+    cache->everything = !fits;
+    if (!fits) {
+        light_layout(cache, min, max);
+        dirty_min = cache->min;
+        dirty_max = light_offset(cache->min, (Vector3){ cache->dims[0], cache->dims[1], cache->dims[2] }, cache->cell);
+    } else {
+        Vector3 changed_min = { INFINITY, INFINITY, INFINITY };
+        Vector3 changed_max = { -INFINITY, -INFINITY, -INFINITY };
+        for (int i = 0; i < count; i++) {
+            if (!memcmp(&spheres[i], &cache->baked[i], sizeof(Sphere))) continue;
+            Vector3 shape_min, shape_max;
+            scene_shape_bounds(&spheres[i], &shape_min, &shape_max);
+            scene_grow(&changed_min, &changed_max, shape_min, shape_max);
+            scene_shape_bounds(&cache->baked[i], &shape_min, &shape_max);
+            scene_grow(&changed_min, &changed_max, shape_min, shape_max);
+        }
+        const float reach = light_reach(cache);
+        cache->changed_min = (Vector3){ changed_min.x - reach, changed_min.y - reach, changed_min.z - reach };
+        cache->changed_max = (Vector3){ changed_max.x + reach, changed_max.y + reach, changed_max.z + reach };
+        const Vector3 light = light_direction();
+        dirty_min = cache->changed_min;
+        dirty_max = cache->changed_max;
+        scene_grow(&dirty_min, &dirty_max, light_offset(dirty_min, light, -LIGHT_SHADOW_DISTANCE),
+                   light_offset(dirty_max, light, -LIGHT_SHADOW_DISTANCE));
+    }
+
+    memcpy(cache->baked, spheres, sizeof(Sphere) * count);
+    cache->baked_count = count;
+    scene_prepare(spheres, count, cache->shapes);
+    cache->shape_count = count;
+
+    const float lo[3] = { dirty_min.x - cache->min.x, dirty_min.y - cache->min.y, dirty_min.z - cache->min.z };
+    const float hi[3] = { dirty_max.x - cache->min.x, dirty_max.y - cache->min.y, dirty_max.z - cache->min.z };
+    for (int axis = 0; axis < 3; axis++) {
+        cache->dirty_min[axis] = (int)fmaxf(0, floorf(lo[axis] / cache->cell));
+        cache->dirty_max[axis] = (int)fminf(cache->dims[axis] - 1, ceilf(hi[axis] / cache->cell));
+        if (cache->dirty_min[axis] > cache->dirty_max[axis]) return false;
+    }
+
+    for (int z = cache->dirty_min[2]; z <= cache->dirty_max[2]; z++) {
+        cache->slices[cache->job_count] = (LightSlice){ cache, z };
+        cache->jobs[cache->job_count] = job_create(light_slice_job, &cache->slices[cache->job_count], JOB_PRIORITY_LOW);
+        job_submit(cache->jobs[cache->job_count++]);
+    }
+    return true;
+}
+
+static inline bool light_baking(const LightCache *cache) {
+    return cache->job_count > 0;
+}
+
+// True once, when the running bake is done and its slices can be uploaded.
+static inline bool light_bake_poll(LightCache *cache) {
+    if (!light_baking(cache)) return false;
+    for (int i = 0; i < cache->job_count; i++) {
+        if (!job_finished(cache->jobs[i])) return false;
+    }
+    for (int i = 0; i < cache->job_count; i++) job_release(cache->jobs[i]);
+    cache->job_count = 0;
+    return true;
+}
+
+#endif
@@ -8,6 +8,13 @@
 #include <stdint.h>
 #include <float.h>
 #include "shaders.h"
+#include "trace.h"
+#include "arena.h"
+#include "jobs.h"
+#include "marching_cubes.h"
+#include "scene.h"
+#include "bricks.h"
+#include "lighting.h"
 
 #define MAX_CHARS 32
 
@@ -52,25 +59,6 @@ union {
 } controlled_axis = {.mask = 0x7};
 double last_axis_set = 0;
 
-typedef struct {
-    float x, y, z;
-} Vector3;
-
-typedef struct {
-    Vector3 pos;
-    Vector3 size;
-    Vector3 angle;
-    float corner_radius;
-    float blob_amount;
-    struct {
-        uint8_t r, g, b;
-    } color;
-    struct {
-        bool x, y, z;
-    } mirror;
-    bool subtract;
-} Sphere;
-
 bool needs_rebuild = true;
 
 #if DEMO_VIDEO_FEATURES
@@ -80,20 +68,65 @@ bool false_color_mode = false;
 enum {
     VISUALS_NONE,
     VISUALS_SDF,
+    VISUALS_MARCH_STEPS,
+    VISUALS_SHAPE_EVALS,
 } visuals_mode;
 
+// Frame totals of the cost visualizers, written by the shader through an
+// atomic counter buffer. Two buffers alternate so the one read back was
+// filled a frame earlier.
+typedef struct {
+    GLuint march_steps;
+    GLuint shape_evals;
+} CostCounters;
+
+GLuint cost_counter_buffers[2];
+CostCounters cost_totals;
+
+// COST_MARCH_UNIT and COST_EVAL_UNIT of shader_base.fs. Without
+// GL_ARB_shader_atomic_counter_ops an increment stands for this many.
+#define COST_MARCH_UNIT 128
+#define COST_EVAL_UNIT 8192
+double cost_march_unit = 1, cost_eval_unit = 1;
+
 Shader main_shader;
-struct {
+// The main shader with every shape but the selected one read from the brick
+// cache, see bricks_update. With fewer shapes than BRICK_MIN_SHAPES the
+// exact map marches about as fast as the lookups.
+Shader bricks_shader;
+#define BRICK_MIN_SHAPES 16
+typedef struct {
     int viewEye;
     int viewCenter;
     int runTime;
     int resolution;
     int selectedParams;
     int visualizer;
-} main_locations;
+    int shapeCount;
+    int viewportOrigin;
+    int renderScale;
+    int jitter;
+    int conePass;
+    int coneStarts;
+    int brickIndex;
+    int brickAtlas;
+    int brickMin;
+    int brickMax;
+    int brickSize;
+    int lightVolume;
+    int lightMin;
+    int lightCell;
+    int marchSteps;
+    int marchFar;
+    int fastShading;
+} MarchLocations;
+MarchLocations main_locations;
+MarchLocations bricks_locations;
+// Whichever of the two marches this frame
+Shader march_shader;
+MarchLocations *march_locations = &main_locations;
 
 int num_spheres = 1;
-#define MAX_SPHERES 100
 Sphere spheres[MAX_SPHERES];
 int selected_sphere = 0;
 
@@ -107,21 +140,218 @@ Color last_color_set = {
 };
 
 double lastSave;
+#define AUTOSAVE_INTERVAL 60.0
+
+// Reset at the start of every frame. Anything allocated from it only lives
+// until the end of the frame.
+Arena frame_arena;
+
+// Performance overlay: GPU time per render pass via GL_TIME_ELAPSED queries,
+// plus CPU time for the main-thread phases. Queries are kept in a ring of
+// PERF_QUERY_FRAMES so results are read a few frames late and never stall.
+#define PERF_QUERY_FRAMES 4
+#define PERF_HISTORY 120
+#define PERF_SMOOTHING 0.05
+
+typedef enum {
+    PERF_PASS_RAYMARCH,
+    PERF_PASS_GIZMOS,
+    PERF_PASS_GUI,
+    PERF_PASS_COUNT,
+} PerfPass;
+
+typedef enum {
+    PERF_CPU_INPUT,
+    PERF_CPU_REBUILD,
+    PERF_CPU_COUNT,
+} PerfCpu;
+
+const char *perf_pass_names[PERF_PASS_COUNT] = { "Raymarch", "Gizmos", "GUI" };
+const char *perf_cpu_names[PERF_CPU_COUNT] = { "Input", "Rebuild" };
 
+struct {
+    bool visible;
+    bool initialized;
+    int frame;
+    GLuint queries[PERF_QUERY_FRAMES][PERF_PASS_COUNT];
+    bool pending[PERF_QUERY_FRAMES][PERF_PASS_COUNT];
+    double gpu_ms[PERF_PASS_COUNT];
+    // Unsmoothed result collected this frame, or 0 when there was none.
+    double gpu_last_ms[PERF_PASS_COUNT];
+    double cpu_ms[PERF_CPU_COUNT];
+    double cpu_start[PERF_CPU_COUNT];
+    float frame_ms[PERF_HISTORY];
+    int history_index;
+} perf;
+
+// The raymarch pass is timed even with the overlay hidden, since dynamic
+// resolution sizes the pass from it.
+bool perf_timed(PerfPass pass) {
+    return perf.visible || pass == PERF_PASS_RAYMARCH;
+}
+
+void perf_begin_frame(void) {
+    // Every pass gets its queries up front, overlay shown or not, so a pass
+    // never begins a query that doesn't exist yet.
+    if (!perf.initialized) {
+        glGenQueries(PERF_QUERY_FRAMES * PERF_PASS_COUNT, &perf.queries[0][0]);
+        perf.initialized = true;
+    }
+
+    // Collect the results written PERF_QUERY_FRAMES frames ago before this
+    // slot gets reused. A result that still isn't ready is dropped.
+    const int slot = perf.frame % PERF_QUERY_FRAMES;
+    for (int pass = 0; pass < PERF_PASS_COUNT; pass++) {
+        perf.gpu_last_ms[pass] = 0;
+        if (!perf.pending[slot][pass]) continue;
+        perf.pending[slot][pass] = false;
+
+        GLint available = 0;
+        glGetQueryObjectiv(perf.queries[slot][pass], GL_QUERY_RESULT_AVAILABLE, &available);
+        if (!available) continue;
+
+        GLuint64 nanoseconds = 0;
+        glGetQueryObjectui64v(perf.queries[slot][pass], GL_QUERY_RESULT, &nanoseconds);
+        perf.gpu_last_ms[pass] = nanoseconds / 1e6;
+        perf.gpu_ms[pass] += (perf.gpu_last_ms[pass] - perf.gpu_ms[pass]) * PERF_SMOOTHING;
+    }
+}
+
+// The first frame after an idle wait isn't graphed, since raylib times it
+// from the end of the last frame drawn, so it is mostly the wait.
+void perf_end_frame(bool resumed) {
+    if (!resumed) {
+        perf.frame_ms[perf.history_index] = GetFrameTime() * 1000;
+        perf.history_index = (perf.history_index + 1) % PERF_HISTORY;
+    }
+    perf.frame++;
+}
+
+// raylib batches draw calls, so the batch is flushed on both sides of the
+// query to attribute the pending geometry to the right pass.
+void perf_gpu_begin(PerfPass pass) {
+    if (!perf_timed(pass)) return;
+    rlDrawRenderBatchActive();
+    glBeginQuery(GL_TIME_ELAPSED, perf.queries[perf.frame % PERF_QUERY_FRAMES][pass]);
+}
+
+void perf_gpu_end(PerfPass pass) {
+    if (!perf_timed(pass)) return;
+    rlDrawRenderBatchActive();
+    glEndQuery(GL_TIME_ELAPSED);
+    perf.pending[perf.frame % PERF_QUERY_FRAMES][pass] = true;
+}
+
+void perf_cpu_begin(PerfCpu timer) {
+    perf.cpu_start[timer] = GetTime();
+}
+
+void perf_cpu_end(PerfCpu timer) {
+    const double elapsed = (GetTime() - perf.cpu_start[timer]) * 1000;
+    perf.cpu_ms[timer] += (elapsed - perf.cpu_ms[timer]) * PERF_SMOOTHING;
+}
+
+// Quality governor. A still view is marched at full quality, since it is
+// accumulated into an antialiased frame and then left alone. While the view
+// moves, the march drops to a cheaper tier of march_qualities: fewer steps,
+// a nearer far plane, three-tap normals and no shadows or AO. Dynamic
+// resolution then fits the pass into its share of the target frame time,
+// and when even VIEWPORT_MIN_SCALE misses it the governor steps down another
+// tier, stepping back once full resolution fits with room to spare. F6
+// cycles the target.
+#define GOVERNOR_MARCH_SHARE 0.5
+#define GOVERNOR_RECOVER_FIT 1.25f
+
+typedef struct {
+    int march_steps;
+    float march_far;
+    bool fast_shading;
+} MarchQuality;
+
+const MarchQuality march_qualities[] = {
+    { 64, 300, false },
+    { 48, 300, true },
+    { 32, 100, true },
+};
+#define MARCH_QUALITY_COUNT (int)(sizeof(march_qualities) / sizeof(march_qualities[0]))
+
+const float governor_targets_ms[] = { 16.7f, 33.3f, 8.3f };
+#define GOVERNOR_TARGET_COUNT (int)(sizeof(governor_targets_ms) / sizeof(governor_targets_ms[0]))
+
+struct {
+    int target;
+    // Tier used while moving, and the tier each query slot timed
+    int quality;
+    int slot_quality[PERF_QUERY_FRAMES];
+} governor = { .quality = 1 };
+
+double governor_budget_ms(void) {
+    return governor_targets_ms[governor.target] * GOVERNOR_MARCH_SHARE;
+}
+
+void governor_bind(bool reduced) {
+    const int tier = reduced ? governor.quality : 0;
+    const MarchQuality *quality = &march_qualities[tier];
+    const int fast_shading = quality->fast_shading;
+    governor.slot_quality[perf.frame % PERF_QUERY_FRAMES] = tier;
+    SetShaderValue(march_shader, march_locations->marchSteps, &quality->march_steps, SHADER_UNIFORM_INT);
+    SetShaderValue(march_shader, march_locations->marchFar, &quality->march_far, SHADER_UNIFORM_FLOAT);
+    SetShaderValue(march_shader, march_locations->fastShading, &fast_shading, SHADER_UNIFORM_INT);
+}
+
+void draw_perf_overlay(void) {
+    if (!perf.visible) return;
+
+    const int width = PERF_HISTORY * 2;
+    const int graph_height = 60;
+    const int line_height = 12;
+    const int height = (PERF_PASS_COUNT + PERF_CPU_COUNT + 2) * line_height + graph_height + 16;
+    const int x = GetScreenWidth() - width - 10;
+    int y = 30;
+
+    DrawRectangle(x - 6, y - 6, width + 12, height, (Color){0, 0, 0, 160});
+
+    double frame_avg = 0;
+    for (int i = 0; i < PERF_HISTORY; i++) frame_avg += perf.frame_ms[i];
+    frame_avg /= PERF_HISTORY;
+    DrawText(TextFormat("Frame  %6.2fms", frame_avg), x, y, 10, WHITE);
+    y += line_height;
+    DrawText(TextFormat("Target %6.2fms (F6), moving tier %d", governor_targets_ms[governor.target], governor.quality), x, y, 10, WHITE);
+    y += line_height;
+
+    for (int pass = 0; pass < PERF_PASS_COUNT; pass++) {
+        DrawText(TextFormat("GPU %-8s %6.2fms", perf_pass_names[pass], perf.gpu_ms[pass]), x, y, 10, WHITE);
+        y += line_height;
+    }
+    for (int timer = 0; timer < PERF_CPU_COUNT; timer++) {
+        DrawText(TextFormat("CPU %-8s %6.2fms", perf_cpu_names[timer], perf.cpu_ms[timer]), x, y, 10, WHITE);
+        y += line_height;
+    }
+
+    // Frame time graph, oldest sample on the left. The line marks the target
+    // and the top of the graph is 33ms.
+    y += 4;
+    const float ms_scale = graph_height / 33.3f;
+    const float target_ms = governor_targets_ms[governor.target];
+    const int target_y = y + graph_height - (int)(fminf(target_ms * ms_scale, graph_height));
+    DrawLine(x, target_y, x + width, target_y, (Color){0, 228, 48, 160});
+    for (int i = 0; i < PERF_HISTORY; i++) {
+        const float ms = perf.frame_ms[(perf.history_index + i) % PERF_HISTORY];
+        const int bar = (int)fminf(ms * ms_scale, graph_height);
+        DrawRectangle(x + i * 2, y + graph_height - bar, 2, bar, ms > target_ms ? ORANGE : SKYBLUE);
+    }
+}
+
+// Kept for append_map_function, new code builds strings with a StringBuilder.
 void append(char **str1, const char *str2) {
     assert(str1);
     assert(str2);
-    size_t len = (*str1 ? strlen(*str1) : 0) + strlen(str2);
+    size_t len1 = *str1 ? strlen(*str1) : 0;
+    size_t len2 = strlen(str2);
 
-    char *concatenated = (char *)malloc(len + 1);
-    concatenated[0] = 0;
+    char *concatenated = (char *)realloc(*str1, len1 + len2 + 1);
     assert(concatenated);
-
-    if (*str1) {
-        strcpy(concatenated, *str1);
-        free(*str1);
-    }
-    strcat(concatenated, str2);
+    memcpy(concatenated + len1, str2, len2 + 1);
 
     *str1 = concatenated;
 }
@@ -240,39 +470,605 @@ const char *vshader =
     "    gl_Position = mvp * vec4(vertexPosition, 1.0);\n"
     "}";
 
+const char *march_header =
+    "#version 330 core\n"
+    "#extension GL_ARB_shader_atomic_counters : enable\n"
+    "#extension GL_ARB_shader_atomic_counter_ops : enable\n"
+    "out vec4 finalColor;\n"
+    "uniform vec3 viewEye;\n"
+    "uniform vec3 viewCenter;\n"
+    "uniform float runTime;\n"
+    "uniform float visualizer;\n"
+    "uniform float shapeCount;\n"
+    "uniform vec2 viewportOrigin;\n"
+    "uniform vec2 renderScale;\n"
+    "uniform vec2 jitter;\n"
+    "uniform bool conePass;\n"
+    "uniform sampler2D coneStarts;\n"
+    "uniform vec2 resolution;";
+
+// The selected shape measured from the selectionValues uniform, folded into
+// the baked field of the others as if it came last, which bricks_update only
+// allows when that order gives the same field. Its mirror and subtract flags
+// are baked into the text like the generated map does.
+void append_baked_field(StringBuilder *sb, const Sphere *s) {
+    sb_appendf(sb,
+        "\nuniform vec3 selectionValues[5];\n"
+        "vec4 signed_distance_field( vec3 p )\n"
+        "{\n"
+        "    vec4 rest = baked_field( p );\n"
+        "    vec3 q = opRotateXYZ( %s( p ) - selectionValues[0], selectionValues[1] );\n"
+        "    vec4 shape = vec4( RoundBox( q, selectionValues[2], selectionValues[4].x ), selectionValues[3] );\n"
+        "    return %s;\n"
+        "}\n",
+        s->mirror.x || s->mirror.y || s->mirror.z ?
+            TextFormat("opSym%s%s%s", s->mirror.x ? "X" : "", s->mirror.y ? "Y" : "", s->mirror.z ? "Z" : "") : "",
+        s->subtract ? "opSmoothSubtraction( shape, rest, selectionValues[4].y )" :
+                      "BlobbyMin( rest, shape, selectionValues[4].y )");
+}
+
+MarchLocations load_march_locations(Shader shader) {
+    return (MarchLocations){
+        .viewEye = GetShaderLocation(shader, "viewEye"),
+        .viewCenter = GetShaderLocation(shader, "viewCenter"),
+        .runTime = GetShaderLocation(shader, "runTime"),
+        .resolution = GetShaderLocation(shader, "resolution"),
+        .selectedParams = GetShaderLocation(shader, "selectionValues"),
+        .visualizer = GetShaderLocation(shader, "visualizer"),
+        .shapeCount = GetShaderLocation(shader, "shapeCount"),
+        .viewportOrigin = GetShaderLocation(shader, "viewportOrigin"),
+        .renderScale = GetShaderLocation(shader, "renderScale"),
+        .jitter = GetShaderLocation(shader, "jitter"),
+        .conePass = GetShaderLocation(shader, "conePass"),
+        .coneStarts = GetShaderLocation(shader, "coneStarts"),
+        .brickIndex = GetShaderLocation(shader, "brickIndex"),
+        .brickAtlas = GetShaderLocation(shader, "brickAtlas"),
+        .brickMin = GetShaderLocation(shader, "brickMin"),
+        .brickMax = GetShaderLocation(shader, "brickMax"),
+        .brickSize = GetShaderLocation(shader, "brickSize"),
+        .lightVolume = GetShaderLocation(shader, "lightVolume"),
+        .lightMin = GetShaderLocation(shader, "lightMin"),
+        .lightCell = GetShaderLocation(shader, "lightCell"),
+        .marchSteps = GetShaderLocation(shader, "marchSteps"),
+        .marchFar = GetShaderLocation(shader, "marchFar"),
+        .fastShading = GetShaderLocation(shader, "fastShading"),
+    };
+}
+
 void rebuild_shaders(void) {
+    TRACE_SCOPE("rebuild_shaders");
     needs_rebuild = false;
     UnloadShader(main_shader); 
+    if (bricks_shader.id) UnloadShader(bricks_shader);
+    bricks_shader = (Shader){ 0 };
 
+    TRACE_BEGIN(generate_trace, "generate shader");
     char *map_function = NULL;
     append_map_function(&map_function, false, selected_sphere);
 
-    char *result = NULL;
-    append(&result, 
-        "#version 330 core\n"
-        "out vec4 finalColor;\n"
-        "uniform vec3 viewEye;\n"
-        "uniform vec3 viewCenter;\n"
-        "uniform float runTime;\n"
-        "uniform float visualizer;\n"
-        "uniform vec2 resolution;");
-    append(&result, shader_prefix_fs);
-    append(&result, map_function);
-    append(&result, shader_base_fs);
-    main_shader = LoadShaderFromMemory(vshader, (char *)result);
-    free(result);
-    result = NULL;
-
-    main_locations.viewEye = GetShaderLocation(main_shader, "viewEye");
-    main_locations.viewCenter = GetShaderLocation(main_shader, "viewCenter");
-    main_locations.runTime = GetShaderLocation(main_shader, "runTime");
-    main_locations.resolution = GetShaderLocation(main_shader, "resolution");
-    main_locations.selectedParams = GetShaderLocation(main_shader, "selectionValues");
-    main_locations.visualizer = GetShaderLocation(main_shader, "visualizer");
+    StringBuilder result = { .arena = &frame_arena };
+    sb_append(&result, march_header);
+    sb_append(&result, shader_prefix_fs);
+    sb_append(&result, map_function);
+    sb_append(&result, shader_base_fs);
+
+    // The baked variant doesn't need the generated map, so it stays small
+    // and quick to compile however many shapes there are.
+    StringBuilder baked = { .arena = &frame_arena };
+    if (selected_sphere >= 0 && num_spheres >= BRICK_MIN_SHAPES) {
+        sb_append(&baked, march_header);
+        sb_appendf(&baked, "\n#define BRICK_CELLS %d\n#define BRICK_SAMPLES %d\n#define BRICK_ATLAS %d\n",
+                   BRICK_CELLS, BRICK_SAMPLES, BRICK_ATLAS);
+        sb_append(&baked, shader_prefix_fs);
+        sb_append(&baked, bricks_fs);
+        append_baked_field(&baked, &spheres[selected_sphere]);
+        sb_append(&baked, shader_base_fs);
+    }
+    TRACE_END(generate_trace);
+
+    TRACE_BEGIN(compile_trace, "compile shader");
+    main_shader = LoadShaderFromMemory(vshader, result.data);
+    if (baked.data) bricks_shader = LoadShaderFromMemory(vshader, baked.data);
+    TRACE_END(compile_trace);
+
+    main_locations = load_march_locations(main_shader);
+    if (bricks_shader.id) bricks_locations = load_march_locations(bricks_shader);
 
     free(map_function);
 }
 
+// Reads back the totals of the previous frame and clears this frame's buffer.
+void bind_cost_counters(int frame) {
+    if (!cost_counter_buffers[0]) {
+        glGenBuffers(2, cost_counter_buffers);
+        for (int i = 0; i < 2; i++) {
+            glBindBuffer(GL_ATOMIC_COUNTER_BUFFER, cost_counter_buffers[i]);
+            glBufferData(GL_ATOMIC_COUNTER_BUFFER, sizeof(CostCounters), NULL, GL_DYNAMIC_READ);
+        }
+        if (!glfwExtensionSupported("GL_ARB_shader_atomic_counter_ops")) {
+            cost_march_unit = COST_MARCH_UNIT;
+            cost_eval_unit = COST_EVAL_UNIT;
+        }
+    }
+
+    glBindBuffer(GL_ATOMIC_COUNTER_BUFFER, cost_counter_buffers[(frame + 1) % 2]);
+    glGetBufferSubData(GL_ATOMIC_COUNTER_BUFFER, 0, sizeof(CostCounters), &cost_totals);
+
+    const CostCounters zero = {0};
+    glBindBuffer(GL_ATOMIC_COUNTER_BUFFER, cost_counter_buffers[frame % 2]);
+    glBufferSubData(GL_ATOMIC_COUNTER_BUFFER, 0, sizeof(CostCounters), &zero);
+    glBindBufferBase(GL_ATOMIC_COUNTER_BUFFER, 0, cost_counter_buffers[frame % 2]);
+}
+
+// Brick cache. While the selected shape is dragged, the viewport marches
+// with bricks_shader, which reads every other shape from a baked copy of
+// their distance field (bricks.h) and measures only the selected one, so a
+// frame costs about the same with 20 shapes or 100. The cache is rebaked on
+// the job system whenever the shapes it holds change, which for a new
+// selection means just the bricks around the old and new selected shapes.
+// Until a bake is done, and whenever nothing is dragged, the exact map is
+// used, so a still view is exact.
+#define BRICK_INDEX_UNIT 6
+#define BRICK_ATLAS_UNIT 7
+
+struct {
+    BrickCache cache;
+    // The textures hold the shapes that are not selected right now
+    bool current;
+    GLuint index;
+    GLuint atlas;
+} bricks;
+
+GLuint load_volume_texture(GLint filter) {
+    GLuint texture;
+    glGenTextures(1, &texture);
+    glBindTexture(GL_TEXTURE_3D, texture);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, filter);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, filter);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+    return texture;
+}
+
+// Copies the staged samples into their atlas slots and replaces the index,
+// which is small enough to send whole.
+void bricks_upload(void) {
+    TRACE_SCOPE("bricks_upload");
+    const BrickCache *cache = &bricks.cache;
+    if (!bricks.atlas) {
+        bricks.atlas = load_volume_texture(GL_LINEAR);
+        const int side = BRICK_ATLAS * BRICK_SAMPLES;
+        glTexImage3D(GL_TEXTURE_3D, 0, GL_RGBA16F, side, side, side, 0, GL_RGBA, GL_HALF_FLOAT, NULL);
+        bricks.index = load_volume_texture(GL_NEAREST);
+    }
+
+    glBindTexture(GL_TEXTURE_3D, bricks.atlas);
+    for (int n = 0; n < cache->staged_count; n++) {
+        const int slot = cache->slot[cache->staged_bricks[n]];
+        glTexSubImage3D(GL_TEXTURE_3D, 0,
+                        slot % BRICK_ATLAS * BRICK_SAMPLES,
+                        slot / BRICK_ATLAS % BRICK_ATLAS * BRICK_SAMPLES,
+                        slot / (BRICK_ATLAS * BRICK_ATLAS) * BRICK_SAMPLES,
+                        BRICK_SAMPLES, BRICK_SAMPLES, BRICK_SAMPLES, GL_RGBA, GL_HALF_FLOAT,
+                        cache->staged + (size_t)n * BRICK_SAMPLE_COUNT);
+    }
+
+    const int count = brick_count(cache);
+    float *index = arena_alloc(&frame_arena, sizeof(float) * 4 * count);
+    for (int i = 0; i < count; i++) {
+        index[i * 4 + 0] = cache->center[i];
+        index[i * 4 + 1] = cache->slot[i];
+        index[i * 4 + 2] = cache->color[i];
+        index[i * 4 + 3] = 0;
+    }
+    glBindTexture(GL_TEXTURE_3D, bricks.index);
+    glTexImage3D(GL_TEXTURE_3D, 0, GL_RGBA32F, cache->dims[0], cache->dims[1], cache->dims[2], 0, GL_RGBA, GL_FLOAT, index);
+    glBindTexture(GL_TEXTURE_3D, 0);
+}
+
+// bricks_shader folds the selected shape in after all the others. That is
+// the map's field only when it is the last shape already, or when it and
+// every shape after it are plain unions, since only Min can be reordered.
+bool selection_folds_last(void) {
+    const Sphere *s = &spheres[selected_sphere];
+    if (selected_sphere == num_spheres - 1) return true;
+    if (s->subtract || s->blob_amount > 0) return false;
+    for (int i = selected_sphere + 1; i < num_spheres; i++) {
+        if (spheres[i].subtract || spheres[i].blob_amount > 0) return false;
+    }
+    return true;
+}
+
+// Finishes the running bake, then starts another if the shapes that are not
+// selected differ from what the cache holds.
+void bricks_update(void) {
+    BrickCache *cache = &bricks.cache;
+    bricks.current = false;
+    if (cache->stage != BRICK_IDLE) {
+        if (!brick_bake_poll(cache)) return;
+        bricks_upload();
+        brick_bake_end(cache);
+    }
+
+    if (selected_sphere < 0 || num_spheres < BRICK_MIN_SHAPES || !selection_folds_last()) return;
+
+    Sphere others[MAX_SPHERES];
+    int count = 0;
+    for (int i = 0; i < num_spheres; i++) {
+        if (i != selected_sphere) others[count++] = spheres[i];
+    }
+    if (brick_bake_start(cache, others, count)) return;
+    bricks.current = !cache->overflow;
+}
+
+bool bricks_in_use(void) {
+    return bricks.current && bricks_shader.id && mouseAction != CONTROL_NONE && mouseAction != CONTROL_ROTATE_CAMERA;
+}
+
+// Picks the shader for this frame. Raylib's batch only binds 2D textures on
+// the first few units, so the cache's 3D textures stay bound on units of
+// their own.
+void bricks_bind(void) {
+    if (!bricks_in_use()) {
+        march_shader = main_shader;
+        march_locations = &main_locations;
+        return;
+    }
+
+    march_shader = bricks_shader;
+    march_locations = &bricks_locations;
+    const int index_unit = BRICK_INDEX_UNIT;
+    const int atlas_unit = BRICK_ATLAS_UNIT;
+    SetShaderValue(bricks_shader, bricks_locations.brickIndex, &index_unit, SHADER_UNIFORM_INT);
+    SetShaderValue(bricks_shader, bricks_locations.brickAtlas, &atlas_unit, SHADER_UNIFORM_INT);
+    SetShaderValue(bricks_shader, bricks_locations.brickMin, &bricks.cache.min, SHADER_UNIFORM_VEC3);
+    SetShaderValue(bricks_shader, bricks_locations.brickMax, &bricks.cache.max, SHADER_UNIFORM_VEC3);
+    SetShaderValue(bricks_shader, bricks_locations.brickSize, &bricks.cache.size, SHADER_UNIFORM_FLOAT);
+    glActiveTexture(GL_TEXTURE0 + BRICK_INDEX_UNIT);
+    glBindTexture(GL_TEXTURE_3D, bricks.index);
+    glActiveTexture(GL_TEXTURE0 + BRICK_ATLAS_UNIT);
+    glBindTexture(GL_TEXTURE_3D, bricks.atlas);
+    glActiveTexture(GL_TEXTURE0);
+}
+
+// Lighting cache. Shadows toward the light and ambient occlusion are read
+// from a volume baked on the job system (lighting.h) rather than marched for
+// every pixel. It is lit again around whatever shapes changed, so while a
+// shape is dragged its shadow follows a few frames behind.
+#define LIGHT_VOLUME_UNIT 5
+
+struct {
+    LightCache cache;
+    GLuint volume;
+    // Where the volume sits, which lags the cache while a new layout bakes
+    Vector3 min;
+    float cell;
+    int dims[3];
+    // Set by an upload, so the view is drawn again with the new lighting
+    bool changed;
+} lighting;
+
+// Sends the slices the bake lit, or the whole volume when it was laid out
+// again.
+void lighting_upload(void) {
+    TRACE_SCOPE("lighting_upload");
+    const LightCache *cache = &lighting.cache;
+    glBindTexture(GL_TEXTURE_3D, lighting.volume);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    if (memcmp(lighting.dims, cache->dims, sizeof(lighting.dims))) {
+        glTexImage3D(GL_TEXTURE_3D, 0, GL_RG8, cache->dims[0], cache->dims[1], cache->dims[2], 0, GL_RG, GL_UNSIGNED_BYTE, cache->texels);
+        memcpy(lighting.dims, cache->dims, sizeof(lighting.dims));
+    } else {
+        const int z = cache->dirty_min[2];
+        glTexSubImage3D(GL_TEXTURE_3D, 0, 0, 0, z, cache->dims[0], cache->dims[1], cache->dirty_max[2] - z + 1,
+                        GL_RG, GL_UNSIGNED_BYTE, cache->texels[z * cache->dims[0] * cache->dims[1]]);
+    }
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    glBindTexture(GL_TEXTURE_3D, 0);
+    lighting.min = cache->min;
+    lighting.cell = cache->cell;
+    lighting.changed = true;
+}
+
+// Called every loop, drawn or not, since a bake can finish while idle.
+void lighting_update(void) {
+    if (!lighting.volume) {
+        // Fully lit until the first bake is in
+        lighting.volume = load_volume_texture(GL_LINEAR);
+        glTexImage3D(GL_TEXTURE_3D, 0, GL_RG8, 1, 1, 1, 0, GL_RG, GL_UNSIGNED_BYTE, (uint8_t[4]){ 255, 255 });
+        glBindTexture(GL_TEXTURE_3D, 0);
+        lighting.dims[0] = lighting.dims[1] = lighting.dims[2] = 1;
+        lighting.cell = 1;
+    }
+
+    LightCache *cache = &lighting.cache;
+    if (light_bake_poll(cache)) lighting_upload();
+    if (!light_baking(cache)) light_bake_start(cache, spheres, num_spheres);
+}
+
+void lighting_bind(void) {
+    const int unit = LIGHT_VOLUME_UNIT;
+    SetShaderValue(march_shader, march_locations->lightVolume, &unit, SHADER_UNIFORM_INT);
+    SetShaderValue(march_shader, march_locations->lightMin, &lighting.min, SHADER_UNIFORM_VEC3);
+    SetShaderValue(march_shader, march_locations->lightCell, &lighting.cell, SHADER_UNIFORM_FLOAT);
+    glActiveTexture(GL_TEXTURE0 + LIGHT_VOLUME_UNIT);
+    glBindTexture(GL_TEXTURE_3D, lighting.volume);
+    glActiveTexture(GL_TEXTURE0);
+}
+
+// Dynamic resolution. While the view changes, the raymarch fills only the
+// lower-left part of a viewport-sized target, sized so the pass's GPU time
+// stays within the governor's budget, with its samples jittered each frame so
+// upsample.fs can fill in detail from the reprojected previous output. Once
+// the view holds still the pass runs at full resolution again, so the frame
+// left on screen when idle is exact. Targets are half float with the view
+// ray distance in alpha.
+#define VIEWPORT_MIN_SCALE 0.25
+#define VIEWPORT_JITTER_FRAMES 8
+// How much a sample landing right on an output pixel replaces its history
+#define VIEWPORT_SAMPLE_WEIGHT 0.5f
+// A still view keeps marching jittered full resolution frames and averages
+// them, which antialiases it, until this many samples are in. After that
+// the history is presented as is.
+#define VIEWPORT_AA_SAMPLES 16
+// Side of the square of march texels one cone pre-pass texel covers, the
+// CONE_TILE of shader_base.fs
+#define VIEWPORT_CONE_TILE 8
+
+// Set by redraw_needed when what the viewport shows differs from last frame.
+bool view_changed = true;
+
+struct {
+    RenderTexture2D current;
+    RenderTexture2D history[2];
+    // Distance each tile's rays can skip, from the cone pre-pass
+    RenderTexture2D cone;
+    int history_index;
+    bool history_valid;
+    int width, height;
+    // Linear scale that fits the budget, and the fraction of the viewport
+    // drawn in the frame each query slot timed.
+    float scale;
+    float slot_area[PERF_QUERY_FRAMES];
+    // Samples averaged into the history since the view last changed
+    int samples;
+    Camera previous_camera;
+    Shader shader;
+    struct {
+        int current;
+        int history;
+        int renderScale;
+        int jitter;
+        int viewportSize;
+        int viewportOrigin;
+        int resolution;
+        int viewEye;
+        int viewCenter;
+        int previousEye;
+        int previousCenter;
+        int currentWeight;
+        int accumulate;
+    } locations;
+} viewport = { .scale = 1 };
+
+RenderTexture2D load_float_target(int width, int height, PixelFormat format) {
+    RenderTexture2D target = { .id = rlLoadFramebuffer(width, height) };
+    target.texture = (Texture2D){
+        .id = rlLoadTexture(NULL, width, height, format, 1),
+        .width = width,
+        .height = height,
+        .mipmaps = 1,
+        .format = format,
+    };
+    rlEnableFramebuffer(target.id);
+    rlFramebufferAttach(target.id, target.texture.id, RL_ATTACHMENT_COLOR_CHANNEL0, RL_ATTACHMENT_TEXTURE2D, 0);
+    rlDisableFramebuffer();
+    SetTextureFilter(target.texture, TEXTURE_FILTER_BILINEAR);
+    SetTextureWrap(target.texture, TEXTURE_WRAP_CLAMP);
+    return target;
+}
+
+void viewport_resize(int width, int height) {
+    if (!viewport.shader.id) {
+        viewport.shader = LoadShaderFromMemory(vshader, (const char *)upsample_fs);
+        viewport.locations.current = GetShaderLocation(viewport.shader, "current");
+        viewport.locations.history = GetShaderLocation(viewport.shader, "history");
+        viewport.locations.renderScale = GetShaderLocation(viewport.shader, "renderScale");
+        viewport.locations.jitter = GetShaderLocation(viewport.shader, "jitter");
+        viewport.locations.viewportSize = GetShaderLocation(viewport.shader, "viewportSize");
+        viewport.locations.viewportOrigin = GetShaderLocation(viewport.shader, "viewportOrigin");
+        viewport.locations.resolution = GetShaderLocation(viewport.shader, "resolution");
+        viewport.locations.viewEye = GetShaderLocation(viewport.shader, "viewEye");
+        viewport.locations.viewCenter = GetShaderLocation(viewport.shader, "viewCenter");
+        viewport.locations.previousEye = GetShaderLocation(viewport.shader, "previousEye");
+        viewport.locations.previousCenter = GetShaderLocation(viewport.shader, "previousCenter");
+        viewport.locations.currentWeight = GetShaderLocation(viewport.shader, "currentWeight");
+        viewport.locations.accumulate = GetShaderLocation(viewport.shader, "accumulate");
+    }
+
+    if (viewport.width) {
+        UnloadRenderTexture(viewport.current);
+        UnloadRenderTexture(viewport.history[0]);
+        UnloadRenderTexture(viewport.history[1]);
+        UnloadRenderTexture(viewport.cone);
+    }
+    viewport.current = load_float_target(width, height, PIXELFORMAT_UNCOMPRESSED_R16G16B16A16);
+    viewport.history[0] = load_float_target(width, height, PIXELFORMAT_UNCOMPRESSED_R16G16B16A16);
+    viewport.history[1] = load_float_target(width, height, PIXELFORMAT_UNCOMPRESSED_R16G16B16A16);
+    viewport.cone = load_float_target((width + VIEWPORT_CONE_TILE - 1) / VIEWPORT_CONE_TILE,
+                                      (height + VIEWPORT_CONE_TILE - 1) / VIEWPORT_CONE_TILE,
+                                      PIXELFORMAT_UNCOMPRESSED_R32);
+    viewport.width = width;
+    viewport.height = height;
+    viewport.history_valid = false;
+}
+
+// Radical inverse, for low-discrepancy jitter offsets.
+float halton(int index, int base) {
+    float fraction = 1, result = 0;
+    for (; index > 0; index /= base) {
+        fraction /= base;
+        result += fraction * (index % base);
+    }
+    return result;
+}
+
+// March cost grows with the pixel count, so the area that fits the budget is
+// the area that was timed scaled by budget / time. Results arrive
+// PERF_QUERY_FRAMES late, hence the damping.
+void viewport_fit_budget(void) {
+    const int slot = perf.frame % PERF_QUERY_FRAMES;
+    const double ms = perf.gpu_last_ms[PERF_PASS_RAYMARCH];
+    if (ms <= 0 || viewport.slot_area[slot] <= 0) return;
+
+    const float fit = sqrtf(viewport.slot_area[slot] * governor_budget_ms() / ms);
+    viewport.scale += (Clamp(fit, VIEWPORT_MIN_SCALE, 1) - viewport.scale) * 0.5f;
+
+    // Only passes marched at the governor's current tier say whether it fits
+    if (governor.slot_quality[slot] == governor.quality) {
+        if (fit < VIEWPORT_MIN_SCALE && governor.quality < MARCH_QUALITY_COUNT - 1) {
+            governor.quality++;
+        } else if (fit > GOVERNOR_RECOVER_FIT && governor.quality > 1) {
+            governor.quality--;
+        }
+    }
+}
+
+// The cost visualizers count per frame and the SDF one animates, so only the
+// shaded view is accumulated.
+bool viewport_converged(void) {
+    return visuals_mode != VISUALS_NONE || viewport.samples >= VIEWPORT_AA_SAMPLES;
+}
+
+void viewport_present(void) {
+    // The window keeps its own alpha
+    rlDrawRenderBatchActive();
+    rlDisableColorBlend();
+    glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_FALSE);
+    DrawTexturePro(viewport.history[viewport.history_index].texture, (Rectangle){ 0, 0, viewport.width, -viewport.height },
+                   (Rectangle){ sidebar_width, 0, GetScreenWidth() - sidebar_width, GetScreenHeight() },
+                   (Vector2){ 0, 0 }, 0, WHITE);
+    rlDrawRenderBatchActive();
+    glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+    rlEnableColorBlend();
+}
+
+// Marches the scene, upsamples or accumulates it into the next history
+// target and draws that into the viewport. The main shader's other uniforms
+// are already set.
+void viewport_draw(void) {
+    const Vector2 dpi = GetWindowScaleDPI();
+    const int width = (int)((GetScreenWidth() - sidebar_width) * dpi.x);
+    const int height = (int)(GetScreenHeight() * dpi.y);
+    if (width <= 0 || height <= 0) return;
+    if (width != viewport.width || height != viewport.height) viewport_resize(width, height);
+
+    viewport_fit_budget();
+
+    // A drag counts as moving only while the mouse does, so a paused drag
+    // settles at full resolution too. The cost visualizers report per
+    // pixel, so they always get every pixel. Frames marched through the
+    // brick cache are not exact, so they never count as samples.
+    const bool dragging = mouseAction != CONTROL_NONE && Vector2Length(GetMouseDelta()) > 0;
+    const bool moving = dragging || memcmp(&camera, &viewport.previous_camera, sizeof(camera));
+    if (moving || view_changed || !viewport.history_valid || visuals_mode != VISUALS_NONE || bricks_in_use()) {
+        viewport.samples = 0;
+    } else if (viewport.samples >= VIEWPORT_AA_SAMPLES) {
+        viewport_present();
+        return;
+    }
+
+    const bool reduced = moving && visuals_mode < VISUALS_MARCH_STEPS;
+    const float scale = reduced ? viewport.scale : 1;
+    const int used_width = (int)fmaxf(1, roundf(width * scale));
+    const int used_height = (int)fmaxf(1, roundf(height * scale));
+    const float render_scale[2] = { (float)used_width / width, (float)used_height / height };
+    const float area = render_scale[0] * render_scale[1];
+    viewport.slot_area[perf.frame % PERF_QUERY_FRAMES] = area;
+
+    // The first sample of a still view is centered, later ones spread
+    // over the pixel
+    float jitter[2] = { 0, 0 };
+    const int index = area < 1 ? perf.frame % VIEWPORT_JITTER_FRAMES + 1 : viewport.samples;
+    if (index > 0) {
+        jitter[0] = halton(index, 2) - 0.5f;
+        jitter[1] = halton(index, 3) - 0.5f;
+    }
+
+    const float origin[2] = { sidebar_width * dpi.x, 0 };
+    SetShaderValue(march_shader, march_locations->viewportOrigin, origin, SHADER_UNIFORM_VEC2);
+    SetShaderValue(march_shader, march_locations->renderScale, render_scale, SHADER_UNIFORM_VEC2);
+    SetShaderValue(march_shader, march_locations->jitter, jitter, SHADER_UNIFORM_VEC2);
+    governor_bind(reduced);
+
+    // Both passes are timed together since the pre-pass is part of the
+    // march cost. Alpha is depth, not coverage, so nothing is blended into
+    // the targets.
+    perf_gpu_begin(PERF_PASS_RAYMARCH);
+    const int cone_pass = 1;
+    SetShaderValue(march_shader, march_locations->conePass, &cone_pass, SHADER_UNIFORM_INT);
+    BeginTextureMode(viewport.cone); {
+        rlDisableColorBlend();
+        rlViewport(0, 0, (used_width + VIEWPORT_CONE_TILE - 1) / VIEWPORT_CONE_TILE,
+                   (used_height + VIEWPORT_CONE_TILE - 1) / VIEWPORT_CONE_TILE);
+        BeginShaderMode(march_shader); {
+            DrawRectangle(0, 0, width, height, WHITE);
+        } EndShaderMode();
+        rlEnableColorBlend();
+    } EndTextureMode();
+
+    const int march_pass = 0;
+    SetShaderValue(march_shader, march_locations->conePass, &march_pass, SHADER_UNIFORM_INT);
+    BeginTextureMode(viewport.current); {
+        rlDisableColorBlend();
+        rlViewport(0, 0, used_width, used_height);
+        BeginShaderMode(march_shader); {
+            SetShaderValueTexture(march_shader, march_locations->coneStarts, viewport.cone.texture);
+            DrawRectangle(0, 0, width, height, WHITE);
+        } EndShaderMode();
+        rlEnableColorBlend();
+    } EndTextureMode();
+    perf_gpu_end(PERF_PASS_RAYMARCH);
+
+    // Accumulating keeps a running mean. Otherwise at full resolution every
+    // pixel has its own sample and needs no history.
+    const int accumulate = viewport.samples > 0;
+    const float weight = accumulate ? 1.0f / (viewport.samples + 1) :
+                         viewport.history_valid && area < 1 ? VIEWPORT_SAMPLE_WEIGHT : 1;
+    const float size[2] = { width, height };
+    const float resolution[2] = { GetScreenWidth() * dpi.x, GetScreenHeight() * dpi.y };
+    SetShaderValue(viewport.shader, viewport.locations.renderScale, render_scale, SHADER_UNIFORM_VEC2);
+    SetShaderValue(viewport.shader, viewport.locations.jitter, jitter, SHADER_UNIFORM_VEC2);
+    SetShaderValue(viewport.shader, viewport.locations.viewportSize, size, SHADER_UNIFORM_VEC2);
+    SetShaderValue(viewport.shader, viewport.locations.viewportOrigin, origin, SHADER_UNIFORM_VEC2);
+    SetShaderValue(viewport.shader, viewport.locations.resolution, resolution, SHADER_UNIFORM_VEC2);
+    SetShaderValue(viewport.shader, viewport.locations.viewEye, &camera.position, SHADER_UNIFORM_VEC3);
+    SetShaderValue(viewport.shader, viewport.locations.viewCenter, &camera.target, SHADER_UNIFORM_VEC3);
+    SetShaderValue(viewport.shader, viewport.locations.previousEye, &viewport.previous_camera.position, SHADER_UNIFORM_VEC3);
+    SetShaderValue(viewport.shader, viewport.locations.previousCenter, &viewport.previous_camera.target, SHADER_UNIFORM_VEC3);
+    SetShaderValue(viewport.shader, viewport.locations.currentWeight, &weight, SHADER_UNIFORM_FLOAT);
+    SetShaderValue(viewport.shader, viewport.locations.accumulate, &accumulate, SHADER_UNIFORM_INT);
+
+    const int write = viewport.history_index ^ 1;
+    BeginTextureMode(viewport.history[write]); {
+        rlDisableColorBlend();
+        BeginShaderMode(viewport.shader); {
+            SetShaderValueTexture(viewport.shader, viewport.locations.current, viewport.current.texture);
+            SetShaderValueTexture(viewport.shader, viewport.locations.history, viewport.history[viewport.history_index].texture);
+            DrawRectangle(0, 0, width, height, WHITE);
+        } EndShaderMode();
+        rlEnableColorBlend();
+    } EndTextureMode();
+
+    viewport.history_index = write;
+    viewport.history_valid = true;
+    viewport.previous_camera = camera;
+    if (area >= 1 && visuals_mode == VISUALS_NONE && !bricks_in_use()) viewport.samples++;
+
+    viewport_present();
+}
+
 void delete_sphere(int index) {
     memmove(&spheres[index], &spheres[index+1], sizeof(Sphere)*(num_spheres-index));
     num_spheres--;
@@ -346,343 +1142,118 @@ uint64_t FNV1a_64_hash(uint8_t *data, int len) {
     return hash;
 }
 
-void save(char *name) {
-    const int size = sizeof(int) + sizeof(Sphere) * num_spheres;
-    char *data = malloc(size);
-    *(int *)(void *)data = num_spheres;
-    memcpy(data + sizeof(int), spheres, num_spheres * sizeof(Sphere));
+// Saves run on the job system. The scene is copied up front, so it can keep
+// changing while the copy is hashed and written.
+typedef struct {
+    char name[64];
+    int size;
+    char data[];
+} SaveRequest;
+
+void save_job(Job *job, void *data, Arena *arena) {
+    (void)job;
+    (void)arena;
+    TRACE_SCOPE("save");
+    SaveRequest *request = data;
 
     char filename[256];
-    snprintf(filename, sizeof(filename), "build/%s_%llu.ocad", name, FNV1a_64_hash((uint8_t *)data, size));
+    snprintf(filename, sizeof(filename), "build/%s_%llu.ocad", request->name,
+             (unsigned long long)FNV1a_64_hash((uint8_t *)request->data, request->size));
     FILE *file = fopen(filename, "wb");
     if (file) {
-        fwrite(data, 1, size, file);
+        fwrite(request->data, 1, request->size, file);
         fclose(file);
     }
 
-    free(data);
+    free(request);
+}
+
+void save(char *name) {
+    const int size = sizeof(int) + sizeof(Sphere) * num_spheres;
+    SaveRequest *request = malloc(sizeof(SaveRequest) + size);
+    snprintf(request->name, sizeof(request->name), "%s", name);
+    request->size = size;
+    *(int *)(void *)request->data = num_spheres;
+    memcpy(request->data + sizeof(int), spheres, num_spheres * sizeof(Sphere));
+
+    job_run_async(save_job, request, JOB_PRIORITY_LOW);
     lastSave = glfwGetTime();
 }
 
+// Snapshots are read and validated on the job system, then swapped into the
+// scene on the main thread by apply_snapshot once the job is done.
+typedef struct {
+    char path[512];
+    bool ok;
+    int num_spheres;
+    Sphere spheres[MAX_SPHERES];
+} SnapshotLoad;
+
+Job *snapshot_job;
+SnapshotLoad *snapshot_load;
+
+void load_snapshot_job(Job *job, void *data, Arena *arena) {
+    (void)job;
+    (void)arena;
+    TRACE_SCOPE("open snapshot");
+    SnapshotLoad *load = data;
+    load->ok = snapshot_read(load->path, load->spheres, &load->num_spheres);
+
+    // Wakes the main loop if it is idling so the shapes show up right away.
+    glfwPostEmptyEvent();
+}
+
 void openSnapshot(const char *path) {
+    if (snapshot_job) return;
     printf("opening ========= %s\n", path);
 
-    FILE *file = fopen(path, "rb");
-    if (!file) {
-        perror("Failed to open file");
-        return;
+    snapshot_load = calloc(1, sizeof(SnapshotLoad));
+    snprintf(snapshot_load->path, sizeof(snapshot_load->path), "%s", path);
+    snapshot_job = job_create(load_snapshot_job, snapshot_load, JOB_PRIORITY_HIGH);
+    job_submit(snapshot_job);
+}
+
+void apply_snapshot(void) {
+    if (!snapshot_job || !job_finished(snapshot_job)) return;
+
+    if (snapshot_load->ok) {
+        num_spheres = snapshot_load->num_spheres;
+        memcpy(spheres, snapshot_load->spheres, sizeof(Sphere) * num_spheres);
+        selected_sphere = -1;
+        needs_rebuild = true;
+        lastSave = glfwGetTime();
     }
 
-    fseek(file, 0, SEEK_END);
-    long size = ftell(file);
-    fseek(file, 0, SEEK_SET);
+    job_release(snapshot_job);
+    free(snapshot_load);
+    snapshot_job = NULL;
+    snapshot_load = NULL;
+}
 
-    char *data = malloc(size);
-    fread(data, 1, size, file);
-    fclose(file);
+#define SDF_THRESHOLD (0)
 
-    num_spheres = *(int *)(void *)data;
-    memcpy(spheres, data + sizeof(int), sizeof(Sphere) * num_spheres);
+// Polygonizes one marching cubes cell into `mesh` as OBJ text. Every triangle
+// gets its own three vertices and refers to them with relative indices.
+void process_cube(int cubeindex, Vector4 v0, Vector4 v1, Vector4 v2, Vector4 v3,
+                  Vector4 v4, Vector4 v5, Vector4 v6, Vector4 v7, StringBuilder *mesh) {
+    const Vector4 corners[8] = { v0, v1, v2, v3, v4, v5, v6, v7 };
+    Vector3 vertlist[12];
 
-    free(data);
+    for (int edge = 0; edge < 12; edge++) {
+        if (edgeTable[cubeindex] & (1 << edge)) {
+            vertlist[edge] = VertexInterp(corners[edgeVertices[edge][0]], corners[edgeVertices[edge][1]], SDF_THRESHOLD);
+        }
+    }
 
-    selected_sphere = -1;
-    // needs_rebuild = true; // Mark as needing rebuild
-    lastSave = glfwGetTime();
+    for (int i = 0; triTable[cubeindex][i] != -1; i += 3) {
+        Vector3 a = vertlist[triTable[cubeindex][i]];
+        Vector3 b = vertlist[triTable[cubeindex][i+1]];
+        Vector3 c = vertlist[triTable[cubeindex][i+2]];
+        sb_appendf(mesh, "v %f %f %f\nv %f %f %f\nv %f %f %f\nf -3 -2 -1\n",
+                   a.x, a.y, a.z, b.x, b.y, b.z, c.x, c.y, c.z);
+    }
 }
 
-// from https://paulbourke.net/geometry/polygonise/
-const int edgeTable[256]={
-    0x0  , 0x109, 0x203, 0x30a, 0x406, 0x50f, 0x605, 0x70c,
-    0x80c, 0x905, 0xa0f, 0xb06, 0xc0a, 0xd03, 0xe09, 0xf00,
-    0x190, 0x99 , 0x393, 0x29a, 0x596, 0x49f, 0x795, 0x69c,
-    0x99c, 0x895, 0xb9f, 0xa96, 0xd9a, 0xc93, 0xf99, 0xe90,
-    0x230, 0x339, 0x33 , 0x13a, 0x636, 0x73f, 0x435, 0x53c,
-    0xa3c, 0xb35, 0x83f, 0x936, 0xe3a, 0xf33, 0xc39, 0xd30,
-    0x3a0, 0x2a9, 0x1a3, 0xaa , 0x7a6, 0x6af, 0x5a5, 0x4ac,
-    0xbac, 0xaa5, 0x9af, 0x8a6, 0xfaa, 0xea3, 0xda9, 0xca0,
-    0x460, 0x569, 0x663, 0x76a, 0x66 , 0x16f, 0x265, 0x36c,
-    0xc6c, 0xd65, 0xe6f, 0xf66, 0x86a, 0x963, 0xa69, 0xb60,
-    0x5f0, 0x4f9, 0x7f3, 0x6fa, 0x1f6, 0xff , 0x3f5, 0x2fc,
-    0xdfc, 0xcf5, 0xfff, 0xef6, 0x9fa, 0x8f3, 0xbf9, 0xaf0,
-    0x650, 0x759, 0x453, 0x55a, 0x256, 0x35f, 0x55 , 0x15c,
-    0xe5c, 0xf55, 0xc5f, 0xd56, 0xa5a, 0xb53, 0x859, 0x950,
-    0x7c0, 0x6c9, 0x5c3, 0x4ca, 0x3c6, 0x2cf, 0x1c5, 0xcc ,
-    0xfcc, 0xec5, 0xdcf, 0xcc6, 0xbca, 0xac3, 0x9c9, 0x8c0,
-    0x8c0, 0x9c9, 0xac3, 0xbca, 0xcc6, 0xdcf, 0xec5, 0xfcc,
-    0xcc , 0x1c5, 0x2cf, 0x3c6, 0x4ca, 0x5c3, 0x6c9, 0x7c0,
-    0x950, 0x859, 0xb53, 0xa5a, 0xd56, 0xc5f, 0xf55, 0xe5c,
-    0x15c, 0x55 , 0x35f, 0x256, 0x55a, 0x453, 0x759, 0x650,
-    0xaf0, 0xbf9, 0x8f3, 0x9fa, 0xef6, 0xfff, 0xcf5, 0xdfc,
-    0x2fc, 0x3f5, 0xff , 0x1f6, 0x6fa, 0x7f3, 0x4f9, 0x5f0,
-    0xb60, 0xa69, 0x963, 0x86a, 0xf66, 0xe6f, 0xd65, 0xc6c,
-    0x36c, 0x265, 0x16f, 0x66 , 0x76a, 0x663, 0x569, 0x460,
-    0xca0, 0xda9, 0xea3, 0xfaa, 0x8a6, 0x9af, 0xaa5, 0xbac,
-    0x4ac, 0x5a5, 0x6af, 0x7a6, 0xaa , 0x1a3, 0x2a9, 0x3a0,
-    0xd30, 0xc39, 0xf33, 0xe3a, 0x936, 0x83f, 0xb35, 0xa3c,
-    0x53c, 0x435, 0x73f, 0x636, 0x13a, 0x33 , 0x339, 0x230,
-    0xe90, 0xf99, 0xc93, 0xd9a, 0xa96, 0xb9f, 0x895, 0x99c,
-    0x69c, 0x795, 0x49f, 0x596, 0x29a, 0x393, 0x99 , 0x190,
-    0xf00, 0xe09, 0xd03, 0xc0a, 0xb06, 0xa0f, 0x905, 0x80c,
-    0x70c, 0x605, 0x50f, 0x406, 0x30a, 0x203, 0x109, 0x0   };
-    const int triTable[256][16] =
-    {{-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
-    {0, 8, 3, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
-    {0, 1, 9, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
-    {1, 8, 3, 9, 8, 1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
-    {1, 2, 10, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
-    {0, 8, 3, 1, 2, 10, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
-    {9, 2, 10, 0, 2, 9, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
-    {2, 8, 3, 2, 10, 8, 10, 9, 8, -1, -1, -1, -1, -1, -1, -1},
-    {3, 11, 2, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
-    {0, 11, 2, 8, 11, 0, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
-    {1, 9, 0, 2, 3, 11, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
-    {1, 11, 2, 1, 9, 11, 9, 8, 11, -1, -1, -1, -1, -1, -1, -1},
-    {3, 10, 1, 11, 10, 3, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
-    {0, 10, 1, 0, 8, 10, 8, 11, 10, -1, -1, -1, -1, -1, -1, -1},
-    {3, 9, 0, 3, 11, 9, 11, 10, 9, -1, -1, -1, -1, -1, -1, -1},
-    {9, 8, 10, 10, 8, 11, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
-    {4, 7, 8, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
-    {4, 3, 0, 7, 3, 4, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
-    {0, 1, 9, 8, 4, 7, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
-    {4, 1, 9, 4, 7, 1, 7, 3, 1, -1, -1, -1, -1, -1, -1, -1},
-    {1, 2, 10, 8, 4, 7, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
-    {3, 4, 7, 3, 0, 4, 1, 2, 10, -1, -1, -1, -1, -1, -1, -1},
-    {9, 2, 10, 9, 0, 2, 8, 4, 7, -1, -1, -1, -1, -1, -1, -1},
-    {2, 10, 9, 2, 9, 7, 2, 7, 3, 7, 9, 4, -1, -1, -1, -1},
-    {8, 4, 7, 3, 11, 2, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
-    {11, 4, 7, 11, 2, 4, 2, 0, 4, -1, -1, -1, -1, -1, -1, -1},
-    {9, 0, 1, 8, 4, 7, 2, 3, 11, -1, -1, -1, -1, -1, -1, -1},
-    {4, 7, 11, 9, 4, 11, 9, 11, 2, 9, 2, 1, -1, -1, -1, -1},
-    {3, 10, 1, 3, 11, 10, 7, 8, 4, -1, -1, -1, -1, -1, -1, -1},
-    {1, 11, 10, 1, 4, 11, 1, 0, 4, 7, 11, 4, -1, -1, -1, -1},
-    {4, 7, 8, 9, 0, 11, 9, 11, 10, 11, 0, 3, -1, -1, -1, -1},
-    {4, 7, 11, 4, 11, 9, 9, 11, 10, -1, -1, -1, -1, -1, -1, -1},
-    {9, 5, 4, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
-    {9, 5, 4, 0, 8, 3, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
-    {0, 5, 4, 1, 5, 0, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
-    {8, 5, 4, 8, 3, 5, 3, 1, 5, -1, -1, -1, -1, -1, -1, -1},
-    {1, 2, 10, 9, 5, 4, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
-    {3, 0, 8, 1, 2, 10, 4, 9, 5, -1, -1, -1, -1, -1, -1, -1},
-    {5, 2, 10, 5, 4, 2, 4, 0, 2, -1, -1, -1, -1, -1, -1, -1},
-    {2, 10, 5, 3, 2, 5, 3, 5, 4, 3, 4, 8, -1, -1, -1, -1},
-    {9, 5, 4, 2, 3, 11, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
-    {0, 11, 2, 0, 8, 11, 4, 9, 5, -1, -1, -1, -1, -1, -1, -1},
-    {0, 5, 4, 0, 1, 5, 2, 3, 11, -1, -1, -1, -1, -1, -1, -1},
-    {2, 1, 5, 2, 5, 8, 2, 8, 11, 4, 8, 5, -1, -1, -1, -1},
-    {10, 3, 11, 10, 1, 3, 9, 5, 4, -1, -1, -1, -1, -1, -1, -1},
-    {4, 9, 5, 0, 8, 1, 8, 10, 1, 8, 11, 10, -1, -1, -1, -1},
-    {5, 4, 0, 5, 0, 11, 5, 11, 10, 11, 0, 3, -1, -1, -1, -1},
-    {5, 4, 8, 5, 8, 10, 10, 8, 11, -1, -1, -1, -1, -1, -1, -1},
-    {9, 7, 8, 5, 7, 9, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
-    {9, 3, 0, 9, 5, 3, 5, 7, 3, -1, -1, -1, -1, -1, -1, -1},
-    {0, 7, 8, 0, 1, 7, 1, 5, 7, -1, -1, -1, -1, -1, -1, -1},
-    {1, 5, 3, 3, 5, 7, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
-    {9, 7, 8, 9, 5, 7, 10, 1, 2, -1, -1, -1, -1, -1, -1, -1},
-    {10, 1, 2, 9, 5, 0, 5, 3, 0, 5, 7, 3, -1, -1, -1, -1},
-    {8, 0, 2, 8, 2, 5, 8, 5, 7, 10, 5, 2, -1, -1, -1, -1},
-    {2, 10, 5, 2, 5, 3, 3, 5, 7, -1, -1, -1, -1, -1, -1, -1},
-    {7, 9, 5, 7, 8, 9, 3, 11, 2, -1, -1, -1, -1, -1, -1, -1},
-    {9, 5, 7, 9, 7, 2, 9, 2, 0, 2, 7, 11, -1, -1, -1, -1},
-    {2, 3, 11, 0, 1, 8, 1, 7, 8, 1, 5, 7, -1, -1, -1, -1},
-    {11, 2, 1, 11, 1, 7, 7, 1, 5, -1, -1, -1, -1, -1, -1, -1},
-    {9, 5, 8, 8, 5, 7, 10, 1, 3, 10, 3, 11, -1, -1, -1, -1},
-    {5, 7, 0, 5, 0, 9, 7, 11, 0, 1, 0, 10, 11, 10, 0, -1},
-    {11, 10, 0, 11, 0, 3, 10, 5, 0, 8, 0, 7, 5, 7, 0, -1},
-    {11, 10, 5, 7, 11, 5, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
-    {10, 6, 5, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
-    {0, 8, 3, 5, 10, 6, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
-    {9, 0, 1, 5, 10, 6, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
-    {1, 8, 3, 1, 9, 8, 5, 10, 6, -1, -1, -1, -1, -1, -1, -1},
-    {1, 6, 5, 2, 6, 1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
-    {1, 6, 5, 1, 2, 6, 3, 0, 8, -1, -1, -1, -1, -1, -1, -1},
-    {9, 6, 5, 9, 0, 6, 0, 2, 6, -1, -1, -1, -1, -1, -1, -1},
-    {5, 9, 8, 5, 8, 2, 5, 2, 6, 3, 2, 8, -1, -1, -1, -1},
-    {2, 3, 11, 10, 6, 5, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
-    {11, 0, 8, 11, 2, 0, 10, 6, 5, -1, -1, -1, -1, -1, -1, -1},
-    {0, 1, 9, 2, 3, 11, 5, 10, 6, -1, -1, -1, -1, -1, -1, -1},
-    {5, 10, 6, 1, 9, 2, 9, 11, 2, 9, 8, 11, -1, -1, -1, -1},
-    {6, 3, 11, 6, 5, 3, 5, 1, 3, -1, -1, -1, -1, -1, -1, -1},
-    {0, 8, 11, 0, 11, 5, 0, 5, 1, 5, 11, 6, -1, -1, -1, -1},
-    {3, 11, 6, 0, 3, 6, 0, 6, 5, 0, 5, 9, -1, -1, -1, -1},
-    {6, 5, 9, 6, 9, 11, 11, 9, 8, -1, -1, -1, -1, -1, -1, -1},
-    {5, 10, 6, 4, 7, 8, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
-    {4, 3, 0, 4, 7, 3, 6, 5, 10, -1, -1, -1, -1, -1, -1, -1},
-    {1, 9, 0, 5, 10, 6, 8, 4, 7, -1, -1, -1, -1, -1, -1, -1},
-    {10, 6, 5, 1, 9, 7, 1, 7, 3, 7, 9, 4, -1, -1, -1, -1},
-    {6, 1, 2, 6, 5, 1, 4, 7, 8, -1, -1, -1, -1, -1, -1, -1},
-    {1, 2, 5, 5, 2, 6, 3, 0, 4, 3, 4, 7, -1, -1, -1, -1},
-    {8, 4, 7, 9, 0, 5, 0, 6, 5, 0, 2, 6, -1, -1, -1, -1},
-    {7, 3, 9, 7, 9, 4, 3, 2, 9, 5, 9, 6, 2, 6, 9, -1},
-    {3, 11, 2, 7, 8, 4, 10, 6, 5, -1, -1, -1, -1, -1, -1, -1},
-    {5, 10, 6, 4, 7, 2, 4, 2, 0, 2, 7, 11, -1, -1, -1, -1},
-    {0, 1, 9, 4, 7, 8, 2, 3, 11, 5, 10, 6, -1, -1, -1, -1},
-    {9, 2, 1, 9, 11, 2, 9, 4, 11, 7, 11, 4, 5, 10, 6, -1},
-    {8, 4, 7, 3, 11, 5, 3, 5, 1, 5, 11, 6, -1, -1, -1, -1},
-    {5, 1, 11, 5, 11, 6, 1, 0, 11, 7, 11, 4, 0, 4, 11, -1},
-    {0, 5, 9, 0, 6, 5, 0, 3, 6, 11, 6, 3, 8, 4, 7, -1},
-    {6, 5, 9, 6, 9, 11, 4, 7, 9, 7, 11, 9, -1, -1, -1, -1},
-    {10, 4, 9, 6, 4, 10, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
-    {4, 10, 6, 4, 9, 10, 0, 8, 3, -1, -1, -1, -1, -1, -1, -1},
-    {10, 0, 1, 10, 6, 0, 6, 4, 0, -1, -1, -1, -1, -1, -1, -1},
-    {8, 3, 1, 8, 1, 6, 8, 6, 4, 6, 1, 10, -1, -1, -1, -1},
-    {1, 4, 9, 1, 2, 4, 2, 6, 4, -1, -1, -1, -1, -1, -1, -1},
-    {3, 0, 8, 1, 2, 9, 2, 4, 9, 2, 6, 4, -1, -1, -1, -1},
-    {0, 2, 4, 4, 2, 6, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
-    {8, 3, 2, 8, 2, 4, 4, 2, 6, -1, -1, -1, -1, -1, -1, -1},
-    {10, 4, 9, 10, 6, 4, 11, 2, 3, -1, -1, -1, -1, -1, -1, -1},
-    {0, 8, 2, 2, 8, 11, 4, 9, 10, 4, 10, 6, -1, -1, -1, -1},
-    {3, 11, 2, 0, 1, 6, 0, 6, 4, 6, 1, 10, -1, -1, -1, -1},
-    {6, 4, 1, 6, 1, 10, 4, 8, 1, 2, 1, 11, 8, 11, 1, -1},
-    {9, 6, 4, 9, 3, 6, 9, 1, 3, 11, 6, 3, -1, -1, -1, -1},
-    {8, 11, 1, 8, 1, 0, 11, 6, 1, 9, 1, 4, 6, 4, 1, -1},
-    {3, 11, 6, 3, 6, 0, 0, 6, 4, -1, -1, -1, -1, -1, -1, -1},
-    {6, 4, 8, 11, 6, 8, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
-    {7, 10, 6, 7, 8, 10, 8, 9, 10, -1, -1, -1, -1, -1, -1, -1},
-    {0, 7, 3, 0, 10, 7, 0, 9, 10, 6, 7, 10, -1, -1, -1, -1},
-    {10, 6, 7, 1, 10, 7, 1, 7, 8, 1, 8, 0, -1, -1, -1, -1},
-    {10, 6, 7, 10, 7, 1, 1, 7, 3, -1, -1, -1, -1, -1, -1, -1},
-    {1, 2, 6, 1, 6, 8, 1, 8, 9, 8, 6, 7, -1, -1, -1, -1},
-    {2, 6, 9, 2, 9, 1, 6, 7, 9, 0, 9, 3, 7, 3, 9, -1},
-    {7, 8, 0, 7, 0, 6, 6, 0, 2, -1, -1, -1, -1, -1, -1, -1},
-    {7, 3, 2, 6, 7, 2, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
-    {2, 3, 11, 10, 6, 8, 10, 8, 9, 8, 6, 7, -1, -1, -1, -1},
-    {2, 0, 7, 2, 7, 11, 0, 9, 7, 6, 7, 10, 9, 10, 7, -1},
-    {1, 8, 0, 1, 7, 8, 1, 10, 7, 6, 7, 10, 2, 3, 11, -1},
-    {11, 2, 1, 11, 1, 7, 10, 6, 1, 6, 7, 1, -1, -1, -1, -1},
-    {8, 9, 6, 8, 6, 7, 9, 1, 6, 11, 6, 3, 1, 3, 6, -1},
-    {0, 9, 1, 11, 6, 7, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
-    {7, 8, 0, 7, 0, 6, 3, 11, 0, 11, 6, 0, -1, -1, -1, -1},
-    {7, 11, 6, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
-    {7, 6, 11, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
-    {3, 0, 8, 11, 7, 6, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
-    {0, 1, 9, 11, 7, 6, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
-    {8, 1, 9, 8, 3, 1, 11, 7, 6, -1, -1, -1, -1, -1, -1, -1},
-    {10, 1, 2, 6, 11, 7, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
-    {1, 2, 10, 3, 0, 8, 6, 11, 7, -1, -1, -1, -1, -1, -1, -1},
-    {2, 9, 0, 2, 10, 9, 6, 11, 7, -1, -1, -1, -1, -1, -1, -1},
-    {6, 11, 7, 2, 10, 3, 10, 8, 3, 10, 9, 8, -1, -1, -1, -1},
-    {7, 2, 3, 6, 2, 7, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
-    {7, 0, 8, 7, 6, 0, 6, 2, 0, -1, -1, -1, -1, -1, -1, -1},
-    {2, 7, 6, 2, 3, 7, 0, 1, 9, -1, -1, -1, -1, -1, -1, -1},
-    {1, 6, 2, 1, 8, 6, 1, 9, 8, 8, 7, 6, -1, -1, -1, -1},
-    {10, 7, 6, 10, 1, 7, 1, 3, 7, -1, -1, -1, -1, -1, -1, -1},
-    {10, 7, 6, 1, 7, 10, 1, 8, 7, 1, 0, 8, -1, -1, -1, -1},
-    {0, 3, 7, 0, 7, 10, 0, 10, 9, 6, 10, 7, -1, -1, -1, -1},
-    {7, 6, 10, 7, 10, 8, 8, 10, 9, -1, -1, -1, -1, -1, -1, -1},
-    {6, 8, 4, 11, 8, 6, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
-    {3, 6, 11, 3, 0, 6, 0, 4, 6, -1, -1, -1, -1, -1, -1, -1},
-    {8, 6, 11, 8, 4, 6, 9, 0, 1, -1, -1, -1, -1, -1, -1, -1},
-    {9, 4, 6, 9, 6, 3, 9, 3, 1, 11, 3, 6, -1, -1, -1, -1},
-    {6, 8, 4, 6, 11, 8, 2, 10, 1, -1, -1, -1, -1, -1, -1, -1},
-    {1, 2, 10, 3, 0, 11, 0, 6, 11, 0, 4, 6, -1, -1, -1, -1},
-    {4, 11, 8, 4, 6, 11, 0, 2, 9, 2, 10, 9, -1, -1, -1, -1},
-    {10, 9, 3, 10, 3, 2, 9, 4, 3, 11, 3, 6, 4, 6, 3, -1},
-    {8, 2, 3, 8, 4, 2, 4, 6, 2, -1, -1, -1, -1, -1, -1, -1},
-    {0, 4, 2, 4, 6, 2, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
-    {1, 9, 0, 2, 3, 4, 2, 4, 6, 4, 3, 8, -1, -1, -1, -1},
-    {1, 9, 4, 1, 4, 2, 2, 4, 6, -1, -1, -1, -1, -1, -1, -1},
-    {8, 1, 3, 8, 6, 1, 8, 4, 6, 6, 10, 1, -1, -1, -1, -1},
-    {10, 1, 0, 10, 0, 6, 6, 0, 4, -1, -1, -1, -1, -1, -1, -1},
-    {4, 6, 3, 4, 3, 8, 6, 10, 3, 0, 3, 9, 10, 9, 3, -1},
-    {10, 9, 4, 6, 10, 4, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
-    {4, 9, 5, 7, 6, 11, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
-    {0, 8, 3, 4, 9, 5, 11, 7, 6, -1, -1, -1, -1, -1, -1, -1},
-    {5, 0, 1, 5, 4, 0, 7, 6, 11, -1, -1, -1, -1, -1, -1, -1},
-    {11, 7, 6, 8, 3, 4, 3, 5, 4, 3, 1, 5, -1, -1, -1, -1},
-    {9, 5, 4, 10, 1, 2, 7, 6, 11, -1, -1, -1, -1, -1, -1, -1},
-    {6, 11, 7, 1, 2, 10, 0, 8, 3, 4, 9, 5, -1, -1, -1, -1},
-    {7, 6, 11, 5, 4, 10, 4, 2, 10, 4, 0, 2, -1, -1, -1, -1},
-    {3, 4, 8, 3, 5, 4, 3, 2, 5, 10, 5, 2, 11, 7, 6, -1},
-    {7, 2, 3, 7, 6, 2, 5, 4, 9, -1, -1, -1, -1, -1, -1, -1},
-    {9, 5, 4, 0, 8, 6, 0, 6, 2, 6, 8, 7, -1, -1, -1, -1},
-    {3, 6, 2, 3, 7, 6, 1, 5, 0, 5, 4, 0, -1, -1, -1, -1},
-    {6, 2, 8, 6, 8, 7, 2, 1, 8, 4, 8, 5, 1, 5, 8, -1},
-    {9, 5, 4, 10, 1, 6, 1, 7, 6, 1, 3, 7, -1, -1, -1, -1},
-    {1, 6, 10, 1, 7, 6, 1, 0, 7, 8, 7, 0, 9, 5, 4, -1},
-    {4, 0, 10, 4, 10, 5, 0, 3, 10, 6, 10, 7, 3, 7, 10, -1},
-    {7, 6, 10, 7, 10, 8, 5, 4, 10, 4, 8, 10, -1, -1, -1, -1},
-    {6, 9, 5, 6, 11, 9, 11, 8, 9, -1, -1, -1, -1, -1, -1, -1},
-    {3, 6, 11, 0, 6, 3, 0, 5, 6, 0, 9, 5, -1, -1, -1, -1},
-    {0, 11, 8, 0, 5, 11, 0, 1, 5, 5, 6, 11, -1, -1, -1, -1},
-    {6, 11, 3, 6, 3, 5, 5, 3, 1, -1, -1, -1, -1, -1, -1, -1},
-    {1, 2, 10, 9, 5, 11, 9, 11, 8, 11, 5, 6, -1, -1, -1, -1},
-    {0, 11, 3, 0, 6, 11, 0, 9, 6, 5, 6, 9, 1, 2, 10, -1},
-    {11, 8, 5, 11, 5, 6, 8, 0, 5, 10, 5, 2, 0, 2, 5, -1},
-    {6, 11, 3, 6, 3, 5, 2, 10, 3, 10, 5, 3, -1, -1, -1, -1},
-    {5, 8, 9, 5, 2, 8, 5, 6, 2, 3, 8, 2, -1, -1, -1, -1},
-    {9, 5, 6, 9, 6, 0, 0, 6, 2, -1, -1, -1, -1, -1, -1, -1},
-    {1, 5, 8, 1, 8, 0, 5, 6, 8, 3, 8, 2, 6, 2, 8, -1},
-    {1, 5, 6, 2, 1, 6, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
-    {1, 3, 6, 1, 6, 10, 3, 8, 6, 5, 6, 9, 8, 9, 6, -1},
-    {10, 1, 0, 10, 0, 6, 9, 5, 0, 5, 6, 0, -1, -1, -1, -1},
-    {0, 3, 8, 5, 6, 10, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
-    {10, 5, 6, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
-    {11, 5, 10, 7, 5, 11, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
-    {11, 5, 10, 11, 7, 5, 8, 3, 0, -1, -1, -1, -1, -1, -1, -1},
-    {5, 11, 7, 5, 10, 11, 1, 9, 0, -1, -1, -1, -1, -1, -1, -1},
-    {10, 7, 5, 10, 11, 7, 9, 8, 1, 8, 3, 1, -1, -1, -1, -1},
-    {11, 1, 2, 11, 7, 1, 7, 5, 1, -1, -1, -1, -1, -1, -1, -1},
-    {0, 8, 3, 1, 2, 7, 1, 7, 5, 7, 2, 11, -1, -1, -1, -1},
-    {9, 7, 5, 9, 2, 7, 9, 0, 2, 2, 11, 7, -1, -1, -1, -1},
-    {7, 5, 2, 7, 2, 11, 5, 9, 2, 3, 2, 8, 9, 8, 2, -1},
-    {2, 5, 10, 2, 3, 5, 3, 7, 5, -1, -1, -1, -1, -1, -1, -1},
-    {8, 2, 0, 8, 5, 2, 8, 7, 5, 10, 2, 5, -1, -1, -1, -1},
-    {9, 0, 1, 5, 10, 3, 5, 3, 7, 3, 10, 2, -1, -1, -1, -1},
-    {9, 8, 2, 9, 2, 1, 8, 7, 2, 10, 2, 5, 7, 5, 2, -1},
-    {1, 3, 5, 3, 7, 5, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
-    {0, 8, 7, 0, 7, 1, 1, 7, 5, -1, -1, -1, -1, -1, -1, -1},
-    {9, 0, 3, 9, 3, 5, 5, 3, 7, -1, -1, -1, -1, -1, -1, -1},
-    {9, 8, 7, 5, 9, 7, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
-    {5, 8, 4, 5, 10, 8, 10, 11, 8, -1, -1, -1, -1, -1, -1, -1},
-    {5, 0, 4, 5, 11, 0, 5, 10, 11, 11, 3, 0, -1, -1, -1, -1},
-    {0, 1, 9, 8, 4, 10, 8, 10, 11, 10, 4, 5, -1, -1, -1, -1},
-    {10, 11, 4, 10, 4, 5, 11, 3, 4, 9, 4, 1, 3, 1, 4, -1},
-    {2, 5, 1, 2, 8, 5, 2, 11, 8, 4, 5, 8, -1, -1, -1, -1},
-    {0, 4, 11, 0, 11, 3, 4, 5, 11, 2, 11, 1, 5, 1, 11, -1},
-    {0, 2, 5, 0, 5, 9, 2, 11, 5, 4, 5, 8, 11, 8, 5, -1},
-    {9, 4, 5, 2, 11, 3, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
-    {2, 5, 10, 3, 5, 2, 3, 4, 5, 3, 8, 4, -1, -1, -1, -1},
-    {5, 10, 2, 5, 2, 4, 4, 2, 0, -1, -1, -1, -1, -1, -1, -1},
-    {3, 10, 2, 3, 5, 10, 3, 8, 5, 4, 5, 8, 0, 1, 9, -1},
-    {5, 10, 2, 5, 2, 4, 1, 9, 2, 9, 4, 2, -1, -1, -1, -1},
-    {8, 4, 5, 8, 5, 3, 3, 5, 1, -1, -1, -1, -1, -1, -1, -1},
-    {0, 4, 5, 1, 0, 5, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
-    {8, 4, 5, 8, 5, 3, 9, 0, 5, 0, 3, 5, -1, -1, -1, -1},
-    {9, 4, 5, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
-    {4, 11, 7, 4, 9, 11, 9, 10, 11, -1, -1, -1, -1, -1, -1, -1},
-    {0, 8, 3, 4, 9, 7, 9, 11, 7, 9, 10, 11, -1, -1, -1, -1},
-    {1, 10, 11, 1, 11, 4, 1, 4, 0, 7, 4, 11, -1, -1, -1, -1},
-    {3, 1, 4, 3, 4, 8, 1, 10, 4, 7, 4, 11, 10, 11, 4, -1},
-    {4, 11, 7, 9, 11, 4, 9, 2, 11, 9, 1, 2, -1, -1, -1, -1},
-    {9, 7, 4, 9, 11, 7, 9, 1, 11, 2, 11, 1, 0, 8, 3, -1},
-    {11, 7, 4, 11, 4, 2, 2, 4, 0, -1, -1, -1, -1, -1, -1, -1},
-    {11, 7, 4, 11, 4, 2, 8, 3, 4, 3, 2, 4, -1, -1, -1, -1},
-    {2, 9, 10, 2, 7, 9, 2, 3, 7, 7, 4, 9, -1, -1, -1, -1},
-    {9, 10, 7, 9, 7, 4, 10, 2, 7, 8, 7, 0, 2, 0, 7, -1},
-    {3, 7, 10, 3, 10, 2, 7, 4, 10, 1, 10, 0, 4, 0, 10, -1},
-    {1, 10, 2, 8, 7, 4, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
-    {4, 9, 1, 4, 1, 7, 7, 1, 3, -1, -1, -1, -1, -1, -1, -1},
-    {4, 9, 1, 4, 1, 7, 0, 8, 1, 8, 7, 1, -1, -1, -1, -1},
-    {4, 0, 3, 7, 4, 3, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
-    {4, 8, 7, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
-    {9, 10, 8, 10, 11, 8, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
-    {3, 0, 9, 3, 9, 11, 11, 9, 10, -1, -1, -1, -1, -1, -1, -1},
-    {0, 1, 10, 0, 10, 8, 8, 10, 11, -1, -1, -1, -1, -1, -1, -1},
-    {3, 1, 10, 11, 3, 10, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
-    {1, 2, 11, 1, 11, 9, 9, 11, 8, -1, -1, -1, -1, -1, -1, -1},
-    {3, 0, 9, 3, 9, 11, 1, 2, 9, 2, 11, 9, -1, -1, -1, -1},
-    {0, 2, 11, 8, 0, 11, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
-    {3, 2, 11, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
-    {2, 3, 8, 2, 8, 10, 10, 8, 9, -1, -1, -1, -1, -1, -1, -1},
-    {9, 10, 2, 0, 9, 2, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
-    {2, 3, 8, 2, 8, 10, 0, 1, 8, 1, 10, 8, -1, -1, -1, -1},
-    {1, 10, 2, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
-    {1, 3, 8, 9, 1, 8, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
-    {0, 9, 1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
-    {0, 3, 8, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
-    {-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1}};
-
 
 GLuint LoadShaderFromMemory(const char *vertexSource, const char *fragmentSource) {
     GLuint vertexShader = glCreateShader(GL_VERTEX_SHADER);
@@ -704,191 +1275,330 @@ GLuint LoadShaderFromMemory(const char *vertexSource, const char *fragmentSource
     return shaderProgram;
 }
 
+// Exports run in the background while the editor keeps drawing. The slices
+// have to be rendered on the main thread, which owns the GL context, so
+// export_update renders a few of them each frame within EXPORT_FRAME_BUDGET.
+// Every layer of cubes between two slices is then polygonized by its own
+// job, and a final job that depends on all of them writes the file.
+#define EXPORT_FRAME_BUDGET 0.004
+#define EXPORT_MAX_PENDING_SLICES 64
+
+typedef struct {
+    const float *below;
+    const float *above;
+    int z_index;
+    StringBuilder *mesh;
+} ExportLayer;
+
+struct {
+    bool active;
+    bool cancelled;
+    double start_time;
+
+    // Owned by the main thread. Workers only read what was allocated here
+    // before their job was submitted.
+    Arena arena;
+
+    GLuint shader;
+    GLint z_loc;
+    GLuint texture;
+    GLuint frame_buffer;
+
+    BoundingBox bounds;
+    int slice_count_x;
+    int slice_count_y;
+    int slice_count_z;
+    float x_step;
+    float y_step;
+    float z_step;
+
+    float **slices;
+    ExportLayer *layers;
+    Job **layer_jobs;
+    // One heap builder per layer. Triangles use relative indices, so the
+    // layers can be written back to back in any order.
+    StringBuilder *meshes;
+
+    // Next slice to render, and the oldest layer job not yet released.
+    int next_slice;
+    int oldest_layer;
+    Job *write_job;
+} export_state;
+
+void export_layer_job(Job *job, void *data, Arena *arena) {
+    (void)arena;
+    TRACE_SCOPE("export layer");
+    const ExportLayer *layer = data;
+    const int slice_count_x = export_state.slice_count_x;
+    const int slice_count_y = export_state.slice_count_y;
+    const float x_step = export_state.x_step;
+    const float y_step = export_state.y_step;
+    const float z_step = export_state.z_step;
+    const BoundingBox bounds = export_state.bounds;
+    const int z_index = layer->z_index;
+
+    const float *pixels = layer->below;
+    const float *pixels2 = layer->above;
+
+    for (int y_index = 0; y_index < slice_count_y - 1; y_index++) {
+        if (job_cancelled(job)) return;
+
+        for (int x_index = 0; x_index < slice_count_x - 1; x_index++) {
+            float val0 = pixels[(x_index + y_index * slice_count_x)];
+            float val1 = pixels[(x_index + 1 + y_index * slice_count_x)];
+            float val2 = pixels[(x_index + 1 + (y_index + 1) * slice_count_x)];
+            float val3 = pixels[(x_index + (y_index + 1) * slice_count_x)];
+            float val4 = pixels2[(x_index + y_index * slice_count_x)];
+            float val5 = pixels2[(x_index + 1 + y_index * slice_count_x)];
+            float val6 = pixels2[(x_index + 1 + (y_index + 1) * slice_count_x)];
+            float val7 = pixels2[(x_index + (y_index + 1) * slice_count_x)];
+
+            int cubeindex = (val0 < SDF_THRESHOLD) << 0 |
+                            (val1 < SDF_THRESHOLD) << 1 |
+                            (val2 < SDF_THRESHOLD) << 2 |
+                            (val3 < SDF_THRESHOLD) << 3 |
+                            (val4 < SDF_THRESHOLD) << 4 |
+                            (val5 < SDF_THRESHOLD) << 5 |
+                            (val6 < SDF_THRESHOLD) << 6 |
+                            (val7 < SDF_THRESHOLD) << 7;
+
+            if (cubeindex == 0 || cubeindex == 255) {
+                continue;
+            }
+
+            Vector4 v0 = {
+                bounds.min.x + x_index * x_step,
+                bounds.min.y + y_index * y_step,
+                bounds.min.z + z_index * z_step,
+                val0
+            };
+            Vector4 v1 = {v0.x + x_step, v0.y, v0.z, val1};
+            Vector4 v2 = {v0.x + x_step, v0.y + y_step, v0.z, val2};
+            Vector4 v3 = {v0.x, v0.y + y_step, v0.z, val3};
+
+            Vector4 v4 = {v0.x, v0.y, v0.z + z_step, val4};
+            Vector4 v5 = {v0.x + x_step, v0.y, v0.z + z_step, val5};
+            Vector4 v6 = {v0.x + x_step, v0.y + y_step, v0.z + z_step, val6};
+            Vector4 v7 = {v0.x, v0.y + y_step, v0.z + z_step, val7};
+
+            process_cube(cubeindex, v0, v1, v2, v3, v4, v5, v6, v7, layer->mesh);
+        }
+    }
+}
+
+void export_write_job(Job *job, void *data, Arena *arena) {
+    (void)data;
+    (void)arena;
+    TRACE_SCOPE("export write");
+    const int layer_count = export_state.slice_count_z - 1;
+
+    FILE *file = fopen("output.obj", "wb");
+    if (!file) {
+        perror("Failed to open file for writing");
+        return;
+    }
+
+    for (int i = 0; i < layer_count && !job_cancelled(job); i++) {
+        fwrite(export_state.meshes[i].data, 1, export_state.meshes[i].size, file);
+        job_set_progress(job, (float)(i + 1) / layer_count);
+    }
+    fclose(file);
+}
+
 void export(void) {
+    if (export_state.active) return;
+    TRACE_SCOPE("export");
     const char *vshader = "your vertex shader code here";
     const char *shader_prefix_fs = "your shader prefix code here";
     const char *slicer_body_fs = "your slicer shader body code here";
 
-    char *shader_source = NULL;
-    append(&shader_source, SHADER_VERSION_PREFIX);
-    append(&shader_source, shader_prefix_fs);
-    append_map_function(&shader_source, false, -1);
-    append(&shader_source, slicer_body_fs);
-
-    GLuint slicer_shader = LoadShaderFromMemory(vshader, shader_source);
-    free(shader_source);
+    export_state.active = true;
+    export_state.cancelled = false;
+    export_state.start_time = glfwGetTime();
 
-    GLint slicer_z_loc = glGetUniformLocation(slicer_shader, "z");
+    char *map_function = NULL;
+    append_map_function(&map_function, false, -1);
 
-    double startTime = glfwGetTime();
-    const float cube_resolution = 0.03;
+    StringBuilder shader_source = { .arena = &frame_arena };
+    sb_append(&shader_source, SHADER_VERSION_PREFIX);
+    sb_append(&shader_source, shader_prefix_fs);
+    sb_append(&shader_source, map_function);
+    sb_append(&shader_source, slicer_body_fs);
+    free(map_function);
 
-    BoundingBox bounds = {
-        {FLT_MAX, FLT_MAX, FLT_MAX},
-        {-FLT_MAX, -FLT_MAX, -FLT_MAX}
-    };
+    export_state.shader = LoadShaderFromMemory(vshader, shader_source.data);
+    export_state.z_loc = glGetUniformLocation(export_state.shader, "z");
 
-    for (int i = 0; i < num_spheres; i++) {
-        const float radius = sqrtf(powf(spheres[i].size.x, 2) + powf(spheres[i].size.y, 2) + powf(spheres[i].size.z, 2));
-        bounds.min.x = fminf(bounds.min.x, spheres[i].pos.x - radius);
-        bounds.min.y = fminf(bounds.min.y, spheres[i].pos.y - radius);
-        bounds.min.z = fminf(bounds.min.z, spheres[i].pos.z - radius);
-
-        bounds.max.x = fmaxf(bounds.max.x, spheres[i].pos.x + radius);
-        bounds.max.y = fmaxf(bounds.max.y, spheres[i].pos.y + radius);
-        bounds.max.z = fmaxf(bounds.max.z, spheres[i].pos.z + radius);
-    }
+    const float cube_resolution = 0.03;
 
-    // Extend bounding box
-    bounds.min.x -= 1;
-    bounds.min.y -= 1;
-    bounds.min.z -= 1;
-    bounds.max.x += 1;
-    bounds.max.y += 1;
-    bounds.max.z += 1;
+    BoundingBox bounds;
+    scene_bounds(spheres, num_spheres, 1, &bounds.min, &bounds.max);
 
     const int slice_count_x = (int)((bounds.max.x - bounds.min.x) / cube_resolution + 1.5);
     const int slice_count_y = (int)((bounds.max.y - bounds.min.y) / cube_resolution + 1.5);
     const int slice_count_z = (int)((bounds.max.z - bounds.min.z) / cube_resolution + 1.5);
 
-    const float x_step = (bounds.max.x - bounds.min.x) / (slice_count_x - 1);
-    const float y_step = (bounds.max.y - bounds.min.y) / (slice_count_y - 1);
-    const float z_step = (bounds.max.z - bounds.min.z) / (slice_count_z - 1);
-
-    int data_capacity = 400000000;
-    char *data = malloc(data_capacity);
-    int data_size = 0;
-
-    GLuint sliceTexture[2];
-    glGenTextures(2, sliceTexture);
-    for (int i = 0; i < 2; i++) {
-        glBindTexture(GL_TEXTURE_2D, sliceTexture[i]);
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_R32F, slice_count_x, slice_count_y, 0, GL_RED, GL_FLOAT, NULL);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    export_state.bounds = bounds;
+    export_state.slice_count_x = slice_count_x;
+    export_state.slice_count_y = slice_count_y;
+    export_state.slice_count_z = slice_count_z;
+    export_state.x_step = (bounds.max.x - bounds.min.x) / (slice_count_x - 1);
+    export_state.y_step = (bounds.max.y - bounds.min.y) / (slice_count_y - 1);
+    export_state.z_step = (bounds.max.z - bounds.min.z) / (slice_count_z - 1);
+
+    export_state.slices = arena_alloc(&export_state.arena, slice_count_z * sizeof(float *));
+    export_state.layers = arena_alloc(&export_state.arena, slice_count_z * sizeof(ExportLayer));
+    export_state.layer_jobs = arena_alloc(&export_state.arena, slice_count_z * sizeof(Job *));
+    export_state.meshes = arena_alloc(&export_state.arena, slice_count_z * sizeof(StringBuilder));
+    memset(export_state.slices, 0, slice_count_z * sizeof(float *));
+    memset(export_state.meshes, 0, slice_count_z * sizeof(StringBuilder));
+    export_state.next_slice = 0;
+    export_state.oldest_layer = 0;
+
+    glGenTextures(1, &export_state.texture);
+    glBindTexture(GL_TEXTURE_2D, export_state.texture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_R32F, slice_count_x, slice_count_y, 0, GL_RED, GL_FLOAT, NULL);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+    glGenFramebuffers(1, &export_state.frame_buffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, export_state.frame_buffer);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, export_state.texture, 0);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    export_state.write_job = job_create(export_write_job, NULL, JOB_PRIORITY_LOW);
+}
+
+void export_render_slice(int z_index) {
+    TRACE_SCOPE("export slice");
+    const BoundingBox bounds = export_state.bounds;
+    const int slice_count_x = export_state.slice_count_x;
+    const int slice_count_y = export_state.slice_count_y;
+
+    float z = bounds.min.z + z_index * export_state.z_step;
+    glUseProgram(export_state.shader);
+    glUniform1f(export_state.z_loc, z);
+
+    glBindFramebuffer(GL_FRAMEBUFFER, export_state.frame_buffer);
+    glClear(GL_COLOR_BUFFER_BIT);
+
+    // Draw a full-screen quad
+    glBegin(GL_QUADS);
+    glTexCoord2f(bounds.max.x, bounds.min.y);
+    glVertex2f(0, 0);
+    glTexCoord2f(bounds.max.x, bounds.max.y);
+    glVertex2f(0, slice_count_y);
+    glTexCoord2f(bounds.min.x, bounds.max.y);
+    glVertex2f(slice_count_x, slice_count_y);
+    glTexCoord2f(bounds.min.x, bounds.min.y);
+    glVertex2f(slice_count_x, 0);
+    glEnd();
+
+    // Read pixels from the framebuffer
+    export_state.slices[z_index] = malloc(slice_count_x * slice_count_y * sizeof(float));
+    glReadPixels(0, 0, slice_count_x, slice_count_y, GL_RED, GL_FLOAT, export_state.slices[z_index]);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+void export_cancel(void) {
+    if (!export_state.active || export_state.cancelled) return;
+    export_state.cancelled = true;
+
+    for (int i = export_state.oldest_layer; i < export_state.next_slice - 1; i++) {
+        job_cancel(export_state.layer_jobs[i]);
     }
+    job_cancel(export_state.write_job);
 
-    GLuint frameBuffer;
-    glGenFramebuffers(1, &frameBuffer);
-
-    for (int z_index = 0; z_index < slice_count_z - 1; z_index++) {
-        for (int side = 0; side < 2; side++) {
-            float z = bounds.min.z + (z_index + side) * z_step;
-            glUseProgram(slicer_shader);
-            glUniform1f(slicer_z_loc, z);
-
-            glBindFramebuffer(GL_FRAMEBUFFER, frameBuffer);
-            glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, sliceTexture[side], 0);
-
-            glClear(GL_COLOR_BUFFER_BIT);
-
-            // Draw a full-screen quad
-            glBegin(GL_QUADS);
-            glTexCoord2f(bounds.max.x, bounds.min.y);
-            glVertex2f(0, 0);
-            glTexCoord2f(bounds.max.x, bounds.max.y);
-            glVertex2f(0, slice_count_y);
-            glTexCoord2f(bounds.min.x, bounds.max.y);
-            glVertex2f(slice_count_x, slice_count_y);
-            glTexCoord2f(bounds.min.x, bounds.min.y);
-            glVertex2f(slice_count_x, 0);
-            glEnd();
-
-            // Read pixels from the framebuffer
-            float *pixels = malloc(slice_count_x * slice_count_y * sizeof(float));
-            glReadPixels(0, 0, slice_count_x, slice_count_y, GL_RED, GL_FLOAT, pixels);
-
-            // Process pixels
-            float *pixels2 = malloc(slice_count_x * slice_count_y * sizeof(float));
-            glReadPixels(0, 0, slice_count_x, slice_count_y, GL_RED, GL_FLOAT, pixels2);
-
-            #define SDF_THRESHOLD (0)
-            for (int y_index = 0; y_index < slice_count_y - 1; y_index++) {
-                for (int x_index = 0; x_index < slice_count_x - 1; x_index++) {
-                    float val0 = pixels[(x_index + y_index * slice_count_x)];
-                    float val1 = pixels[(x_index + 1 + y_index * slice_count_x)];
-                    float val2 = pixels[(x_index + 1 + (y_index + 1) * slice_count_x)];
-                    float val3 = pixels[(x_index + (y_index + 1) * slice_count_x)];
-                    float val4 = pixels2[(x_index + y_index * slice_count_x)];
-                    float val5 = pixels2[(x_index + 1 + y_index * slice_count_x)];
-                    float val6 = pixels2[(x_index + 1 + (y_index + 1) * slice_count_x)];
-                    float val7 = pixels2[(x_index + (y_index + 1) * slice_count_x)];
-
-                    Vector4 v0 = {
-                        bounds.min.x + x_index * x_step,
-                        bounds.min.y + y_index * y_step,
-                        bounds.min.z + z_index * z_step,
-                        val0
-                    };
-                    Vector4 v1 = {v0.x + x_step, v0.y, v0.z, val1};
-                    Vector4 v2 = {v0.x + x_step, v0.y + y_step, v0.z, val2};
-                    Vector4 v3 = {v0.x, v0.y + y_step, v0.z, val3};
-
-                    Vector4 v4 = {v0.x, v0.y, v0.z + z_step, val4};
-                    Vector4 v5 = {v0.x + x_step, v0.y, v0.z + z_step, val5};
-                    Vector4 v6 = {v0.x + x_step, v0.y + y_step, v0.z + z_step, val6};
-                    Vector4 v7 = {v0.x, v0.y + y_step, v0.z + z_step, val7};
-
-                    int cubeindex = (val0 < SDF_THRESHOLD) << 0 |
-                                    (val1 < SDF_THRESHOLD) << 1 |
-                                    (val2 < SDF_THRESHOLD) << 2 |
-                                    (val3 < SDF_THRESHOLD) << 3 |
-                                    (val4 < SDF_THRESHOLD) << 4 |
-                                    (val5 < SDF_THRESHOLD) << 5 |
-                                    (val6 < SDF_THRESHOLD) << 6 |
-                                    (val7 < SDF_THRESHOLD) << 7;
-
-                    if (cubeindex == 0 || cubeindex == 255) {
-                        continue;
-                    }
+    // The write job still has to finish, as a no-op, before cleaning up.
+    if (export_state.next_slice < export_state.slice_count_z) {
+        job_submit(export_state.write_job);
+    }
+}
 
-                    char *mesh = NULL;
-                    int mesh_size = 0;
-
-                    process_cube(cubeindex, v0, v1, v2, v3, v4, v5, v6, v7, &mesh, &mesh_size);
-                    if (mesh_size > 0) {
-                        if (data_size + mesh_size > data_capacity) {
-                            data_capacity *= 2;
-                            data = realloc(data, data_capacity);
-                        }
-                        memcpy(data + data_size, mesh, mesh_size);
-                        data_size += mesh_size;
-                        free(mesh);
-                    }
-                }
-            }
+float export_progress(void) {
+    if (!export_state.active) return 0;
+    return (export_state.oldest_layer + job_progress(export_state.write_job)) / export_state.slice_count_z;
+}
+
+// Called once per frame, before drawing.
+void export_update(void) {
+    if (!export_state.active) return;
+    TRACE_SCOPE("export update");
+
+    // A finished layer frees its lower slice. The layer below it, the only
+    // other reader, was released before it.
+    while (export_state.oldest_layer < export_state.next_slice - 1 &&
+           job_finished(export_state.layer_jobs[export_state.oldest_layer])) {
+        const int z_index = export_state.oldest_layer++;
+        job_release(export_state.layer_jobs[z_index]);
+        free(export_state.slices[z_index]);
+        export_state.slices[z_index] = NULL;
+    }
 
-            free(pixels);
-            free(pixels2);
+    const double start = glfwGetTime();
+    while (!export_state.cancelled &&
+           export_state.next_slice < export_state.slice_count_z &&
+           export_state.next_slice - export_state.oldest_layer < EXPORT_MAX_PENDING_SLICES &&
+           glfwGetTime() - start < EXPORT_FRAME_BUDGET) {
+        const int z_index = export_state.next_slice++;
+        export_render_slice(z_index);
+        if (z_index == 0) continue;
+
+        ExportLayer *layer = &export_state.layers[z_index - 1];
+        *layer = (ExportLayer){
+            .below = export_state.slices[z_index - 1],
+            .above = export_state.slices[z_index],
+            .z_index = z_index - 1,
+            .mesh = &export_state.meshes[z_index - 1],
+        };
+
+        Job *job = job_create(export_layer_job, layer, JOB_PRIORITY_NORMAL);
+        job_depends_on(export_state.write_job, job);
+        job_submit(job);
+        export_state.layer_jobs[z_index - 1] = job;
+
+        if (export_state.next_slice == export_state.slice_count_z) {
+            job_submit(export_state.write_job);
         }
     }
 
-    // Save the data to a file
-    FILE *file = fopen("output.obj", "wb");
-    if (file) {
-        fwrite(data, 1, data_size, file);
-        fclose(file);
-    } else {
-        perror("Failed to open file for writing");
+    if (!job_finished(export_state.write_job)) return;
+
+    if (!export_state.cancelled) {
+        printf("Exported output.obj in %.2fs\n", glfwGetTime() - export_state.start_time);
+    }
+
+    // Every layer job is finished once the write job is.
+    for (int i = export_state.oldest_layer; i < export_state.next_slice - 1; i++) {
+        job_release(export_state.layer_jobs[i]);
     }
+    for (int i = 0; i < export_state.slice_count_z; i++) {
+        free(export_state.slices[i]);
+        free(export_state.meshes[i].data);
+    }
+    job_release(export_state.write_job);
 
-    // Clean up
-    glDeleteTextures(2, sliceTexture);
-    glDeleteFramebuffers(1, &frameBuffer);
-    glDeleteProgram(slicer_shader);
-    free(data);
+    glDeleteTextures(1, &export_state.texture);
+    glDeleteFramebuffers(1, &export_state.frame_buffer);
+    glDeleteProgram(export_state.shader);
+    arena_reset(&export_state.arena);
+    export_state.active = false;
 }
 
 int object_at_pixel(GLFWwindow *window, int x, int y) {
+    TRACE_SCOPE("object_at_pixel");
     double start = glfwGetTime();
-    char *shader_source = NULL;
-    append(&shader_source, SHADER_VERSION_PREFIX);
-    append(&shader_source, shader_prefix_fs);
-    append_map_function(&shader_source, true, -1);
-    append(&shader_source, selection_fs);
+    char *map_function = NULL;
+    append_map_function(&map_function, true, -1);
 
-    GLuint shader = LoadShaderFromMemory(vshader, shader_source);
-    free(shader_source);
+    StringBuilder shader_source = { .arena = &frame_arena };
+    sb_append(&shader_source, SHADER_VERSION_PREFIX);
+    sb_append(&shader_source, shader_prefix_fs);
+    sb_append(&shader_source, map_function);
+    sb_append(&shader_source, selection_fs);
+    free(map_function);
+
+    GLuint shader = LoadShaderFromMemory(vshader, shader_source.data);
 
     GLint eye_loc = glGetUniformLocation(shader, "viewEye");
     GLint center_loc = glGetUniformLocation(shader, "viewCenter");
@@ -928,12 +1638,11 @@ int object_at_pixel(GLFWwindow *window, int x, int y) {
 
     glReadBuffer(GL_COLOR_ATTACHMENT0);
 
-    uint8_t *pixels = malloc(4 * (glfwGetFramebufferWidth(window) * glfwGetFramebufferHeight(window)));
-    glReadPixels(x, glfwGetFramebufferHeight(window) - y, 1, 1, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+    uint8_t pixel[4];
+    glReadPixels(x, glfwGetFramebufferHeight(window) - y, 1, 1, GL_RGBA, GL_UNSIGNED_BYTE, pixel);
 
-    int object_index = ((int)pixels[0]) - 1;
+    int object_index = ((int)pixel[0]) - 1;
 
-    free(pixels);
     glDeleteFramebuffers(1, &framebuffer);
     glDeleteTextures(1, &texture);
     glDeleteProgram(shader);
@@ -961,6 +1670,162 @@ void render_microui(GLFWwindow *window) {
     microui_render(mui);
 }
 
+// On-demand redraw. A frame is only drawn when something it shows has
+// changed since the last one; otherwise the previous frame stays on screen
+// and the loop sleeps in glfwWaitEventsTimeout until an event arrives or
+// timed work (autosave, gamepad polling) is due. raylib owns the GLFW
+// callbacks, so these note that input arrived and pass it on.
+#define REDRAW_SETTLE_FRAMES 2
+#define REDRAW_GAMEPAD_POLL (1.0/60)
+// Longest step runTime takes in one frame. raylib's frame time after an
+// idle wait spans the whole wait.
+#define REDRAW_MAX_STEP 0.1f
+
+bool redraw_on_demand = true;
+bool input_seen = true;
+
+// Everything a drawn frame depends on besides input, compared byte for byte.
+typedef struct {
+    struct {
+        Camera camera;
+        int num_spheres;
+        Sphere spheres[MAX_SPHERES];
+        int selected_sphere;
+        int visuals_mode;
+        int width, height;
+    } view;
+    Control focused_control;
+    Control mouse_action;
+} FrameKey;
+
+FrameKey last_frame_key;
+
+GLFWkeyfun raylib_key_callback;
+GLFWcharfun raylib_char_callback;
+GLFWmousebuttonfun raylib_mouse_button_callback;
+GLFWcursorposfun raylib_cursor_pos_callback;
+GLFWscrollfun raylib_scroll_callback;
+GLFWcursorenterfun raylib_cursor_enter_callback;
+GLFWwindowsizefun raylib_window_size_callback;
+GLFWwindowfocusfun raylib_window_focus_callback;
+GLFWdropfun raylib_drop_callback;
+
+void wake_key(GLFWwindow *window, int key, int scancode, int action, int mods) {
+    input_seen = true;
+    if (raylib_key_callback) raylib_key_callback(window, key, scancode, action, mods);
+}
+
+void wake_char(GLFWwindow *window, unsigned int codepoint) {
+    input_seen = true;
+    if (raylib_char_callback) raylib_char_callback(window, codepoint);
+}
+
+void wake_mouse_button(GLFWwindow *window, int button, int action, int mods) {
+    input_seen = true;
+    if (raylib_mouse_button_callback) raylib_mouse_button_callback(window, button, action, mods);
+}
+
+void wake_cursor_pos(GLFWwindow *window, double x, double y) {
+    input_seen = true;
+    if (raylib_cursor_pos_callback) raylib_cursor_pos_callback(window, x, y);
+}
+
+void wake_scroll(GLFWwindow *window, double x, double y) {
+    input_seen = true;
+    if (raylib_scroll_callback) raylib_scroll_callback(window, x, y);
+}
+
+void wake_cursor_enter(GLFWwindow *window, int entered) {
+    input_seen = true;
+    if (raylib_cursor_enter_callback) raylib_cursor_enter_callback(window, entered);
+}
+
+void wake_window_size(GLFWwindow *window, int width, int height) {
+    input_seen = true;
+    if (raylib_window_size_callback) raylib_window_size_callback(window, width, height);
+}
+
+void wake_window_focus(GLFWwindow *window, int focused) {
+    input_seen = true;
+    if (raylib_window_focus_callback) raylib_window_focus_callback(window, focused);
+}
+
+void wake_drop(GLFWwindow *window, int count, const char **paths) {
+    input_seen = true;
+    if (raylib_drop_callback) raylib_drop_callback(window, count, paths);
+}
+
+// Exposed or damaged without a resize: the last frame has to be drawn again.
+void wake_refresh(GLFWwindow *window) {
+    (void)window;
+    input_seen = true;
+}
+
+void redraw_init(void) {
+    GLFWwindow *window = GetWindowHandle();
+    raylib_key_callback = glfwSetKeyCallback(window, wake_key);
+    raylib_char_callback = glfwSetCharCallback(window, wake_char);
+    raylib_mouse_button_callback = glfwSetMouseButtonCallback(window, wake_mouse_button);
+    raylib_cursor_pos_callback = glfwSetCursorPosCallback(window, wake_cursor_pos);
+    raylib_scroll_callback = glfwSetScrollCallback(window, wake_scroll);
+    raylib_cursor_enter_callback = glfwSetCursorEnterCallback(window, wake_cursor_enter);
+    raylib_window_size_callback = glfwSetWindowSizeCallback(window, wake_window_size);
+    raylib_window_focus_callback = glfwSetWindowFocusCallback(window, wake_window_focus);
+    raylib_drop_callback = glfwSetDropCallback(window, wake_drop);
+    glfwSetWindowRefreshCallback(window, wake_refresh);
+}
+
+// Called once input for the frame has been applied. Some state only changes
+// while the GUI draws, and the cost counters are read back a frame late, so
+// a few frames are drawn after the last change before going idle.
+bool redraw_needed(void) {
+    static int settle_frames = REDRAW_SETTLE_FRAMES;
+
+    FrameKey key;
+    memset(&key, 0, sizeof(key));
+    key.view.camera = camera;
+    key.view.num_spheres = num_spheres;
+    memcpy(key.view.spheres, spheres, sizeof(Sphere) * num_spheres);
+    key.view.selected_sphere = selected_sphere;
+    key.view.visuals_mode = visuals_mode;
+    key.view.width = GetScreenWidth();
+    key.view.height = GetScreenHeight();
+    key.focused_control = focusedControl;
+    key.mouse_action = mouseAction;
+    view_changed = needs_rebuild || lighting.changed || memcmp(&key.view, &last_frame_key.view, sizeof(key.view));
+    lighting.changed = false;
+
+    // The SDF visualizer animates with runTime, the overlay graphs frame
+    // times, the export progress bar moves every frame and the viewport
+    // keeps refining a still view until its samples are in.
+    const bool animating = visuals_mode == VISUALS_SDF || perf.visible || export_state.active ||
+                           !viewport_converged();
+
+    if (!redraw_on_demand || animating || input_seen || view_changed ||
+        memcmp(&key, &last_frame_key, sizeof(key))) {
+        settle_frames = REDRAW_SETTLE_FRAMES;
+    }
+    input_seen = false;
+    last_frame_key = key;
+
+    if (settle_frames == 0) return false;
+    settle_frames--;
+    return true;
+}
+
+// Sleeps until the next event, the next autosave, or the next poll of what
+// doesn't send events: gamepads and a running lighting bake.
+void redraw_wait(void) {
+    double timeout = fmax(0, AUTOSAVE_INTERVAL - (GetTime() - lastSave));
+    if (IsGamepadAvailable(0)) timeout = fmin(timeout, REDRAW_GAMEPAD_POLL);
+    if (light_baking(&lighting.cache)) timeout = fmin(timeout, REDRAW_GAMEPAD_POLL);
+
+    // Advances raylib's previous/current input state the way EndDrawing
+    // would, so presses that arrive during the wait are seen next frame.
+    PollInputEvents();
+    if (!input_seen) glfwWaitEventsTimeout(timeout);
+}
+
 int main(void) {
     // Initialize GLFW
     if (!glfwInit()) {
@@ -993,12 +1858,52 @@ int main(void) {
     SetConfigFlags(FLAG_WINDOW_RESIZABLE);
     InitWindow(1940/2, 1100/2, "ShapeUp!");
     SetExitKey(0);
+    job_system_init();
+    redraw_init();
 
     const int gamepad = 0;
 
     bool ui_mode_gamepad = false;
+    // Set while the frame being drawn is the first after an idle wait
+    bool resumed = false;
+
+    TRACE_THREAD_NAME("main");
 
     while (!WindowShouldClose()) {
+        TRACE_BEGIN(frame_trace, "frame");
+        TRACE_BEGIN(input_trace, "input");
+        arena_reset(&frame_arena);
+
+        // Before perf_begin_frame, so the overlay's passes are timed from
+        // the frame it appears on
+        if (IsKeyPressed(KEY_F3)) {
+            perf.visible = !perf.visible;
+        }
+
+        perf_cpu_begin(PERF_CPU_INPUT);
+
+        if (IsKeyPressed(KEY_F4)) {
+            TRACE_DUMP("build/trace.json");
+        }
+
+        if (IsKeyPressed(KEY_F5)) {
+            redraw_on_demand = !redraw_on_demand;
+        }
+
+        if (IsKeyPressed(KEY_F6)) {
+            governor.target = (governor.target + 1) % GOVERNOR_TARGET_COUNT;
+        }
+
+        if (IsFileDropped()) {
+            FilePathList dropped = LoadDroppedFiles();
+            if (dropped.count > 0) openSnapshot(dropped.paths[0]);
+            UnloadDroppedFiles(dropped);
+        }
+        apply_snapshot();
+
+        if (GetTime() - lastSave > AUTOSAVE_INTERVAL) {
+            save("autosave");
+        }
 
         if (fabsf(GetGamepadAxisMovement(gamepad, GAMEPAD_AXIS_RIGHT_X)) > 0 || 
             fabsf(GetGamepadAxisMovement(gamepad, GAMEPAD_AXIS_RIGHT_Y)) > 0 ||
@@ -1141,20 +2046,46 @@ int main(void) {
     if (IsMouseButtonReleased(MOUSE_BUTTON_LEFT)) {
         mouseAction = CONTROL_NONE;
     }
+        perf_cpu_end(PERF_CPU_INPUT);
+        TRACE_END(input_trace);
+
+        lighting_update();
+        if (!redraw_needed()) {
+            TRACE_END(frame_trace);
+            redraw_wait();
+            resumed = true;
+            continue;
+        }
 
+        // Only for frames that are drawn, so a skipped one doesn't collect
+        // the query results of a slot the next drawn frame is waiting on
+        perf_begin_frame();
 
-        float deltaTime = GetFrameTime();
+        // Clamped, so the frames around an idle wait don't jump the SDF
+        // visualizer's animation forward
+        float deltaTime = fminf(GetFrameTime(), REDRAW_MAX_STEP);
         runTime += deltaTime;
 
         if ( needs_rebuild ) {
+            perf_cpu_begin(PERF_CPU_REBUILD);
             rebuild_shaders();
+            perf_cpu_end(PERF_CPU_REBUILD);
         }
-        SetShaderValue(main_shader, main_locations.viewEye, &camera.position, SHADER_UNIFORM_VEC3);
-        SetShaderValue(main_shader, main_locations.viewCenter, &camera.target, SHADER_UNIFORM_VEC3);
-        SetShaderValue(main_shader, main_locations.resolution, (float[2]){ (float)GetScreenWidth()*GetWindowScaleDPI().x, (float)GetScreenHeight()*GetWindowScaleDPI().y }, SHADER_UNIFORM_VEC2);
-        SetShaderValue(main_shader, main_locations.runTime, &runTime, SHADER_UNIFORM_FLOAT);
+        export_update();
+        bricks_update();
+        bricks_bind();
+        lighting_bind();
+        SetShaderValue(march_shader, march_locations->viewEye, &camera.position, SHADER_UNIFORM_VEC3);
+        SetShaderValue(march_shader, march_locations->viewCenter, &camera.target, SHADER_UNIFORM_VEC3);
+        SetShaderValue(march_shader, march_locations->resolution, (float[2]){ (float)GetScreenWidth()*GetWindowScaleDPI().x, (float)GetScreenHeight()*GetWindowScaleDPI().y }, SHADER_UNIFORM_VEC2);
+        SetShaderValue(march_shader, march_locations->runTime, &runTime, SHADER_UNIFORM_FLOAT);
         float mode = visuals_mode;
-        SetShaderValue(main_shader, main_locations.visualizer, &mode, SHADER_UNIFORM_FLOAT);
+        SetShaderValue(march_shader, march_locations->visualizer, &mode, SHADER_UNIFORM_FLOAT);
+        float shape_count = num_spheres;
+        SetShaderValue(march_shader, march_locations->shapeCount, &shape_count, SHADER_UNIFORM_FLOAT);
+        if (visuals_mode >= VISUALS_MARCH_STEPS) {
+            bind_cost_counters(perf.frame);
+        }
         if (selected_sphere >= 0) {
             Sphere *s = &spheres[selected_sphere];
             float used_radius = fmaxf(0.01,fminf(s->corner_radius, fminf(s->size.x,fminf(s->size.y, s->size.z))));
@@ -1180,17 +2111,17 @@ int main(void) {
                 0,
             };
 
-            SetShaderValueV(main_shader, main_locations.selectedParams, data, SHADER_UNIFORM_VEC3, 5);
+            SetShaderValueV(march_shader, march_locations->selectedParams, data, SHADER_UNIFORM_VEC3, 5);
             
         }
 
+        TRACE_BEGIN(draw_trace, "draw");
         BeginDrawing(); {
             
             ClearBackground(RAYWHITE);
-            BeginShaderMode(main_shader); {
-                DrawRectangle(sidebar_width, 0, GetScreenWidth()-sidebar_width, GetScreenHeight(), WHITE);
-            } EndShaderMode();
+            viewport_draw();
 
+            perf_gpu_begin(PERF_PASS_GIZMOS);
             BeginMode3D(camera); {
                 if (selected_sphere >= 0 && selected_sphere < MAX_SPHERES) {
                     Sphere s = spheres[selected_sphere];
@@ -1228,7 +2159,9 @@ int main(void) {
                     }
                 }
             } EndMode3D();
+            perf_gpu_end(PERF_PASS_GIZMOS);
 
+            perf_gpu_begin(PERF_PASS_GUI);
             if (ui_mode_gamepad) {
                 DrawCircle(sidebar_width + (GetScreenWidth()-sidebar_width)/2, GetScreenHeight()/2, 5, WHITE);
             }
@@ -1238,7 +2171,16 @@ int main(void) {
 
             int y = 20;
 
-            GuiCheckBox((Rectangle){ 20, y+0.5, 20, 20 }, "Show Field", (bool *)&visuals_mode);
+            GuiComboBox((Rectangle){ 20, y+0.5, 170, 20 }, "Shaded;Show Field;March Steps;Shape Evals", (int *)&visuals_mode);
+            y+=30;
+
+            if (export_state.active) {
+                float progress = export_progress();
+                GuiProgressBar((Rectangle){ 20, y, 110, 20 }, NULL, NULL, &progress, 0, 1);
+                if (GuiButton((Rectangle){ 140, y, 50, 20 }, "Cancel")) export_cancel();
+            } else if (GuiButton((Rectangle){ 20, y, 170, 20 }, "Export OBJ")) {
+                export();
+            }
             y+=30;
 
             if (selected_sphere >= 0 ){
@@ -1404,7 +2346,20 @@ int main(void) {
                 DrawText("Pan: Alt+Drag", sidebar_width + 8, 11, 10, WHITE);
             } 
 
+            if (visuals_mode >= VISUALS_MARCH_STEPS) {
+                const double pixels = (GetScreenWidth()-sidebar_width)*GetWindowScaleDPI().x * GetScreenHeight()*GetWindowScaleDPI().y;
+                DrawText(TextFormat("March: %.1f/px    Shape evals: %.1f/px",
+                                    cost_totals.march_steps * cost_march_unit / pixels,
+                                    cost_totals.shape_evals * cost_eval_unit / pixels), sidebar_width + 8, 25, 10, WHITE);
+            }
+            perf_gpu_end(PERF_PASS_GUI);
+
+            draw_perf_overlay();
         } EndDrawing();
+        TRACE_END(draw_trace);
+        perf_end_frame(resumed);
+        resumed = false;
+        TRACE_END(frame_trace);
 
     // Create a windowed mode window and its OpenGL context
     GLFWwindow *window = glfwCreateWindow(640, 480, "GLFW Window", NULL, NULL);
@@ -1434,6 +2389,7 @@ int main(void) {
     // Cleanup
     glfwDestroyWindow(window);
     glfwTerminate();
+    job_system_shutdown();
 
     return 0;
 }
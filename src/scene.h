@@ -0,0 +1,194 @@
+// Shapes, .ocad snapshot files and a CPU version of the scene's distance
+// function, shared by the editor and the thumbnail tool.
+//
+// A snapshot is an int count followed by that many Sphere structs as they sit
+// in memory, so files only load into a build with the same struct layout.
+//
+// scene_sample mirrors the GLSL map function built from shader_prefix.fs:
+// each shape is mirrored, moved and rotated into its own frame, measured
+// as a RoundBox, then folded into the running result in order. Corners are
+// rounded the way the editor uploads the selected shape: the radius is
+// clamped to the smallest side and taken off the box, so the shape never
+// grows past its size. Subtracting
+// shapes are cut out with opSmoothSubtraction (opS with no blend), the others
+// join with BlobbyMin (Min with no blend).
+
+#ifndef SCENE_H
+#define SCENE_H
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+typedef struct {
+    float x, y, z;
+} Vector3;
+
+typedef struct {
+    Vector3 pos;
+    Vector3 size;
+    Vector3 angle;
+    float corner_radius;
+    float blob_amount;
+    struct {
+        uint8_t r, g, b;
+    } color;
+    struct {
+        bool x, y, z;
+    } mirror;
+    bool subtract;
+} Sphere;
+
+#define MAX_SPHERES 100
+
+// Validates the size against the count before reading any shapes. Returns
+// false and leaves *count alone if the file is not a snapshot.
+static inline bool snapshot_read(const char *path, Sphere *spheres, int *count) {
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        perror("Failed to open file");
+        return false;
+    }
+
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    int n = 0;
+    bool ok = size >= (long)sizeof(int) && fread(&n, sizeof(int), 1, file) == 1 &&
+              n > 0 && n <= MAX_SPHERES && size == (long)(sizeof(int) + sizeof(Sphere) * n) &&
+              fread(spheres, sizeof(Sphere), n, file) == (size_t)n;
+    fclose(file);
+
+    if (!ok) {
+        fprintf(stderr, "Not a valid snapshot: %s\n", path);
+        return false;
+    }
+    *count = n;
+    return true;
+}
+
+// Box around every shape and its mirror images, padded like the mesh export
+// so the surface never touches the sides.
+static inline void scene_bounds(const Sphere *spheres, int count, float padding, Vector3 *min, Vector3 *max) {
+    *min = (Vector3){ INFINITY, INFINITY, INFINITY };
+    *max = (Vector3){ -INFINITY, -INFINITY, -INFINITY };
+    for (int i = 0; i < count; i++) {
+        const Sphere *s = &spheres[i];
+        const float radius = sqrtf(s->size.x * s->size.x + s->size.y * s->size.y + s->size.z * s->size.z);
+        min->x = fminf(min->x, (s->mirror.x ? -fabsf(s->pos.x) : s->pos.x) - radius);
+        min->y = fminf(min->y, (s->mirror.y ? -fabsf(s->pos.y) : s->pos.y) - radius);
+        min->z = fminf(min->z, (s->mirror.z ? -fabsf(s->pos.z) : s->pos.z) - radius);
+        max->x = fmaxf(max->x, (s->mirror.x ? fabsf(s->pos.x) : s->pos.x) + radius);
+        max->y = fmaxf(max->y, (s->mirror.y ? fabsf(s->pos.y) : s->pos.y) + radius);
+        max->z = fmaxf(max->z, (s->mirror.z ? fabsf(s->pos.z) : s->pos.z) + radius);
+    }
+    min->x -= padding;
+    min->y -= padding;
+    min->z -= padding;
+    max->x += padding;
+    max->y += padding;
+    max->z += padding;
+}
+
+// Bounds of one shape, grown by how far a blend can pull the surface out.
+static inline void scene_shape_bounds(const Sphere *s, Vector3 *min, Vector3 *max) {
+    scene_bounds(s, 1, fmaxf(s->blob_amount, 0) * 0.25f, min, max);
+}
+
+static inline void scene_grow(Vector3 *min, Vector3 *max, Vector3 other_min, Vector3 other_max) {
+    *min = (Vector3){ fminf(min->x, other_min.x), fminf(min->y, other_min.y), fminf(min->z, other_min.z) };
+    *max = (Vector3){ fmaxf(max->x, other_max.x), fmaxf(max->y, other_max.y), fmaxf(max->z, other_max.z) };
+}
+
+// A shape with its rotation and rounding worked out once instead of per
+// sample.
+typedef struct {
+    Sphere sphere;
+    float rotation[3][3];
+    Vector3 box;
+    float radius;
+    Vector3 color;
+} SceneShape;
+
+typedef struct {
+    float distance;
+    Vector3 color;
+} SceneSample;
+
+// Rows of opRotateXYZ's matrix (the GLSL one is written column by column).
+static inline void scene_prepare(const Sphere *spheres, int count, SceneShape *shapes) {
+    for (int i = 0; i < count; i++) {
+        const Sphere *s = &spheres[i];
+        const float cz = cosf(s->angle.z), sz = sinf(s->angle.z);
+        const float cy = cosf(s->angle.y), sy = sinf(s->angle.y);
+        const float cx = cosf(s->angle.x), sx = sinf(s->angle.x);
+        const float radius = fmaxf(0.01f, fminf(s->corner_radius, fminf(s->size.x, fminf(s->size.y, s->size.z))));
+        shapes[i] = (SceneShape){
+            .sphere = *s,
+            .rotation = {
+                { cz * cy, cy * sz, -sy },
+                { cz * sy * sx - cx * sz, cz * cx + sz * sy * sx, cy * sx },
+                { sz * sx + cz * cx * sy, cx * sz * sy - cz * sx, cy * cx },
+            },
+            .box = { s->size.x - radius, s->size.y - radius, s->size.z - radius },
+            .radius = radius,
+            .color = { s->color.r / 255.0f, s->color.g / 255.0f, s->color.b / 255.0f },
+        };
+    }
+}
+
+static inline float scene_round_box(Vector3 p, Vector3 b, float r) {
+    const float qx = fabsf(p.x) - b.x, qy = fabsf(p.y) - b.y, qz = fabsf(p.z) - b.z;
+    const float ox = fmaxf(qx, 0), oy = fmaxf(qy, 0), oz = fmaxf(qz, 0);
+    return sqrtf(ox * ox + oy * oy + oz * oz) + fminf(fmaxf(qx, fmaxf(qy, qz)), 0) - r;
+}
+
+static inline Vector3 scene_mix(Vector3 a, Vector3 b, float t) {
+    return (Vector3){ a.x + (b.x - a.x) * t, a.y + (b.y - a.y) * t, a.z + (b.z - a.z) * t };
+}
+
+// BlobbyMin, which is Min when blend is 0.
+static inline SceneSample scene_blobby_min(SceneSample a, SceneSample b, float blend) {
+    if (blend <= 0) return a.distance < b.distance ? a : b;
+    const float h = fmaxf(blend - fabsf(a.distance - b.distance), 0) / blend;
+    const float m = h * h * 0.5f;
+    const float s = m * blend * 0.5f;
+    return a.distance < b.distance ? (SceneSample){ a.distance - s, scene_mix(a.color, b.color, m) }
+                                   : (SceneSample){ b.distance - s, scene_mix(a.color, b.color, 1 - m) };
+}
+
+// Cuts b out of a and keeps a's color: opSmoothSubtraction(b, a), which is
+// opS(a, b) when blend is 0.
+static inline SceneSample scene_subtract(SceneSample a, SceneSample b, float blend) {
+    if (blend <= 0) return (SceneSample){ fmaxf(-b.distance, a.distance), a.color };
+    const SceneSample cut = scene_blobby_min(b, (SceneSample){ -a.distance, a.color }, blend);
+    return (SceneSample){ -cut.distance, a.color };
+}
+
+// Folds one shape into the result of the shapes before it.
+static inline SceneSample scene_fold(SceneSample result, const SceneShape *shape, Vector3 p) {
+    const Sphere *s = &shape->sphere;
+    const Vector3 m = {
+        (s->mirror.x ? fabsf(p.x) : p.x) - s->pos.x,
+        (s->mirror.y ? fabsf(p.y) : p.y) - s->pos.y,
+        (s->mirror.z ? fabsf(p.z) : p.z) - s->pos.z,
+    };
+    const Vector3 q = {
+        shape->rotation[0][0] * m.x + shape->rotation[0][1] * m.y + shape->rotation[0][2] * m.z,
+        shape->rotation[1][0] * m.x + shape->rotation[1][1] * m.y + shape->rotation[1][2] * m.z,
+        shape->rotation[2][0] * m.x + shape->rotation[2][1] * m.y + shape->rotation[2][2] * m.z,
+    };
+    const SceneSample sample = { scene_round_box(q, shape->box, shape->radius), shape->color };
+    return s->subtract ? scene_subtract(result, sample, s->blob_amount)
+                       : scene_blobby_min(result, sample, s->blob_amount);
+}
+
+static inline SceneSample scene_sample(const SceneShape *shapes, int count, Vector3 p) {
+    SceneSample result = { INFINITY, { 0, 0, 0 } };
+    for (int i = 0; i < count; i++) result = scene_fold(result, &shapes[i], p);
+    return result;
+}
+
+#endif
@@ -1,45 +1,112 @@
-vec4 castRay( in vec3 ro, in vec3 rd )
+// Cost counters for the step-count visualizers
+int march_steps = 0;
+int sdf_evaluations = 0;
+
+#ifdef GL_ARB_shader_atomic_counters
+layout(binding = 0, offset = 0) uniform atomic_uint marchStepTotal;
+layout(binding = 0, offset = 4) uniform atomic_uint shapeEvalTotal;
+#endif
+
+// Quality limits, lowered by the governor in main.c while the view moves.
+// Fast shading skips the cached lighting and takes normals from three taps.
+uniform int marchSteps;
+uniform float marchFar;
+uniform bool fastShading;
+
+// Field value at the t castRay returned
+float hit_distance = 0.0;
+
+vec4 counted_sdf( in vec3 p )
 {
-    float tmin = 0.1;
-    float tmax = 300.0;
+    sdf_evaluations++;
+    return signed_distance_field( p );
+}
+
+// Steps are stretched by this much until two neighbouring spheres stop
+// overlapping, then the march backs up and continues with plain steps
+// (over-relaxed sphere tracing, Keinert et al. 2014)
+#define MARCH_RELAXATION 1.2
 
+vec4 castRay( in vec3 ro, in vec3 rd, in float tmin )
+{
+    float tmax = marchFar;
+
+    float omega = MARCH_RELAXATION;
     float t = tmin;
+    float step = 0.0;
+    float previous = 0.0;
+    bool converged = false;
     vec3 m = vec3(-1);
-    for( int i=0; i<64; i++ )
+    for( int i=0; i<marchSteps; i++ )
     {
+        march_steps++;
         float precis = 0.0001*t;
-        vec4 res = signed_distance_field( ro+rd*t );
-        if( res.x<precis || t>tmax ) break;
-        t += res.x;
-        m = res.gba;
+        vec4 res = counted_sdf( ro+rd*t );
+        hit_distance = res.x;
+        bool overshot = omega>1.0 && res.x+previous<step;
+        if( overshot )
+        {
+            step -= omega*step;
+            omega = 1.0;
+        }
+        else
+        {
+            // Before the test, a ray started on the surface by the cone
+            // pre-pass converges on its first sample
+            m = res.gba;
+            if( res.x<precis ) { converged = true; break; }
+            step = res.x*omega;
+        }
+        previous = res.x;
+        if( t>tmax ) break;
+        t += step;
     }
 
     if( t>tmax ) m=vec3(-1);
+    // Out of steps, t has moved past the last sample
+    else if( !converged ) hit_distance = counted_sdf( ro+rd*t ).x;
     return vec4( t, m );
 }
 
+// Cone pre-pass. Each texel of it covers a CONE_TILE square of the march
+// target, and gets the distance every ray through that square can skip: the
+// tile's center ray is marched with a cone wide enough to hold the others,
+// stopping where the cone first touches a surface.
+#define CONE_TILE 8
 
-float calcSoftshadow( in vec3 ro, in vec3 rd, in float mint, in float tmax )
+float coneStart( in vec3 ro, in mat3 camera_to_world, in vec2 lo, in vec2 hi )
 {
-    float res = 1.0;
-    float t = mint;
-    for( int i=0; i<16; i++ )
+    vec2 center = (-resolution.xy + (lo+hi))/resolution.y;
+    vec3 rd = camera_to_world * normalize( vec3(center,2.0) );
+
+    // Rays at the same distance t are at most t*spread apart
+    float spread = 0.0;
+    for( int c=0; c<4; c++ )
     {
-        float h = signed_distance_field( ro + rd*t ).x;
-        res = min( res, 8.0*h/t );
-        t += clamp( h, 0.02, 0.10 );
-        if( h<0.001 || t>tmax ) break;
+        vec2 corner = vec2( c%2==0 ? lo.x : hi.x, c<2 ? lo.y : hi.y );
+        vec2 p = (-resolution.xy + 2.0*corner)/resolution.y;
+        spread = max( spread, length( camera_to_world*normalize( vec3(p,2.0) ) - rd ) );
     }
-    return clamp( res, 0.0, 1.0 );
+
+    float tmin = 0.1;
+    float tmax = marchFar;
+    float t = tmin;
+    for( int i=0; i<marchSteps; i++ )
+    {
+        float clearance = signed_distance_field( ro+rd*t ).x - t*spread;
+        if( clearance<0.0001*t || t>tmax ) break;
+        t += clearance;
+    }
+    return t;
 }
 
 vec3 calcNormal( in vec3 pos )
 {
     vec2 e = vec2(1.0,-1.0)*0.5773*0.0005;
-    return normalize( e.xyy*signed_distance_field( pos + e.xyy ).x +
-                      e.yyx*signed_distance_field( pos + e.yyx ).x +
-                      e.yxy*signed_distance_field( pos + e.yxy ).x +
-                      e.xxx*signed_distance_field( pos + e.xxx ).x );
+    return normalize( e.xyy*counted_sdf( pos + e.xyy ).x +
+                      e.yyx*counted_sdf( pos + e.yyx ).x +
+                      e.yxy*counted_sdf( pos + e.yxy ).x +
+                      e.xxx*counted_sdf( pos + e.xxx ).x );
     /*
     vec3 eps = vec3( 0.0005, 0.0, 0.0 );
     vec3 nor = vec3(
@@ -50,22 +117,31 @@ vec3 calcNormal( in vec3 pos )
     */
 }
 
-float calcAO( in vec3 pos, in vec3 nor )
+// Forward differences from the field value castRay stopped at
+vec3 calcNormalFast( in vec3 pos )
 {
-    float occ = 0.0;
-    float sca = 1.0;
-    for( int i=0; i<5; i++ )
-    {
-        float hr = 0.01 + 0.12*float(i)/4.0;
-        vec3 aopos =  nor * hr + pos;
-        float dd = signed_distance_field( aopos ).x;
-        occ += -(dd-hr)*sca;
-        sca *= 0.95;
-    }
-    return clamp( 1.0 - 3.0*occ, 0.0, 1.0 );
+    vec2 e = vec2(0.0005,0.0);
+    return normalize( vec3( counted_sdf( pos + e.xyy ).x,
+                            counted_sdf( pos + e.yxy ).x,
+                            counted_sdf( pos + e.yyx ).x ) - hit_distance );
 }
 
-vec3 render( in vec3 ro, in vec3 rd )
+// Shadow toward the light and ambient occlusion, baked by lighting.h into a
+// grid with a point every lightCell from lightMin. The grid's edge is lit.
+uniform sampler3D lightVolume;
+uniform vec3 lightMin;
+uniform float lightCell;
+
+vec2 cachedLighting( in vec3 pos )
+{
+    vec3 texel = (pos - lightMin)/lightCell + 0.5;
+    return texture( lightVolume, texel/vec3(textureSize(lightVolume, 0)) ).rg;
+}
+
+// depth is the distance along rd to the surface, or FAR_DEPTH on a miss
+#define FAR_DEPTH 1000.0
+
+vec3 render( in vec3 ro, in vec3 rd, in float tstart, out float depth )
 {
     vec3 color =
 #ifdef FALSE_COLOR_MODE
@@ -73,13 +149,15 @@ vec3 render( in vec3 ro, in vec3 rd )
 #else
     vec3(0.4, 0.5, 0.6) +rd.y*0.4;
 #endif
-    vec4 result = castRay(ro,rd);
+    vec4 result = castRay(ro,rd,tstart);
     float t = result.x;
     vec3 m = result.yzw;
+    depth = FAR_DEPTH;
     if( m.r>-0.5 )
     {
+        depth = t;
         vec3 pos = ro + t*rd;
-        vec3 nor = calcNormal( pos );
+        vec3 nor = fastShading ? calcNormalFast( pos ) : calcNormal( pos );
         // vec3 ref = reflect( rd, nor );
 
         // material
@@ -88,15 +166,15 @@ vec3 render( in vec3 ro, in vec3 rd )
         #ifndef FALSE_COLOR_MODE
 
         // lighting
-        // float occ = calcAO( pos, nor );
+        vec2 cached = fastShading ? vec2(1.0) : cachedLighting( pos );
+        float occ = cached.y;
         vec3  light_dir = normalize( vec3(cos(-0.4), sin(0.7), -0.6) );
         vec3  hal = normalize( light_dir-rd );
         float ambient = clamp( 0.5+0.5*nor.y, 0.0, 1.0 );
         float diffuse = clamp( dot( nor, light_dir ), 0.0, 1.0 );
         float back_light = clamp( dot( nor, normalize(vec3(-light_dir.x,0.0,-light_dir.z))), 0.0, 1.0 )*clamp( 1.0-pos.y,0.0,1.0);
 
-        // TODO: turn back on shadows
-        diffuse *= calcSoftshadow( pos, light_dir, 0.02, 2.5 );
+        diffuse *= cached.x;
 
         float spe = pow( clamp( dot( nor, hal ), 0.0, 1.0 ),16.0)*
                     diffuse *
@@ -104,8 +182,8 @@ vec3 render( in vec3 ro, in vec3 rd )
 
         vec3 lin = vec3(0.0);
         lin += 1.30*diffuse*vec3(1.00,0.80,0.55);
-        lin += 0.40*ambient*vec3(0.40,0.60,1.00);//*occ;
-        lin += 0.50*back_light*vec3(0.25,0.25,0.25);//*occ;
+        lin += 0.40*ambient*vec3(0.40,0.60,1.00)*occ;
+        lin += 0.50*back_light*vec3(0.25,0.25,0.25)*occ;
         color = color*lin;
         color += 10.00*spe*vec3(1.00,0.90,0.70);
         #endif
@@ -123,6 +201,34 @@ mat3 setCamera( in vec3 ro, in vec3 ta, float cr )
     return mat3( cu, cv, cw );
 }
 
+// blue -> cyan -> green -> yellow -> red
+vec3 heatmap( in float x )
+{
+    x = clamp( x, 0.0, 1.0 );
+    return clamp( vec3( 4.0*x-2.0, 2.0-abs(4.0*x-2.0), 2.0-4.0*x ), 0.0, 1.0 );
+}
+
+// Without counter ops a pixel adds at most one increment to each counter,
+// standing for COST_*_UNIT of its count. The pixel increments with chance
+// count/unit against a per-pixel threshold, and main.c scales the totals
+// back up, so the frame total stays right on average.
+#define COST_MARCH_UNIT 128.0
+#define COST_EVAL_UNIT 8192.0
+
+void count_cost()
+{
+#ifdef GL_ARB_shader_atomic_counters
+#ifdef GL_ARB_shader_atomic_counter_ops
+    atomicCounterAddARB( marchStepTotal, uint(march_steps) );
+    atomicCounterAddARB( shapeEvalTotal, uint(sdf_evaluations)*uint(shapeCount) );
+#else
+    float threshold = fract( 52.9829189*fract( dot( gl_FragCoord.xy, vec2(0.06711056, 0.00583715) ) ) );
+    if( threshold < float(march_steps)/COST_MARCH_UNIT ) atomicCounterIncrement( marchStepTotal );
+    if( threshold < float(sdf_evaluations)*shapeCount/COST_EVAL_UNIT ) atomicCounterIncrement( shapeEvalTotal );
+#endif
+#endif
+}
+
 // plane.xyz must be normalized
 float planeIntersect( in vec3 ro, in vec3 rd, in vec4 plane )  {
     return -(dot(ro,plane.xyz)+plane.w)/dot(rd,plane.xyz);
@@ -130,48 +236,59 @@ float planeIntersect( in vec3 ro, in vec3 rd, in vec4 plane )  {
 
 void main()
 {
-    vec3 tot = vec3(0.0);
-// TODO:  turn back on AA
-#define AA 1
-#if AA>1
-    for( int m=0; m<AA; m++ )
-    for( int n=0; n<AA; n++ )
+    // The pass may render into a smaller target than the viewport, so the
+    // window pixel is rebuilt from the target pixel. Antialiasing comes from
+    // the jitter, averaged over frames by upsample.fs.
+    vec2 fragCoord = viewportOrigin + (gl_FragCoord.xy + jitter)/renderScale;
+
+    vec3 ro = viewEye;
+    vec3 ta = viewCenter;
+
+    mat3 camera_to_world = setCamera( ro, ta, 0.0 );
+
+    if( conePass )
     {
-        // pixel coordinates
-        vec2 o = vec2(float(m),float(n)) / float(AA) - 0.5;
-        vec2 p = (-resolution.xy + 2.0*(gl_FragCoord.xy+o))/resolution.y;
-#else
-        vec2 p = (-resolution.xy + 2.0*gl_FragCoord.xy)/resolution.y;
-#endif
+        // Window pixels reached by the jittered samples of this tile
+        vec2 tile = floor( gl_FragCoord.xy )*float(CONE_TILE);
+        vec2 lo = viewportOrigin + tile/renderScale;
+        vec2 hi = viewportOrigin + (tile + float(CONE_TILE))/renderScale;
+        finalColor = vec4( coneStart( ro, camera_to_world, lo, hi ), 0.0, 0.0, 1.0 );
+        return;
+    }
 
-        vec3 ro = viewEye;
-        vec3 ta = viewCenter;
+    vec2 p = (-resolution.xy + 2.0*fragCoord)/resolution.y;
+    vec3 ray_direction = camera_to_world * normalize( vec3(p.xy,2.0) );
+    float tstart = texelFetch( coneStarts, ivec2(gl_FragCoord.xy)/CONE_TILE, 0 ).r;
 
-        mat3 camera_to_world = setCamera( ro, ta, 0.0 );
-        vec3 ray_direction = camera_to_world * normalize( vec3(p.xy,2.0) );
+    float depth;
+    vec3 col = render( ro, ray_direction, tstart, depth );
 
-        vec3 col = render( ro, ray_direction );
+    col = pow( col, vec3(0.4545) ); // gamma
 
-        col = pow( col, vec3(0.4545) ); // gamma
-        
-        if (visualizer > 0.) {
-            float dist = planeIntersect(ro, ray_direction, vec4(0,0,1.,0));
-            if (dist > 0.) {
-                vec3 t = ro + dist*ray_direction;
-                float sdf_value = signed_distance_field(t).x;
-                vec4 field_color = (sdf_value < 0. ? 
-                                    vec4(1.,0.,0., sin(sdf_value*8.+runTime*2.)/4. + 0.25): 
-                                    vec4(0.15, 0.15,0.8,sin(sdf_value*8.-runTime*2.)/4. + 0.25 )) ;
+    if (visualizer > 0.5 && visualizer < 1.5) {
+        float dist = planeIntersect(ro, ray_direction, vec4(0,0,1.,0));
+        if (dist > 0.) {
+            vec3 t = ro + dist*ray_direction;
+            float sdf_value = counted_sdf(t).x;
+            vec4 field_color = (sdf_value < 0. ? 
+                                vec4(1.,0.,0., sin(sdf_value*8.+runTime*2.)/4. + 0.25): 
+                                vec4(0.15, 0.15,0.8,sin(sdf_value*8.-runTime*2.)/4. + 0.25 )) ;
 
-                col = mix(col, field_color.rgb, field_color.a);
-            }
+            col = mix(col, field_color.rgb, field_color.a);
         }
+    }
 
-        tot += col;
-#if AA>1
+    if (visualizer > 1.5) {
+        // march steps or shape evaluations, the latter on a log scale where
+        // the top of the ramp is a ray that runs out of steps, takes one more
+        // sample and four normal taps, each evaluating MAX_SPHERES (100) shapes
+        float most_evaluations = float(marchSteps + 1 + 4)*100.0;
+        float cost = visualizer < 2.5 ? float(march_steps) / 64.0 :
+                                        log2( 1.0 + float(sdf_evaluations)*shapeCount ) / log2( 1.0 + most_evaluations );
+        col = heatmap( cost );
+        count_cost();
     }
-    tot /= float(AA*AA);
-#endif
 
-    finalColor = vec4( tot, 1.0 );
+    // alpha carries the depth for temporal upsampling
+    finalColor = vec4( col, depth );
 }
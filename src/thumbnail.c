@@ -0,0 +1,460 @@
+// Renders .ocad snapshots to PNG thumbnails without a GPU or a window.
+//
+//     build/thumbnail [-s size] [-r resolution] [-t ms] [-o dir] [-ppm] snapshot.ocad...
+//
+// Every snapshot is one job. The job samples the scene's distance function
+// on the CPU (scene.h), meshes it with the export's marching cubes tables,
+// lights each triangle and draws the mesh with mini3d into a buffer from the
+// worker's arena. Nothing is shared between jobs, so a batch scales with the
+// worker count.
+//
+// The picture uses the editor's starting camera, framed to fit the mesh.
+// Thumbnails are written next to their snapshot unless -o names a directory.
+//
+// -t caps the milliseconds a job spends meshing. The job meshes the scene at
+// a quarter of the resolution first, assumes the full mesh costs the cube of
+// the resolution ratio times that, and lowers the resolution until it fits.
+// Surface work only grows with the square, so the estimate errs high.
+
+#define _POSIX_C_SOURCE 200809L
+#define MINI3D_NO_MAIN
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "../mini3d/mini3d.c"
+#include "arena.h"
+#include "jobs.h"
+#include "marching_cubes.h"
+#include "scene.h"
+
+// Samples per side of a block that is skipped when its center is far enough
+// from the surface. The distance function never changes faster than the
+// distance moved, so the whole block has the sign of its center.
+//
+// Each block also folds only the shapes whose bounds come within
+// THUMBNAIL_REACH samples plus the shape's blend of it. A shape further
+// away only changes values more than THUMBNAIL_REACH samples from the
+// surface, which keep their sign, so the cells the mesh comes from are the
+// same. A sample pays for the shapes around it rather than for all of them.
+#define THUMBNAIL_BLOCK 4
+#define THUMBNAIL_REACH 2
+#define THUMBNAIL_PROBE 4
+#define THUMBNAIL_MAX_IN_FLIGHT 256
+
+typedef struct {
+    const char *path;
+    char output[512];
+    int size;
+    int resolution;
+    double budget;
+    bool ppm;
+
+    bool ok;
+    int triangles;
+    double milliseconds;
+} Thumbnail;
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+static Vector3 vec3_sub(Vector3 a, Vector3 b) {
+    return (Vector3){ a.x - b.x, a.y - b.y, a.z - b.z };
+}
+
+static Vector3 vec3_cross(Vector3 a, Vector3 b) {
+    return (Vector3){ a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x };
+}
+
+static float vec3_dot(Vector3 a, Vector3 b) {
+    return a.x * b.x + a.y * b.y + a.z * b.z;
+}
+
+static Vector3 vec3_normalize(Vector3 v) {
+    const float length = sqrtf(vec3_dot(v, v));
+    return length > 0 ? (Vector3){ v.x / length, v.y / length, v.z / length } : v;
+}
+
+typedef struct {
+    Vector3 min;
+    float step;
+    int nx, ny, nz;
+    float *values;
+} SampleGrid;
+
+static SceneSample sample_near(const SceneShape *shapes, const int *near, int count, Vector3 p) {
+    SceneSample result = { INFINITY, { 0, 0, 0 } };
+    for (int i = 0; i < count; i++) result = scene_fold(result, &shapes[near[i]], p);
+    return result;
+}
+
+// Lists the shapes that can change the surface within the samples from
+// (x0, y0, z0) to (x1, y1, z1), in map order. Returns how many there are.
+static int shapes_near(const SampleGrid *grid, const SceneShape *shapes, int count,
+                       int x0, int y0, int z0, int x1, int y1, int z1, int *near) {
+    const Vector3 lo = { grid->min.x + x0 * grid->step, grid->min.y + y0 * grid->step, grid->min.z + z0 * grid->step };
+    const Vector3 hi = { grid->min.x + x1 * grid->step, grid->min.y + y1 * grid->step, grid->min.z + z1 * grid->step };
+    int near_count = 0;
+    for (int i = 0; i < count; i++) {
+        Vector3 min, max;
+        scene_shape_bounds(&shapes[i].sphere, &min, &max);
+        const float gx = fmaxf(0, fmaxf(min.x - hi.x, lo.x - max.x));
+        const float gy = fmaxf(0, fmaxf(min.y - hi.y, lo.y - max.y));
+        const float gz = fmaxf(0, fmaxf(min.z - hi.z, lo.z - max.z));
+        const float limit = grid->step * THUMBNAIL_REACH + fmaxf(shapes[i].sphere.blob_amount, 0);
+        if (gx * gx + gy * gy + gz * gz < limit * limit) near[near_count++] = i;
+    }
+    return near_count;
+}
+
+static void sample_grid(SampleGrid *grid, const SceneShape *shapes, int count) {
+    const float block_radius = grid->step * (THUMBNAIL_BLOCK - 1) * 0.5f * 1.7321f;
+
+    for (int bz = 0; bz < grid->nz; bz += THUMBNAIL_BLOCK) {
+        for (int by = 0; by < grid->ny; by += THUMBNAIL_BLOCK) {
+            for (int bx = 0; bx < grid->nx; bx += THUMBNAIL_BLOCK) {
+                const int ex = bx + THUMBNAIL_BLOCK < grid->nx ? bx + THUMBNAIL_BLOCK : grid->nx;
+                const int ey = by + THUMBNAIL_BLOCK < grid->ny ? by + THUMBNAIL_BLOCK : grid->ny;
+                const int ez = bz + THUMBNAIL_BLOCK < grid->nz ? bz + THUMBNAIL_BLOCK : grid->nz;
+                int near[MAX_SPHERES];
+                const int near_count = shapes_near(grid, shapes, count, bx, by, bz, ex - 1, ey - 1, ez - 1, near);
+
+                const Vector3 center = {
+                    grid->min.x + (bx + (THUMBNAIL_BLOCK - 1) * 0.5f) * grid->step,
+                    grid->min.y + (by + (THUMBNAIL_BLOCK - 1) * 0.5f) * grid->step,
+                    grid->min.z + (bz + (THUMBNAIL_BLOCK - 1) * 0.5f) * grid->step,
+                };
+                // With nothing near, the block is outside everything by at least the reach.
+                const float d = near_count ? sample_near(shapes, near, near_count, center).distance : grid->step * THUMBNAIL_REACH;
+                const bool far = !near_count || fabsf(d) > block_radius + grid->step * 0.5f;
+
+                for (int z = bz; z < ez; z++) {
+                    for (int y = by; y < ey; y++) {
+                        float *row = grid->values + ((size_t)z * grid->ny + y) * grid->nx;
+                        for (int x = bx; x < ex; x++) {
+                            const Vector3 p = {
+                                grid->min.x + x * grid->step,
+                                grid->min.y + y * grid->step,
+                                grid->min.z + z * grid->step,
+                            };
+                            row[x] = far ? d : sample_near(shapes, near, near_count, p).distance;
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+static int cell_index(const SampleGrid *grid, int x, int y, int z, float values[8]) {
+    const float *a = grid->values + ((size_t)z * grid->ny + y) * grid->nx + x;
+    const float *b = a + (size_t)grid->nx * grid->ny;
+    values[0] = a[0], values[1] = a[1], values[2] = a[grid->nx + 1], values[3] = a[grid->nx];
+    values[4] = b[0], values[5] = b[1], values[6] = b[grid->nx + 1], values[7] = b[grid->nx];
+
+    int index = 0;
+    for (int i = 0; i < 8; i++) index |= (values[i] < 0) << i;
+    return index;
+}
+
+// Triangles each cube index produces. Filled by main before any job runs,
+// so the jobs only ever read it.
+static int triangles_per_index[256];
+
+static void count_triangles_init(void) {
+    for (int i = 0; i < 256; i++) {
+        int n = 0;
+        while (triTable[i][n] != -1) n++;
+        triangles_per_index[i] = n / 3;
+    }
+}
+
+static int count_triangles(const SampleGrid *grid) {
+    int triangles = 0;
+    float values[8];
+    for (int z = 0; z < grid->nz - 1; z++) {
+        for (int y = 0; y < grid->ny - 1; y++) {
+            for (int x = 0; x < grid->nx - 1; x++) {
+                triangles += triangles_per_index[cell_index(grid, x, y, z, values)];
+            }
+        }
+    }
+    return triangles;
+}
+
+// Same placement as the export's VertexInterp.
+static Vector3 edge_point(Vector3 p1, float v1, Vector3 p2, float v2) {
+    if (fabsf(v1) < 0.00001f || fabsf(v1 - v2) < 0.00001f) return p1;
+    if (fabsf(v2) < 0.00001f) return p2;
+    const float mu = -v1 / (v2 - v1);
+    return (Vector3){ p1.x + mu * (p2.x - p1.x), p1.y + mu * (p2.y - p1.y), p1.z + mu * (p2.z - p1.z) };
+}
+
+// Writes three scene space corners per triangle, flat lit and colored by the
+// scene at the triangle's center. Returns the number of triangles written.
+static int polygonize(const SampleGrid *grid, const SceneShape *shapes, int count, vertex_t *vertices) {
+    const Vector3 light = vec3_normalize((Vector3){ 0.4f, 1.0f, 0.6f });
+    static const int offsets[8][3] = {
+        {0, 0, 0}, {1, 0, 0}, {1, 1, 0}, {0, 1, 0},
+        {0, 0, 1}, {1, 0, 1}, {1, 1, 1}, {0, 1, 1},
+    };
+    int triangles = 0;
+    float values[8];
+    int near[MAX_SPHERES], near_count = 0, near_block = -1;
+
+    for (int z = 0; z < grid->nz - 1; z++) {
+        for (int y = 0; y < grid->ny - 1; y++) {
+            for (int x = 0; x < grid->nx - 1; x++) {
+                const int index = cell_index(grid, x, y, z, values);
+                if (!edgeTable[index]) continue;
+
+                // Cells of a block share its shape list. A cell reaches one
+                // sample past its block, so the list's box does too.
+                const int bx = x - x % THUMBNAIL_BLOCK, by = y - y % THUMBNAIL_BLOCK, bz = z - z % THUMBNAIL_BLOCK;
+                const int block = (bz * grid->ny + by) * grid->nx + bx;
+                if (block != near_block) {
+                    const int ex = bx + THUMBNAIL_BLOCK < grid->nx ? bx + THUMBNAIL_BLOCK : grid->nx - 1;
+                    const int ey = by + THUMBNAIL_BLOCK < grid->ny ? by + THUMBNAIL_BLOCK : grid->ny - 1;
+                    const int ez = bz + THUMBNAIL_BLOCK < grid->nz ? bz + THUMBNAIL_BLOCK : grid->nz - 1;
+                    near_count = shapes_near(grid, shapes, count, bx, by, bz, ex, ey, ez, near);
+                    near_block = block;
+                }
+
+                Vector3 corners[8], points[12];
+                for (int i = 0; i < 8; i++) {
+                    corners[i] = (Vector3){
+                        grid->min.x + (x + offsets[i][0]) * grid->step,
+                        grid->min.y + (y + offsets[i][1]) * grid->step,
+                        grid->min.z + (z + offsets[i][2]) * grid->step,
+                    };
+                }
+                for (int edge = 0; edge < 12; edge++) {
+                    if (edgeTable[index] & (1 << edge)) {
+                        const int a = edgeVertices[edge][0], b = edgeVertices[edge][1];
+                        points[edge] = edge_point(corners[a], values[a], corners[b], values[b]);
+                    }
+                }
+
+                for (int i = 0; triTable[index][i] != -1; i += 3) {
+                    const Vector3 a = points[triTable[index][i]];
+                    const Vector3 b = points[triTable[index][i + 1]];
+                    const Vector3 c = points[triTable[index][i + 2]];
+                    const Vector3 normal = vec3_normalize(vec3_cross(vec3_sub(c, a), vec3_sub(b, a)));
+                    const Vector3 center = { (a.x + b.x + c.x) / 3, (a.y + b.y + c.y) / 3, (a.z + b.z + c.z) / 3 };
+                    const Vector3 albedo = sample_near(shapes, near, near_count, center).color;
+                    const float lit = 0.3f + 0.7f * fmaxf(vec3_dot(normal, light), 0);
+                    const color_t color = { albedo.x * lit, albedo.y * lit, albedo.z * lit };
+
+                    vertex_t *v = &vertices[triangles * 3];
+                    v[0] = (vertex_t){ { a.x, a.y, a.z, 1 }, { 0, 0 }, color, 1 };
+                    v[1] = (vertex_t){ { b.x, b.y, b.z, 1 }, { 0, 0 }, color, 1 };
+                    v[2] = (vertex_t){ { c.x, c.y, c.z, 1 }, { 0, 0 }, color, 1 };
+                    triangles++;
+                }
+            }
+        }
+    }
+    return triangles;
+}
+
+// Looks at the mesh from the editor's starting direction. mini3d's camera is
+// left handed, so z is flipped on the way in to get the editor's picture.
+static void frame_mesh(device_t *device, vertex_t *vertices, int count) {
+    vector_t min = { INFINITY, INFINITY, INFINITY, 1 }, max = { -INFINITY, -INFINITY, -INFINITY, 1 };
+    for (int i = 0; i < count; i++) {
+        const point_t *p = &vertices[i].pos;
+        min.x = fminf(min.x, p->x), min.y = fminf(min.y, p->y), min.z = fminf(min.z, p->z);
+        max.x = fmaxf(max.x, p->x), max.y = fmaxf(max.y, p->y), max.z = fmaxf(max.z, p->z);
+    }
+
+    const float fovy = 55.0f * 3.1415926f / 180.0f;
+    const float radius = fmaxf(0.5f * sqrtf((max.x - min.x) * (max.x - min.x) + (max.y - min.y) * (max.y - min.y) +
+                                            (max.z - min.z) * (max.z - min.z)), 1e-6f);
+    const float distance = 1.05f / sinf(fovy * 0.5f);
+    const Vector3 direction = vec3_normalize((Vector3){ 2.5f, 2.5f, -3.0f });
+    point_t eye = { direction.x * distance, direction.y * distance, direction.z * distance, 1 };
+    point_t at = { 0, 0, 0, 1 }, up = { 0, 1, 0, 1 };
+
+    matrix_t scale, translate;
+    matrix_set_translate(&translate, -(min.x + max.x) * 0.5f, -(min.y + max.y) * 0.5f, -(min.z + max.z) * 0.5f);
+    matrix_set_scale(&scale, 1 / radius, 1 / radius, -1 / radius);
+    matrix_mul(&device->transform.world, &translate, &scale);
+    matrix_set_lookat(&device->transform.view, &eye, &at, &up);
+    matrix_set_perspective(&device->transform.projection, fovy, 1.0f, distance - 1.1f, distance + 1.1f);
+    transform_update(&device->transform);
+}
+
+// Samples the box from min to max with resolution samples along its longest
+// side and meshes it. The vertices come from the arena.
+static int mesh_scene(const SceneShape *shapes, int count, Vector3 min, Vector3 max, int resolution, Arena *arena,
+                      vertex_t **vertices) {
+    SampleGrid grid;
+    grid.min = min;
+    grid.step = fmaxf(max.x - min.x, fmaxf(max.y - min.y, max.z - min.z)) / resolution;
+    grid.nx = (int)ceilf((max.x - min.x) / grid.step) + 1;
+    grid.ny = (int)ceilf((max.y - min.y) / grid.step) + 1;
+    grid.nz = (int)ceilf((max.z - min.z) / grid.step) + 1;
+    grid.values = arena_alloc(arena, sizeof(float) * grid.nx * grid.ny * grid.nz);
+    sample_grid(&grid, shapes, count);
+
+    const int triangles = count_triangles(&grid);
+    *vertices = arena_alloc(arena, sizeof(vertex_t) * 3 * (triangles + 1));
+    polygonize(&grid, shapes, count, *vertices);
+    return triangles;
+}
+
+void thumbnail_job(Job *job, void *data, Arena *arena) {
+    (void)job;
+    TRACE_SCOPE("thumbnail");
+    Thumbnail *thumbnail = data;
+    const double start = now_ms();
+
+    Sphere spheres[MAX_SPHERES];
+    SceneShape shapes[MAX_SPHERES];
+    int count = 0;
+    if (!snapshot_read(thumbnail->path, spheres, &count)) return;
+    scene_prepare(spheres, count, shapes);
+
+    // Rounding and blending can push the surface past the shapes' boxes.
+    float padding = 0.05f;
+    for (int i = 0; i < count; i++) {
+        padding = fmaxf(padding, spheres[i].corner_radius + spheres[i].blob_amount * 0.25f + 0.05f);
+    }
+
+    Vector3 min, max;
+    scene_bounds(spheres, count, padding, &min, &max);
+
+    int resolution = thumbnail->resolution;
+    vertex_t *vertices;
+    if (thumbnail->budget > 0 && resolution >= THUMBNAIL_PROBE * 4) {
+        const int probe = resolution / THUMBNAIL_PROBE;
+        const double probe_start = now_ms();
+        mesh_scene(shapes, count, min, max, probe, arena, &vertices);
+        const double probe_ms = fmax(now_ms() - probe_start, 0.001);
+        const int fits = (int)(probe * cbrt(thumbnail->budget / probe_ms));
+        resolution = fits < probe ? probe : fits < resolution ? fits : resolution;
+    }
+    const int triangles = mesh_scene(shapes, count, min, max, resolution, arena, &vertices);
+    int *indices = arena_alloc(arena, sizeof(int) * 3 * (triangles + 1));
+    for (int i = 0; i < triangles * 3; i++) indices[i] = i;
+
+    const int size = thumbnail->size;
+    IUINT32 *pixels = arena_alloc(arena, sizeof(IUINT32) * size * size);
+    device_t device;
+    device_init(&device, size, size, pixels);
+    device.render_state = RENDER_STATE_COLOR | RENDER_STATE_HALFSPACE | RENDER_STATE_CULL;
+    device_clear(&device, 0);
+    if (triangles) {
+        frame_mesh(&device, vertices, triangles * 3);
+        device_draw_indexed(&device, vertices, triangles * 3, indices, triangles * 3);
+    }
+    device_destroy(&device);
+
+    const int result = thumbnail->ppm ? image_write_ppm(thumbnail->output, pixels, size * 4, size, size)
+                                      : image_write_png(thumbnail->output, pixels, size * 4, size, size);
+    if (result) {
+        fprintf(stderr, "Failed to write %s\n", thumbnail->output);
+        return;
+    }
+    thumbnail->triangles = triangles;
+    thumbnail->resolution = resolution;
+    thumbnail->milliseconds = now_ms() - start;
+    thumbnail->ok = true;
+}
+
+// name.ocad becomes name.png, in directory when one is given.
+static void output_path(char *output, size_t capacity, const char *path, const char *directory, bool ppm) {
+    const char *name = strrchr(path, '/');
+    name = name ? name + 1 : path;
+    const char *dot = strrchr(name, '.');
+    const int stem = dot && dot != name ? (int)(dot - name) : (int)strlen(name);
+    const int folder = directory ? 0 : (int)(name - path);
+
+    if (directory) {
+        snprintf(output, capacity, "%s/%.*s.%s", directory, stem, name, ppm ? "ppm" : "png");
+    } else {
+        snprintf(output, capacity, "%.*s%.*s.%s", folder, path, stem, name, ppm ? "ppm" : "png");
+    }
+}
+
+static void wait_for(Job *job) {
+    const struct timespec delay = { 0, 1000000 };
+    while (!job_finished(job)) nanosleep(&delay, NULL);
+}
+
+static int usage(void) {
+    fprintf(stderr, "usage: thumbnail [-s size] [-r resolution] [-t ms] [-o dir] [-ppm] snapshot.ocad...\n");
+    return 1;
+}
+
+int main(int argc, char **argv) {
+    int size = 256, resolution = 64;
+    double budget = 0;
+    const char *directory = NULL;
+    bool ppm = false;
+
+    int first = 1;
+    for (; first < argc && argv[first][0] == '-'; first++) {
+        if (!strcmp(argv[first], "-ppm")) {
+            ppm = true;
+        } else if (first + 1 < argc && !strcmp(argv[first], "-s")) {
+            size = atoi(argv[++first]);
+        } else if (first + 1 < argc && !strcmp(argv[first], "-r")) {
+            resolution = atoi(argv[++first]);
+        } else if (first + 1 < argc && !strcmp(argv[first], "-t")) {
+            budget = atof(argv[++first]);
+        } else if (first + 1 < argc && !strcmp(argv[first], "-o")) {
+            directory = argv[++first];
+        } else {
+            return usage();
+        }
+    }
+    if (first == argc || size < 8 || size > 8192 || resolution < 4 || resolution > 512 || budget < 0) return usage();
+
+    const int count = argc - first;
+    Thumbnail *thumbnails = calloc(count, sizeof(Thumbnail));
+    Job **jobs = calloc(count, sizeof(Job *));
+    assert(thumbnails && jobs);
+
+    count_triangles_init();
+    job_system_init();
+    const double start = now_ms();
+    int submitted = 0, failed = 0;
+
+    // Jobs are collected in order, keeping a bounded number queued ahead.
+    for (int i = 0; i < count; i++) {
+        for (; submitted < count && submitted < i + THUMBNAIL_MAX_IN_FLIGHT; submitted++) {
+            Thumbnail *thumbnail = &thumbnails[submitted];
+            thumbnail->path = argv[first + submitted];
+            thumbnail->size = size;
+            thumbnail->resolution = resolution;
+            thumbnail->budget = budget;
+            thumbnail->ppm = ppm;
+            output_path(thumbnail->output, sizeof(thumbnail->output), thumbnail->path, directory, ppm);
+            jobs[submitted] = job_create(thumbnail_job, thumbnail, JOB_PRIORITY_NORMAL);
+            job_submit(jobs[submitted]);
+        }
+
+        wait_for(jobs[i]);
+        job_release(jobs[i]);
+        if (thumbnails[i].ok) {
+            printf("%s (%d triangles at resolution %d, %.1f ms)\n", thumbnails[i].output, thumbnails[i].triangles,
+                   thumbnails[i].resolution, thumbnails[i].milliseconds);
+        } else {
+            failed++;
+        }
+    }
+
+    const double total = now_ms() - start;
+    printf("%d of %d thumbnails in %.1f ms, %.1f ms each on %d workers\n",
+           count - failed, count, total, total / count, job_system.worker_count);
+
+    job_system_shutdown();
+    free(jobs);
+    free(thumbnails);
+    return failed ? 1 : 0;
+}
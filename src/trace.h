@@ -0,0 +1,163 @@
+// Scoped CPU trace markers, dumped as Chrome trace_event JSON for Perfetto
+// or chrome://tracing.
+//
+// Build with -DTRACE_ENABLED=1 (`make trace`) to record; otherwise every
+// macro below compiles to nothing.
+//
+//     void export(void) {
+//         TRACE_SCOPE("export");
+//         ...
+//     }
+//
+// Each thread records into its own ring buffer, so recording takes no locks.
+// The owning thread is the only writer and publishes an event by bumping
+// `head`. trace_dump reads up to `head` from any thread. A ring that wraps
+// while it is being dumped can tear its oldest events, so the dump skips a
+// margin of them.
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#if TRACE_ENABLED
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define TRACE_RING_SIZE 65536
+#define TRACE_DUMP_MARGIN 1024
+#define TRACE_MAX_THREADS 64
+
+typedef struct {
+    const char *name;
+    uint64_t begin;
+    uint64_t end;
+} TraceEvent;
+
+typedef struct {
+    TraceEvent events[TRACE_RING_SIZE];
+    _Atomic uint64_t head;
+    const char *thread_name;
+    int thread_id;
+} TraceBuffer;
+
+typedef struct {
+    const char *name;
+    uint64_t begin;
+} TraceScope;
+
+static TraceBuffer *_Atomic trace_buffers[TRACE_MAX_THREADS];
+static atomic_int trace_buffer_count;
+static _Thread_local TraceBuffer *trace_local;
+// Set on a thread that came after every buffer was taken, so it stops asking
+static _Thread_local bool trace_refused;
+
+static inline uint64_t trace_now(void) {
+    return glfwGetTimerValue();
+}
+
+static inline TraceBuffer *trace_thread_buffer(void) {
+    if (!trace_local && !trace_refused) {
+        const int id = atomic_fetch_add(&trace_buffer_count, 1);
+        if (id >= TRACE_MAX_THREADS) {
+            trace_refused = true;
+            return NULL;
+        }
+
+        TraceBuffer *buffer = calloc(1, sizeof(TraceBuffer));
+        buffer->thread_id = id;
+        atomic_store(&trace_buffers[id], buffer);
+        trace_local = buffer;
+    }
+    return trace_local;
+}
+
+static inline void trace_set_thread_name(const char *name) {
+    TraceBuffer *buffer = trace_thread_buffer();
+    if (buffer) buffer->thread_name = name;
+}
+
+static inline void trace_record(const char *name, uint64_t begin, uint64_t end) {
+    TraceBuffer *buffer = trace_thread_buffer();
+    if (!buffer) return;
+
+    const uint64_t head = atomic_load_explicit(&buffer->head, memory_order_relaxed);
+    buffer->events[head % TRACE_RING_SIZE] = (TraceEvent){ name, begin, end };
+    atomic_store_explicit(&buffer->head, head + 1, memory_order_release);
+}
+
+static inline TraceScope trace_begin(const char *name) {
+    return (TraceScope){ name, trace_now() };
+}
+
+static inline void trace_end(TraceScope *scope) {
+    trace_record(scope->name, scope->begin, trace_now());
+}
+
+static inline void trace_dump(const char *path) {
+    FILE *file = fopen(path, "wb");
+    if (!file) {
+        perror("Failed to open trace file");
+        return;
+    }
+
+    const double us_per_tick = 1e6 / (double)glfwGetTimerFrequency();
+    bool first = true;
+    fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+
+    const int count = atomic_load(&trace_buffer_count);
+    for (int i = 0; i < count && i < TRACE_MAX_THREADS; i++) {
+        TraceBuffer *buffer = atomic_load(&trace_buffers[i]);
+        if (!buffer) continue;
+
+        if (buffer->thread_name) {
+            fprintf(file, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                    first ? "" : ",", buffer->thread_id, buffer->thread_name);
+            first = false;
+        }
+
+        const uint64_t head = atomic_load_explicit(&buffer->head, memory_order_acquire);
+        uint64_t tail = 0;
+        if (head > TRACE_RING_SIZE - TRACE_DUMP_MARGIN) tail = head - (TRACE_RING_SIZE - TRACE_DUMP_MARGIN);
+
+        for (uint64_t e = tail; e < head; e++) {
+            const TraceEvent *event = &buffer->events[e % TRACE_RING_SIZE];
+            fprintf(file, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+                    first ? "" : ",", event->name, buffer->thread_id,
+                    event->begin * us_per_tick, (event->end - event->begin) * us_per_tick);
+            first = false;
+        }
+    }
+
+    fprintf(file, "\n]}\n");
+    fclose(file);
+    printf("Wrote trace to %s\n", path);
+}
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+
+// Records from here to the end of the enclosing block.
+#define TRACE_SCOPE(name) \
+    __attribute__((cleanup(trace_end))) TraceScope TRACE_CONCAT(trace_scope_, __LINE__) = trace_begin(name)
+
+// For phases that don't line up with a block.
+#define TRACE_BEGIN(var, name) TraceScope var = trace_begin(name)
+#define TRACE_END(var) trace_end(&var)
+
+#define TRACE_THREAD_NAME(name) trace_set_thread_name(name)
+#define TRACE_DUMP(path) trace_dump(path)
+
+#else
+
+#define TRACE_SCOPE(name)
+#define TRACE_BEGIN(var, name)
+#define TRACE_END(var)
+#define TRACE_THREAD_NAME(name)
+#define TRACE_DUMP(path)
+
+#endif
+
+#endif
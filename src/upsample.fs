@@ -0,0 +1,94 @@
+#version 330 core
+// Temporal upsampling for the raymarched viewport. The current frame was
+// marched into the lower-left renderScale part of `current`, with its
+// sample grid shifted by `jitter` texels so that over a few frames samples
+// land on every output pixel. Each output pixel follows its march distance
+// back into the previous frame's camera and blends the history found there
+// with the nearest current sample, weighted by how close that sample landed.
+// History that falls off screen or on a different surface is dropped, and
+// what is kept is clamped to the colors around the current sample so moving
+// edges don't smear. When the view has not changed since the history was
+// written, samples are instead averaged into it, which antialiases edges.
+
+out vec4 finalColor;
+
+uniform sampler2D current;   // rgb color, a = distance along the view ray
+uniform sampler2D history;   // previous output, same layout, full size
+uniform vec2 renderScale;
+uniform vec2 jitter;         // sample offset the march used, in its texels
+uniform vec2 viewportSize;   // pixels covered by the viewport
+uniform vec2 viewportOrigin; // window pixel of the viewport's corner
+uniform vec2 resolution;
+uniform vec3 viewEye;
+uniform vec3 viewCenter;
+uniform vec3 previousEye;
+uniform vec3 previousCenter;
+uniform float currentWeight; // weight of a sample on the pixel, 1 ignores the history
+uniform bool accumulate;     // history holds the same view at full resolution
+
+#define FAR_DEPTH 1000.0
+
+mat3 setCamera( in vec3 ro, in vec3 ta )
+{
+    vec3 cw = normalize(ta-ro);
+    vec3 cu = normalize( cross(cw,vec3(0.0,1.0,0.0)) );
+    vec3 cv = normalize( cross(cu,cw) );
+    return mat3( cu, cv, cw );
+}
+
+void main()
+{
+    vec2 used = viewportSize*renderScale;
+    vec2 low = gl_FragCoord.xy*renderScale - jitter;
+    vec2 size = vec2(textureSize(current, 0));
+
+    ivec2 texel = clamp(ivec2(floor(low)), ivec2(0), ivec2(used)-1);
+    vec4 nearest = texelFetch(current, texel, 0);
+    float depth = nearest.a;
+
+    // Distance in output pixels from this pixel to where the sample landed
+    vec2 offset = (vec2(texel) + 0.5 - low)/renderScale;
+    float closeness = exp( -2.0*dot(offset, offset) );
+
+    vec3 lo = nearest.rgb;
+    vec3 hi = nearest.rgb;
+    for( int y=-1; y<=1; y++ )
+    for( int x=-1; x<=1; x++ )
+    {
+        ivec2 neighbor = clamp(texel + ivec2(x,y), ivec2(0), ivec2(used)-1);
+        vec3 c = texelFetch(current, neighbor, 0).rgb;
+        lo = min(lo, c);
+        hi = max(hi, c);
+    }
+
+    // Without usable history the pixel is filtered from the current frame
+    vec3 color = texture(current, clamp(low, vec2(0.5), used-0.5)/size).rgb;
+
+    if( accumulate )
+    {
+        vec4 past = texelFetch(history, ivec2(gl_FragCoord.xy), 0);
+        color = mix(past.rgb, nearest.rgb, currentWeight);
+    }
+    else if( currentWeight<1.0 )
+    {
+        vec2 p = (-resolution + 2.0*(viewportOrigin + gl_FragCoord.xy))/resolution.y;
+        vec3 pos = viewEye + setCamera(viewEye, viewCenter)*normalize(vec3(p,2.0))*depth;
+
+        // Into the previous camera's frame, then back to a window pixel
+        vec3 q = (pos - previousEye)*setCamera(previousEye, previousCenter);
+        vec2 pp = 2.0*q.xy/q.z;
+        vec2 uv = ((pp*resolution.y + resolution)*0.5 - viewportOrigin)/viewportSize;
+
+        vec4 past = texture(history, uv);
+        float expected = depth<FAR_DEPTH ? length(pos - previousEye) : FAR_DEPTH;
+        bool onscreen = q.z>0.0 && all(greaterThanEqual(uv, vec2(0.0))) && all(lessThanEqual(uv, vec2(1.0)));
+        bool same_surface = abs(past.a - expected) < 0.05*expected;
+
+        if( onscreen && same_surface )
+        {
+            color = mix(clamp(past.rgb, lo, hi), nearest.rgb, currentWeight*closeness);
+        }
+    }
+
+    finalColor = vec4( color, depth );
+}
@@ -10,17 +10,84 @@
 #include "renderer.h"
 #include "microui.h"
 
-static  char logbuf[64000];
-static   int logbuf_updated = 0;
-static float bg[3] = { 90, 95, 100 };
+/* The log keeps its text in a ring of LOG_BYTES with an index of its lines,
+** so appending never touches older lines and the oldest ones are dropped
+** once either ring is full. Every line is stored contiguously */
+#define LOG_BYTES    65536
+#define LOG_LINES     4096
+#define LOG_LINE_MAX  1024
+
+typedef struct {
+  int start, len;
+  Uint32 time;  /* SDL_GetTicks when it was written */
+} LogLine;
+
+static    char log_text[LOG_BYTES];
+static LogLine log_lines[LOG_LINES];
+static     int log_cursor;     /* where the next line is written */
+static     int log_first;      /* oldest line held, counted from the first ever written */
+static     int log_end;        /* one past the newest line */
+static     int logbuf_updated = 0;
+static   float bg[3] = { 90, 95, 100 };
+
+static void log_line(const char *text, int len) {
+  len = mu_min(len, LOG_LINE_MAX);
+  int start = log_cursor;
+  int wrapped = start + len > LOG_BYTES;
+  if (wrapped) { start = 0; }
+
+  /* drop the oldest lines: those this one overwrites, and on a wrap the
+  ** ones left past the cursor, which are older than anything at the start */
+  while (log_first < log_end) {
+    LogLine *l = &log_lines[log_first % LOG_LINES];
+    int overlaps = l->start >= start && l->start < start + len;
+    if (!overlaps && !(wrapped && l->start >= log_cursor) && log_end - log_first < LOG_LINES) { break; }
+    log_first++;
+  }
+
+  memcpy(log_text + start, text, len);
+  log_lines[log_end++ % LOG_LINES] = (LogLine) { start, len, SDL_GetTicks() };
+  log_cursor = start + len;
+}
 
 /* Needed for logging */
 static void write_log(const char *text) {
-  if (logbuf[0]) { strcat(logbuf, "\n"); }
-  strcat(logbuf, text);
+  for (;;) {
+    const char *end = strchr(text, '\n');
+    log_line(text, end ? end - text : (int) strlen(text));
+    if (!end) { break; }
+    text = end + 1;
+  }
   logbuf_updated = 1;
 }
 
+/* Lays out only the lines the panel shows. Spacers stand in for the lines
+** above and below so the content size, and with it the scrollbar, still
+** covers the whole log */
+static void log_lines_visible(mu_Context *ctx, mu_Container *panel) {
+  int height = ctx->text_height(ctx->style->font);
+  int pitch = height + ctx->style->spacing;
+  int count = log_end - log_first;
+  int first = mu_min(count, mu_max(0, panel->scroll.y / pitch));
+  int last = mu_min(count, (panel->scroll.y + panel->body.h) / pitch + 1);
+
+  if (first > 0) {
+    mu_layout_row(ctx, 1, (int[]) { -1 }, first * pitch - ctx->style->spacing);
+    mu_layout_next(ctx);
+  }
+  for (int i = first; i < last; i++) {
+    LogLine *l = &log_lines[(log_first + i) % LOG_LINES];
+    char line[LOG_LINE_MAX + 32];
+    snprintf(line, sizeof(line), "[%u.%03u] %.*s", l->time / 1000, l->time % 1000, l->len, log_text + l->start);
+    mu_layout_row(ctx, 1, (int[]) { -1 }, height);
+    mu_label(ctx, line);
+  }
+  if (last < count) {
+    mu_layout_row(ctx, 1, (int[]) { -1 }, (count - last) * pitch - ctx->style->spacing);
+    mu_layout_next(ctx);
+  }
+}
+
 /* Slider template code */
 static int uint8_slider(mu_Context *ctx, unsigned char *value, int low, int high) {
   static float tmp;
@@ -39,8 +106,7 @@ static void log_window(mu_Context *ctx) {
     mu_layout_row(ctx, 1, (int[]) { -1 }, -25);
     mu_begin_panel(ctx, "Log Output");
     mu_Container *panel = mu_get_current_container(ctx);
-    mu_layout_row(ctx, 1, (int[]) { -1 }, -1);
-    mu_text(ctx, logbuf);
+    log_lines_visible(ctx, panel);
     mu_end_panel(ctx);
     if (logbuf_updated) {
       panel->scroll.y = panel->content_size.y;
@@ -121,6 +187,12 @@ int main(int argc, char **argv) {
         case SDL_MOUSEWHEEL: mu_input_scroll(ctx, 0, e.wheel.y * -30); break;
         case SDL_TEXTINPUT: mu_input_text(ctx, e.text.text); break;
 
+        /* the window lost what was drawn, redraw it even if nothing changed */
+        case SDL_WINDOWEVENT:
+          if (e.window.event == SDL_WINDOWEVENT_EXPOSED ||
+              e.window.event == SDL_WINDOWEVENT_SIZE_CHANGED) { r_invalidate(); }
+          break;
+
         case SDL_MOUSEBUTTONDOWN:
         case SDL_MOUSEBUTTONUP: {
           int b = button_map[e.button.button & 0xff];
@@ -142,18 +214,10 @@ int main(int argc, char **argv) {
     /* process frame */
     process_frame(ctx);
 
-    /* render */
-    r_clear(mu_color(bg[0], bg[1], bg[2], 255));
-    mu_Command *cmd = NULL;
-    while (mu_next_command(ctx, &cmd)) {
-      switch (cmd->type) {
-        case MU_COMMAND_TEXT: r_draw_text(cmd->text.str, cmd->text.pos, cmd->text.color); break;
-        case MU_COMMAND_RECT: r_draw_rect(cmd->rect.rect, cmd->rect.color); break;
-        case MU_COMMAND_ICON: r_draw_icon(cmd->icon.id, cmd->icon.rect, cmd->icon.color); break;
-        case MU_COMMAND_CLIP: r_set_clip_rect(cmd->clip.rect); break;
-      }
+    /* render, or sleep until the next event when nothing changed */
+    if (!r_draw_frame(ctx, mu_color(bg[0], bg[1], bg[2], 255))) {
+      SDL_WaitEventTimeout(NULL, 100);
     }
-    r_present();
   }
 
   return 0;
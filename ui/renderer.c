@@ -8,10 +8,13 @@
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_opengl.h>
 #include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
 #include "renderer.h"
 #include "atlas.inl"
 
 #define BUFFER_SIZE 16384
+#define RING_REGIONS 3
 
 static GLfloat   tex_buf[BUFFER_SIZE *  8];
 static GLfloat  vert_buf[BUFFER_SIZE *  8];
@@ -24,11 +27,222 @@ static int buf_idx;
 
 static SDL_Window *window;
 
+/* Core profile path: quads are written straight into a persistently mapped
+** ring of RING_REGIONS regions of BUFFER_SIZE quads, drawn with one static
+** index buffer. Clip rects only start a new draw in the draw list, so a
+** frame goes out as one draw per distinct clip when it is presented. A
+** fence per region keeps the CPU from writing over quads the GPU has not
+** drawn yet. Without a 4.4 context the fixed function path below is used */
+typedef struct {
+  GLfloat x, y, u, v;
+  GLubyte color[4];
+} Vertex;
+
+typedef struct {
+  int first, count;  /* quads from the start of the region */
+  mu_Rect clip;
+} Draw;
+
+#define CORE_GL_FUNCS(X) \
+  X(PFNGLGENBUFFERSPROC,             glGenBuffers)             \
+  X(PFNGLBINDBUFFERPROC,             glBindBuffer)             \
+  X(PFNGLBUFFERDATAPROC,             glBufferData)             \
+  X(PFNGLBUFFERSTORAGEPROC,          glBufferStorage)          \
+  X(PFNGLMAPBUFFERRANGEPROC,         glMapBufferRange)         \
+  X(PFNGLGENVERTEXARRAYSPROC,        glGenVertexArrays)        \
+  X(PFNGLBINDVERTEXARRAYPROC,        glBindVertexArray)        \
+  X(PFNGLENABLEVERTEXATTRIBARRAYPROC, glEnableVertexAttribArray) \
+  X(PFNGLVERTEXATTRIBPOINTERPROC,    glVertexAttribPointer)    \
+  X(PFNGLCREATESHADERPROC,           glCreateShader)           \
+  X(PFNGLSHADERSOURCEPROC,           glShaderSource)           \
+  X(PFNGLCOMPILESHADERPROC,          glCompileShader)          \
+  X(PFNGLGETSHADERIVPROC,            glGetShaderiv)            \
+  X(PFNGLDELETESHADERPROC,           glDeleteShader)           \
+  X(PFNGLCREATEPROGRAMPROC,          glCreateProgram)          \
+  X(PFNGLATTACHSHADERPROC,           glAttachShader)           \
+  X(PFNGLBINDATTRIBLOCATIONPROC,     glBindAttribLocation)     \
+  X(PFNGLLINKPROGRAMPROC,            glLinkProgram)            \
+  X(PFNGLGETPROGRAMIVPROC,           glGetProgramiv)           \
+  X(PFNGLUSEPROGRAMPROC,             glUseProgram)             \
+  X(PFNGLGETUNIFORMLOCATIONPROC,     glGetUniformLocation)     \
+  X(PFNGLUNIFORM2FPROC,              glUniform2f)              \
+  X(PFNGLDRAWELEMENTSBASEVERTEXPROC, glDrawElementsBaseVertex) \
+  X(PFNGLFENCESYNCPROC,              glFenceSync)              \
+  X(PFNGLCLIENTWAITSYNCPROC,         glClientWaitSync)         \
+  X(PFNGLDELETESYNCPROC,             glDeleteSync)
+
+#define DECLARE_GL_FUNC(type, name) static type p##name;
+CORE_GL_FUNCS(DECLARE_GL_FUNC)
+
+static const char *vertex_source =
+  "#version 330 core\n"
+  "uniform vec2 screen;\n"
+  "in vec2 position;\n"
+  "in vec2 texcoord;\n"
+  "in vec4 color;\n"
+  "out vec2 uv;\n"
+  "out vec4 tint;\n"
+  "void main() {\n"
+  "  uv = texcoord;\n"
+  "  tint = color;\n"
+  "  gl_Position = vec4(position.x * 2.0 / screen.x - 1.0, 1.0 - position.y * 2.0 / screen.y, 0.0, 1.0);\n"
+  "}\n";
+
+/* the atlas only has coverage, as the GL_ALPHA texture of the old path */
+static const char *fragment_source =
+  "#version 330 core\n"
+  "uniform sampler2D atlas;\n"
+  "in vec2 uv;\n"
+  "in vec4 tint;\n"
+  "out vec4 frag;\n"
+  "void main() {\n"
+  "  frag = vec4(tint.rgb, tint.a * texture(atlas, uv).r);\n"
+  "}\n";
+
+static int core;
+static GLuint program;
+static GLint screen_loc;
+static Vertex *ring;
+static GLsync fences[RING_REGIONS];
+static int region;
+static Draw draws[BUFFER_SIZE + 1];
+static int draw_count;
+static mu_Rect clip_rect;
+
+/* Retained UI: every root container's commands are hashed each frame. When
+** nothing hashes differently from the last frame no drawing is done at all,
+** otherwise containers that did not change replay the quads recorded the
+** last time they were drawn (core path only) */
+typedef struct {
+  int quad;  /* quads recorded before the clip changed */
+  mu_Rect clip;
+} ClipMark;
+
+typedef struct {
+  uint64_t hash;
+  int valid;
+  Vertex *quads;  /* 4 vertices per quad */
+  int quad_count, quad_capacity;
+  ClipMark *clips;
+  int clip_count, clip_capacity;
+} ContainerCache;
+
+static ContainerCache container_cache[MU_CONTAINERPOOL_SIZE];
+static ContainerCache *recording;
+static int frame_order[MU_CONTAINERPOOL_SIZE];
+static int frame_order_count = -1;
+static mu_Color frame_clear;
+
+static GLuint compile_shader(GLenum type, const char *source) {
+  GLuint shader = pglCreateShader(type);
+  GLint ok;
+  pglShaderSource(shader, 1, &source, NULL);
+  pglCompileShader(shader);
+  pglGetShaderiv(shader, GL_COMPILE_STATUS, &ok);
+  return ok ? shader : 0;
+}
+
+/* Two triangles per quad, shared by every flush on either path */
+static void init_indices(void) {
+  for (int i = 0; i < BUFFER_SIZE; i++) {
+    GLuint *index = index_buf + i * 6;
+    index[0] = i * 4 + 0;
+    index[1] = i * 4 + 1;
+    index[2] = i * 4 + 2;
+    index[3] = i * 4 + 2;
+    index[4] = i * 4 + 3;
+    index[5] = i * 4 + 1;
+  }
+}
+
+/* Returns 0 when the context can't run the core path */
+static int init_core(void) {
+  /* copied rather than cast, ISO C has no object to function pointer cast */
+  void *proc;
+#define LOAD_GL_FUNC(type, name) \
+  if (!(proc = SDL_GL_GetProcAddress(#name))) { return 0; } \
+  memcpy(&p##name, &proc, sizeof(proc));
+  CORE_GL_FUNCS(LOAD_GL_FUNC)
+#undef LOAD_GL_FUNC
+
+  GLuint vs = compile_shader(GL_VERTEX_SHADER, vertex_source);
+  GLuint fs = compile_shader(GL_FRAGMENT_SHADER, fragment_source);
+  if (!vs || !fs) { return 0; }
+  program = pglCreateProgram();
+  pglAttachShader(program, vs);
+  pglAttachShader(program, fs);
+  pglBindAttribLocation(program, 0, "position");
+  pglBindAttribLocation(program, 1, "texcoord");
+  pglBindAttribLocation(program, 2, "color");
+  pglLinkProgram(program);
+  pglDeleteShader(vs);
+  pglDeleteShader(fs);
+  GLint ok;
+  pglGetProgramiv(program, GL_LINK_STATUS, &ok);
+  if (!ok) { return 0; }
+  screen_loc = pglGetUniformLocation(program, "screen");
+
+  /* every region uses the same indices, offset with a base vertex */
+  GLuint vao, buffers[2];
+  pglGenVertexArrays(1, &vao);
+  pglBindVertexArray(vao);
+  pglGenBuffers(2, buffers);
+  init_indices();
+  pglBindBuffer(GL_ELEMENT_ARRAY_BUFFER, buffers[1]);
+  pglBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(index_buf), index_buf, GL_STATIC_DRAW);
+
+  GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+  GLsizeiptr size = sizeof(Vertex) * 4 * BUFFER_SIZE * RING_REGIONS;
+  pglBindBuffer(GL_ARRAY_BUFFER, buffers[0]);
+  pglBufferStorage(GL_ARRAY_BUFFER, size, NULL, flags);
+  ring = pglMapBufferRange(GL_ARRAY_BUFFER, 0, size, flags);
+  if (!ring) { return 0; }
+
+  pglEnableVertexAttribArray(0);
+  pglEnableVertexAttribArray(1);
+  pglEnableVertexAttribArray(2);
+  pglVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void *) offsetof(Vertex, x));
+  pglVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void *) offsetof(Vertex, u));
+  pglVertexAttribPointer(2, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(Vertex), (void *) offsetof(Vertex, color));
+
+  /* init gl */
+  glEnable(GL_BLEND);
+  glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+  glDisable(GL_CULL_FACE);
+  glDisable(GL_DEPTH_TEST);
+  glEnable(GL_SCISSOR_TEST);
+
+  /* init texture */
+  GLuint id;
+  glGenTextures(1, &id);
+  glBindTexture(GL_TEXTURE_2D, id);
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, ATLAS_WIDTH, ATLAS_HEIGHT, 0,
+    GL_RED, GL_UNSIGNED_BYTE, atlas_texture);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+  clip_rect = mu_rect(0, 0, width, height);
+  draws[0] = (Draw) { 0, 0, clip_rect };
+  draw_count = 1;
+  return glGetError() == 0;
+}
+
 void r_init(void) {
-  /* init SDL window */
+  /* init SDL window, asking for a context the core path can use */
+  SDL_GL_SetAttribute(SDL_GL_CONTEXT_PROFILE_MASK, SDL_GL_CONTEXT_PROFILE_CORE);
+  SDL_GL_SetAttribute(SDL_GL_CONTEXT_MAJOR_VERSION, 4);
+  SDL_GL_SetAttribute(SDL_GL_CONTEXT_MINOR_VERSION, 4);
   window = SDL_CreateWindow(
     NULL, SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED,
     width, height, SDL_WINDOW_OPENGL);
+  SDL_GLContext context = SDL_GL_CreateContext(window);
+  if (context && init_core()) {
+    core = 1;
+    return;
+  }
+  if (context) { SDL_GL_DeleteContext(context); }
+  SDL_GL_ResetAttributes();
   SDL_GL_CreateContext(window);
 
   /* init gl */
@@ -42,6 +256,9 @@ void r_init(void) {
   glEnableClientState(GL_TEXTURE_COORD_ARRAY);
   glEnableClientState(GL_COLOR_ARRAY);
 
+  /* init index buffer, the same for every flush */
+  init_indices();
+
   /* init texture */
   GLuint id;
   glGenTextures(1, &id);
@@ -53,8 +270,36 @@ void r_init(void) {
   assert(glGetError() == 0);
 }
 
+/* Submits the region's draws, then moves on to the next region once the
+** GPU has finished with it */
+static void flush_core(void) {
+  glViewport(0, 0, width, height);
+  pglUseProgram(program);
+  pglUniform2f(screen_loc, width, height);
+  for (int i = 0; i < draw_count; i++) {
+    Draw *d = &draws[i];
+    if (d->count == 0) { continue; }
+    glScissor(d->clip.x, height - (d->clip.y + d->clip.h), d->clip.w, d->clip.h);
+    pglDrawElementsBaseVertex(GL_TRIANGLES, d->count * 6, GL_UNSIGNED_INT,
+      (void *) (d->first * 6 * sizeof(GLuint)), region * BUFFER_SIZE * 4);
+  }
+
+  fences[region] = pglFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+  region = (region + 1) % RING_REGIONS;
+  if (fences[region]) {
+    pglClientWaitSync(fences[region], GL_SYNC_FLUSH_COMMANDS_BIT, UINT64_MAX);
+    pglDeleteSync(fences[region]);
+    fences[region] = 0;
+  }
+
+  buf_idx = 0;
+  draws[0] = (Draw) { 0, 0, clip_rect };
+  draw_count = 1;
+}
+
 static void flush(void) {
   if (buf_idx == 0) { return; }
+  if (core) { flush_core(); return; }
 
   glViewport(0, 0, width, height);
   glMatrixMode(GL_PROJECTION);
@@ -78,13 +323,60 @@ static void flush(void) {
   buf_idx = 0;
 }
 
+static void record_quad(const Vertex *v) {
+  ContainerCache *c = recording;
+  if (c->quad_count == c->quad_capacity) {
+    c->quad_capacity = c->quad_capacity ? c->quad_capacity * 2 : 256;
+    c->quads = realloc(c->quads, sizeof(Vertex) * 4 * c->quad_capacity);
+  }
+  memcpy(c->quads + c->quad_count++ * 4, v, sizeof(Vertex) * 4);
+}
+
+static void record_clip(mu_Rect rect) {
+  ContainerCache *c = recording;
+  if (c->clip_count == c->clip_capacity) {
+    c->clip_capacity = c->clip_capacity ? c->clip_capacity * 2 : 16;
+    c->clips = realloc(c->clips, sizeof(ClipMark) * c->clip_capacity);
+  }
+  c->clips[c->clip_count++] = (ClipMark) { c->quad_count, rect };
+}
+
+static void push_quad_core(mu_Rect dst, mu_Rect src, mu_Color color) {
+  float x = src.x / (float) ATLAS_WIDTH;
+  float y = src.y / (float) ATLAS_HEIGHT;
+  float w = src.w / (float) ATLAS_WIDTH;
+  float h = src.h / (float) ATLAS_HEIGHT;
+  Vertex v[4] = {
+    { dst.x,         dst.y,         x,     y,     { color.r, color.g, color.b, color.a } },
+    { dst.x + dst.w, dst.y,         x + w, y,     { color.r, color.g, color.b, color.a } },
+    { dst.x,         dst.y + dst.h, x,     y + h, { color.r, color.g, color.b, color.a } },
+    { dst.x + dst.w, dst.y + dst.h, x + w, y + h, { color.r, color.g, color.b, color.a } },
+  };
+  memcpy(ring + (region * BUFFER_SIZE + buf_idx) * 4, v, sizeof(v));
+  draws[draw_count - 1].count++;
+  buf_idx++;
+  if (recording) { record_quad(v); }
+}
+
+/* Copies already built quads into the ring */
+static void push_quads_core(const Vertex *v, int n) {
+  while (n > 0) {
+    if (buf_idx == BUFFER_SIZE) { flush(); }
+    int k = mu_min(n, BUFFER_SIZE - buf_idx);
+    memcpy(ring + (region * BUFFER_SIZE + buf_idx) * 4, v, sizeof(Vertex) * 4 * k);
+    draws[draw_count - 1].count += k;
+    buf_idx += k;
+    v += k * 4;
+    n -= k;
+  }
+}
+
 static void push_quad(mu_Rect dst, mu_Rect src, mu_Color color) {
   if (buf_idx == BUFFER_SIZE) { flush(); }
+  if (core) { push_quad_core(dst, src, color); return; }
 
   int texvert_idx = buf_idx *  8;
   int   color_idx = buf_idx * 16;
-  int element_idx = buf_idx *  4;
-  int   index_idx = buf_idx *  6;
   buf_idx++;
 
   /* update texture buffer */
@@ -116,14 +408,6 @@ static void push_quad(mu_Rect dst, mu_Rect src, mu_Color color) {
   memcpy(color_buf + color_idx +  4, &color, 4);
   memcpy(color_buf + color_idx +  8, &color, 4);
   memcpy(color_buf + color_idx + 12, &color, 4);
-
-  /* update index buffer */
-  index_buf[index_idx + 0] = element_idx + 0;
-  index_buf[index_idx + 1] = element_idx + 1;
-  index_buf[index_idx + 2] = element_idx + 2;
-  index_buf[index_idx + 3] = element_idx + 2;
-  index_buf[index_idx + 4] = element_idx + 3;
-  index_buf[index_idx + 5] = element_idx + 1;
 }
 
 void r_draw_rect(mu_Rect rect, mu_Color color) {
@@ -165,6 +449,18 @@ int r_get_text_height(void) {
 }
 
 void r_set_clip_rect(mu_Rect rect) {
+  if (core) {
+    if (recording) { record_clip(rect); }
+    /* a draw with no quads yet just takes the new clip */
+    Draw *d = &draws[draw_count - 1];
+    clip_rect = rect;
+    if (d->count == 0) {
+      d->clip = rect;
+    } else if (memcmp(&d->clip, &rect, sizeof(rect)) != 0) {
+      draws[draw_count++] = (Draw) { buf_idx, 0, rect };
+    }
+    return;
+  }
   flush();
   glScissor(rect.x, height - (rect.y + rect.h), rect.w, rect.h);
 }
@@ -172,10 +468,100 @@ void r_set_clip_rect(mu_Rect rect) {
 void r_clear(mu_Color clr) {
   flush();
   glClearColor(clr.r / 255., clr.g / 255., clr.b / 255., clr.a / 255.);
+  /* the scissor is still the last clip drawn, the clear is for the window */
+  glDisable(GL_SCISSOR_TEST);
   glClear(GL_COLOR_BUFFER_BIT);
+  glEnable(GL_SCISSOR_TEST);
 }
 
 void r_present(void) {
   flush();
   SDL_GL_SwapWindow(window);
-}
\ No newline at end of file
+}
+
+
+/* Container commands run from just after the head jump to the tail jump. A
+** nested root container (a popup opened inside a window) sits in between,
+** and its head jump skips over it */
+#define container_first(cnt) ((mu_Command *) ((char *) (cnt)->head + sizeof(mu_JumpCommand)))
+#define container_next(cmd) ((cmd)->type == MU_COMMAND_JUMP ? (mu_Command *) (cmd)->jump.dst \
+                                                           : (mu_Command *) ((char *) (cmd) + (cmd)->base.size))
+
+/* FNV-1a over the container's commands */
+static uint64_t hash_container(mu_Container *cnt) {
+  uint64_t hash = 14695981039346656037ull;
+  for (mu_Command *cmd = container_first(cnt); cmd != cnt->tail; cmd = container_next(cmd)) {
+    if (cmd->type == MU_COMMAND_JUMP) { continue; }
+    const unsigned char *p = (const unsigned char *) cmd;
+    for (int i = 0; i < cmd->base.size; i++) {
+      hash = (hash ^ p[i]) * 1099511628211ull;
+    }
+  }
+  return hash;
+}
+
+static void draw_container(mu_Container *cnt) {
+  for (mu_Command *cmd = container_first(cnt); cmd != cnt->tail; cmd = container_next(cmd)) {
+    switch (cmd->type) {
+      case MU_COMMAND_TEXT: r_draw_text(cmd->text.str, cmd->text.pos, cmd->text.color); break;
+      case MU_COMMAND_RECT: r_draw_rect(cmd->rect.rect, cmd->rect.color); break;
+      case MU_COMMAND_ICON: r_draw_icon(cmd->icon.id, cmd->icon.rect, cmd->icon.color); break;
+      case MU_COMMAND_CLIP: r_set_clip_rect(cmd->clip.rect); break;
+    }
+  }
+}
+
+static void replay_container(ContainerCache *c) {
+  int quad = 0;
+  for (int i = 0; i < c->clip_count; i++) {
+    push_quads_core(c->quads + quad * 4, c->clips[i].quad - quad);
+    quad = c->clips[i].quad;
+    r_set_clip_rect(c->clips[i].clip);
+  }
+  push_quads_core(c->quads + quad * 4, c->quad_count - quad);
+}
+
+/* Drops every recorded container so the next r_draw_frame redraws from
+** scratch, for when the window contents were lost or resized */
+void r_invalidate(void) {
+  for (int i = 0; i < MU_CONTAINERPOOL_SIZE; i++) {
+    container_cache[i].valid = 0;
+  }
+  frame_order_count = -1;
+}
+
+int r_draw_frame(mu_Context *ctx, mu_Color clear) {
+  int n = ctx->root_list.idx;
+  int order[MU_CONTAINERPOOL_SIZE];
+  uint64_t hashes[MU_CONTAINERPOOL_SIZE];
+  int changed = n != frame_order_count || memcmp(&clear, &frame_clear, sizeof(clear)) != 0;
+  for (int i = 0; i < n; i++) {
+    mu_Container *cnt = ctx->root_list.items[i];
+    order[i] = cnt - ctx->containers;
+    hashes[i] = hash_container(cnt);
+    ContainerCache *c = &container_cache[order[i]];
+    if (!c->valid || c->hash != hashes[i] || (!changed && frame_order[i] != order[i])) { changed = 1; }
+  }
+  if (!changed) { return 0; }
+
+  r_clear(clear);
+  for (int i = 0; i < n; i++) {
+    ContainerCache *c = &container_cache[order[i]];
+    if (core && c->valid && c->hash == hashes[i]) {
+      replay_container(c);
+      continue;
+    }
+    c->quad_count = c->clip_count = 0;
+    recording = core ? c : NULL;
+    draw_container(ctx->root_list.items[i]);
+    recording = NULL;
+    c->hash = hashes[i];
+    c->valid = 1;
+  }
+  r_present();
+
+  memcpy(frame_order, order, sizeof(int) * n);
+  frame_order_count = n;
+  frame_clear = clear;
+  return 1;
+}
@@ -19,5 +19,7 @@ void r_draw_icon(int id, mu_Rect rect, mu_Color color);
 void r_set_clip_rect(mu_Rect rect);
 void r_clear(mu_Color color);
 void r_present(void);
+ int r_draw_frame(mu_Context *ctx, mu_Color clear);
+void r_invalidate(void);
 
 #endif
\ No newline at end of file